@@ -0,0 +1,502 @@
+/*
+* Host Benchmark: codecs, the streaming copy path and the raw partition log over generated sensor CSVs.
+* Flash/SD paths are plain host directories. Knobs (environment):
+*   SDCLOUD_BENCH_DIR     work directory (default ./bench_data)
+*   SDCLOUD_BENCH_MAX_MB  largest dataset to generate, 100 KB .. 100 MB (default 100)
+*   SDCLOUD_BENCH_WORKERS comma-separated compression worker counts to run each codec with (default 1);
+*                         rows for more than one worker are labelled "<codec>/<n>w"
+* Reports MB/s, bytes/row, compression ratio, peak heap and lock hold time (total and longest single hold) per codec.
+* Before the table, a check that no rows are lost when the checkpoint goes missing after input was reclaimed.
+* Every decode is compared with its input value by value. Any mismatch, failed run or failed check makes the exit
+* status non-zero.
+*/
+#include "compression.h"
+#include "codec.h"
+#include "stream_copy.h"
+#include "transfer.h"
+#include "rawlog.h"
+#include "metrics.h"
+#include "csv_field.h"
+#include "global.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SemaphoreHandle_t spi_flash_lock = NULL;
+
+/* Heap Accounting (linked with -Wl,--wrap=malloc,calloc,realloc,free). */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+/* Atomic: encoder tasks allocate while the bench thread does. */
+static _Atomic long s_heap_cur = 0;
+static _Atomic long s_heap_peak = 0;
+
+static void heap_add(long delta) {
+    long cur = atomic_fetch_add(&s_heap_cur, delta) + delta;
+    long peak = atomic_load(&s_heap_peak);
+    while (cur > peak && !atomic_compare_exchange_weak(&s_heap_peak, &peak, cur)) {
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    void *p = __real_malloc(size);
+    if (p) {
+        heap_add((long)malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    void *p = __real_calloc(n, size);
+    if (p) {
+        heap_add((long)malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *__wrap_realloc(void *old, size_t size) {
+    long before = old ? (long)malloc_usable_size(old) : 0;
+    void *p = __real_realloc(old, size);
+    if (p) {
+        heap_add((long)malloc_usable_size(p) - before);
+    }
+    return p;
+}
+
+void __wrap_free(void *p) {
+    if (p) {
+        heap_add(-(long)malloc_usable_size(p));
+    }
+    __real_free(p);
+}
+
+/* Peak bytes allocated since the last reset. */
+static void heap_reset(void) {
+    atomic_store(&s_heap_peak, atomic_load(&s_heap_cur));
+}
+
+static long heap_peak(void) {
+    return atomic_load(&s_heap_peak) - atomic_load(&s_heap_cur);
+}
+
+/* Dataset Generation. */
+
+typedef struct {
+    size_t bytes;
+    int    cols;
+    int    noise; /* 0: constant, 1: slow random walk, 2: uniform random */
+} bench_case_t;
+
+static uint32_t s_rng;
+
+static uint32_t rng_next(void) {
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+/* Rows shaped like append_line() / real sensors: "<ms timestamp>,<v1>,...". Returns rows written. */
+static size_t generate_csv(const char *path, const bench_case_t *c) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return 0;
+    }
+    s_rng = 0x9E3779B9u ^ (uint32_t)(c->bytes + c->cols * 31 + c->noise);
+    long values[32];
+    for (int i = 0; i < c->cols; i++) {
+        values[i] = 1000 + (long)(rng_next() % 5000);
+    }
+    unsigned long ts = 1000;
+    size_t written = 0;
+    size_t rows = 0;
+    char line[512];
+    while (written < c->bytes) {
+        ts += 750 + (c->noise ? rng_next() % 3 : 0);
+        int n = snprintf(line, sizeof(line), "%lu", ts);
+        for (int i = 0; i < c->cols; i++) {
+            if (c->noise == 1 && rng_next() % 3 == 0) {
+                values[i] += (long)(rng_next() % 5) - 2;
+            } else if (c->noise == 2) {
+                values[i] = (long)(rng_next() % 100000);
+            }
+            /* The walk can cross zero: sign first, so -0.05 is not printed as "0.-5". */
+            n += snprintf(line + n, sizeof(line) - (size_t)n, ",%s%ld.%02ld", values[i] < 0 ? "-" : "",
+                          labs(values[i]) / 100, labs(values[i]) % 100);
+        }
+        line[n++] = '\n';
+        fwrite(line, 1, (size_t)n, f);
+        written += (size_t)n;
+        rows++;
+    }
+    fclose(f);
+    return rows;
+}
+
+/* Set by any failed run, decode mismatch or check: the exit status. */
+static bool s_failed = false;
+
+/*
+* Same field: the same text, or two decimals of the same value. Codecs may pad ("21.25" as "21.250") or shorten
+* ("20.50" as "20.5") a number (see compression.h).
+*/
+static bool field_same(const char *a, size_t alen, const char *b, size_t blen) {
+    if (alen == blen && memcmp(a, b, alen) == 0) {
+        return true;
+    }
+    int64_t am, bm;
+    int ad, bd;
+    if (csv_parse_decimal(a, a + alen, &am, &ad) != CSV_FIELD_OK || csv_parse_decimal(b, b + blen, &bm, &bd) != CSV_FIELD_OK) {
+        return false;
+    }
+    for (; ad < bd; ad++) {
+        if (__builtin_mul_overflow(am, 10, &am)) {
+            return false;
+        }
+    }
+    for (; bd < ad; bd++) {
+        if (__builtin_mul_overflow(bm, 10, &bm)) {
+            return false;
+        }
+    }
+    return am == bm;
+}
+
+static bool row_same(const char *a, size_t alen, const char *b, size_t blen) {
+    const char *ae = a + alen, *be = b + blen;
+    for (;;) {
+        const char *an = memchr(a, ',', (size_t)(ae - a));
+        const char *bn = memchr(b, ',', (size_t)(be - b));
+        an = an ? an : ae;
+        bn = bn ? bn : be;
+        if (!field_same(a, (size_t)(an - a), b, (size_t)(bn - b))) {
+            return false;
+        }
+        if (an == ae || bn == be) {
+            return an == ae && bn == be;
+        }
+        a = an + 1;
+        b = bn + 1;
+    }
+}
+
+/* Whether the decoded file holds the input's rows, value for value. */
+static bool rows_same(const char *in_path, const char *dec_path) {
+    FILE *a = fopen(in_path, "rb");
+    FILE *b = fopen(dec_path, "rb");
+    char *la = NULL, *lb = NULL;
+    size_t ca = 0, cb = 0;
+    bool same = a && b;
+    while (same) {
+        ssize_t na = getline(&la, &ca, a);
+        ssize_t nb = getline(&lb, &cb, b);
+        if (na < 0 || nb < 0) {
+            same = na < 0 && nb < 0;
+            break;
+        }
+        na -= na > 0 && la[na - 1] == '\n';
+        nb -= nb > 0 && lb[nb - 1] == '\n';
+        same = row_same(la, (size_t)na, lb, (size_t)nb);
+    }
+    free(la);
+    free(lb);
+    if (a) {
+        fclose(a);
+    }
+    if (b) {
+        fclose(b);
+    }
+    return same;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static double mb_per_s(long bytes, int64_t us) {
+    return us > 0 ? ((double)bytes / (1024.0 * 1024.0)) / ((double)us / 1e6) : 0.0;
+}
+
+/* Runners. */
+
+static void bench_codec(const char *dir, const char *csv, long csv_bytes, size_t rows, const char *label, const char *algo, int workers) {
+    char out[128], ckpt[136], dec[128], name[16];
+    snprintf(name, sizeof(name), workers > 1 ? "%s/%dw" : "%s", algo, workers);
+    compression_set_workers(workers);
+    snprintf(out, sizeof(out), "%s/out.bin", dir);
+    snprintf(ckpt, sizeof(ckpt), "%s.ckpt", out);
+    snprintf(dec, sizeof(dec), "%s/decoded.csv", dir);
+    remove(out);
+    remove(ckpt);
+
+    heap_reset();
+    uint32_t logical = metrics_get_counter(METRIC_FLASH_LOGICAL_BYTES);
+    uint32_t physical = metrics_get_counter(METRIC_FLASH_PHYSICAL_BYTES);
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = compression_run_once(csv, out, algo);
+    int64_t enc_us = esp_timer_get_time() - t0;
+    long peak = heap_peak();
+    /* Write amplification of the encode: estimated bytes programmed per byte written (see page_write.h). */
+    logical = metrics_get_counter(METRIC_FLASH_LOGICAL_BYTES) - logical;
+    physical = metrics_get_counter(METRIC_FLASH_PHYSICAL_BYTES) - physical;
+    compression_stats_t st;
+    compression_get_stats(&st);
+    if (err != ESP_OK) {
+        printf("%-22s %-10s FAILED (%d)\n", label, name, err);
+        s_failed = true;
+        return;
+    }
+
+    t0 = esp_timer_get_time();
+    err = compression_decode_file(out, dec, algo);
+    int64_t dec_us = esp_timer_get_time() - t0;
+    const char *verdict = "";
+    if (err != ESP_OK) {
+        verdict = "  (decode failed)";
+    } else if (!rows_same(csv, dec)) {
+        verdict = "  (decode mismatch)";
+    }
+    s_failed |= *verdict != '\0';
+
+    long out_bytes = file_size(out);
+    printf("%-22s %-10s %9.2f %10.1f %7.2f %7.2f %9.1f %9.1f %8.1f %9.1f %9.2f %6.2f%s\n",
+           label, name,
+           csv_bytes / (1024.0 * 1024.0),
+           out_bytes / 1024.0,
+           out_bytes > 0 ? (double)csv_bytes / (double)out_bytes : 0.0,
+           rows ? (double)out_bytes / (double)rows : 0.0,
+           mb_per_s(csv_bytes, enc_us),
+           err == ESP_OK ? mb_per_s(csv_bytes, dec_us) : 0.0,
+           peak / 1024.0,
+           st.lock_hold_us / 1000.0,
+           st.lock_hold_max_us / 1000.0,
+           logical ? (double)physical / (double)logical : 0.0,
+           verdict);
+    remove(dec);
+}
+
+static void bench_copy(const char *dir, const char *csv, long csv_bytes, const char *label) {
+    char dst[128];
+    snprintf(dst, sizeof(dst), "%s/copy.csv", dir);
+    heap_reset();
+    int64_t t0 = esp_timer_get_time();
+    size_t copied = 0;
+    esp_err_t err = stream_copy_file(csv, dst, &copied);
+    int64_t us = esp_timer_get_time() - t0;
+    printf("%-22s %-10s %9.2f %10s %7s %7s %9.1f %9s %8.1f %9s %9s %6s%s\n",
+           label, "copy", csv_bytes / (1024.0 * 1024.0), "-", "-", "-",
+           mb_per_s((long)copied, us), "-", heap_peak() / 1024.0, "-", "-", "-",
+           err == ESP_OK ? "" : "  (failed)");
+    s_failed |= err != ESP_OK;
+    remove(dst);
+
+    /* Same copy through the pipelined transfer engine (reader task + writer, ping-pong buffers). */
+    heap_reset();
+    transfer_stats_t st = { 0 };
+    err = transfer_file(csv, dst, false, NULL, &st);
+    printf("%-22s %-10s %9.2f %10s %7s %7s %9.1f %9s %8.1f %9s %9s %6s%s\n",
+           label, "transfer", csv_bytes / (1024.0 * 1024.0), "-", "-", "-",
+           mb_per_s((long)st.bytes, st.us), "-", heap_peak() / 1024.0, "-", "-", "-",
+           err == ESP_OK ? "" : "  (failed)");
+    s_failed |= err != ESP_OK;
+    remove(dst);
+}
+
+/*
+* Same data appended to the raw partition log (esp_partition emulation on the Linux target) and read back
+* zero-copy. enc/dec columns are append/read MB/s; reads cover what the partition still holds after wrapping.
+*/
+static void bench_rawlog(rawlog_t *log, const char *csv, long csv_bytes, const char *label) {
+    FILE *in = fopen(csv, "rb");
+    esp_err_t err = in && rawlog_format(log) == ESP_OK ? ESP_OK : ESP_FAIL;
+    char rec[RAWLOG_DEFAULT_SLOT];
+    size_t max = rawlog_max_record(log) < sizeof(rec) ? rawlog_max_record(log) : sizeof(rec);
+    long appended = 0;
+    heap_reset();
+    int64_t t0 = esp_timer_get_time();
+    size_t n;
+    while (err == ESP_OK && in && (n = fread(rec, 1, max, in)) > 0) {
+        err = rawlog_append(log, rec, n, NULL);
+        appended += (long)n;
+    }
+    int64_t append_us = esp_timer_get_time() - t0;
+    if (in) {
+        fclose(in);
+    }
+
+    long read = 0;
+    t0 = esp_timer_get_time();
+    for (uint32_t id = rawlog_first(log); err == ESP_OK && id < rawlog_end(log); id++) {
+        const void *data;
+        size_t len;
+        err = rawlog_read(log, id, &data, &len);
+        read += (long)len;
+    }
+    int64_t read_us = esp_timer_get_time() - t0;
+    printf("%-22s %-10s %9.2f %10s %7s %7s %9.1f %9.1f %8.1f %9s %9s %6s%s\n",
+           label, "rawlog", csv_bytes / (1024.0 * 1024.0), "-", "-", "-",
+           mb_per_s(appended, append_us), mb_per_s(read, read_us), heap_peak() / 1024.0, "-", "-", "-",
+           err == ESP_OK ? "" : "  (failed)");
+    s_failed |= err != ESP_OK;
+}
+
+static long count_rows(const char *path) {
+    FILE *f = fopen(path, "rb");
+    long n = 0;
+    int c;
+    while (f && (c = fgetc(f)) != EOF) {
+        n += c == '\n';
+    }
+    if (f) {
+        fclose(f);
+    }
+    return n;
+}
+
+static void append_rows(const char *path, long from, long n) {
+    FILE *f = fopen(path, "a");
+    for (long i = from; f && i < from + n; i++) {
+        fprintf(f, "%ld,%ld.%ld\n", 1000 + i * 50, 20 + i % 7, i % 10);
+    }
+    if (f) {
+        fclose(f);
+    }
+}
+
+/*
+* Reclaim the compressed input, lose the checkpoint, run another pass: the rebuild must set the output aside,
+* so the rows decoded from "<output>.1" and the new output are all the rows written.
+*/
+static bool check_reclaim(const char *dir) {
+    char in[128], out[128], ckpt[136], aside[136], dec[128];
+    snprintf(in, sizeof(in), "%s/reclaim.csv", dir);
+    snprintf(out, sizeof(out), "%s/reclaim.z", dir);
+    snprintf(ckpt, sizeof(ckpt), "%s.ckpt", out);
+    snprintf(aside, sizeof(aside), "%s.1", out);
+    snprintf(dec, sizeof(dec), "%s/reclaim_dec.csv", dir);
+    remove(in);
+    remove(out);
+    remove(ckpt);
+    remove(aside);
+
+    compression_stream_t *cs;
+    uint32_t reclaimed = 0;
+    esp_err_t err = compression_stream_create(in, out, "delta", &cs);
+    if (err == ESP_OK) {
+        append_rows(in, 0, 1500);
+        compression_stream_pass(cs);
+        append_rows(in, 1500, 7);
+        err = compression_stream_reclaim_input(cs, 1, NULL, &reclaimed);
+        append_rows(in, 1507, 413);
+        compression_stream_destroy(cs);
+    }
+    remove(ckpt);
+    if (err == ESP_OK && (err = compression_stream_create(in, out, "delta", &cs)) == ESP_OK) {
+        err = compression_stream_pass(cs);
+        compression_stream_destroy(cs);
+    }
+    long rows = 0;
+    if (err == ESP_OK && (err = compression_decode_file(aside, dec, NULL)) == ESP_OK) {
+        rows += count_rows(dec);
+        err = compression_decode_file(out, dec, NULL);
+        rows += count_rows(dec);
+    }
+    bool ok = err == ESP_OK && reclaimed > 0 && rows == 1920;
+    printf("check reclaim/lost-ckpt: %s (%ld of 1920 rows)\n", ok ? "ok" : "FAILED", rows);
+    char idx[144];
+    snprintf(idx, sizeof(idx), "%s.idx", out);
+    remove(in);
+    remove(out);
+    remove(ckpt);
+    remove(idx);
+    remove(aside);
+    snprintf(idx, sizeof(idx), "%s.idx", aside);
+    remove(idx);
+    remove(dec);
+    return ok;
+}
+
+void app_main(void) {
+    const char *dir = getenv("SDCLOUD_BENCH_DIR");
+    if (!dir) {
+        dir = "./bench_data";
+    }
+    const char *max_env = getenv("SDCLOUD_BENCH_MAX_MB");
+    double max_mb = max_env ? atof(max_env) : 100.0;
+    mkdir(dir, 0755);
+
+    int workers[COMPRESSION_MAX_WORKERS] = { 1 };
+    int nworkers = 1;
+    const char *workers_env = getenv("SDCLOUD_BENCH_WORKERS");
+    if (workers_env) {
+        nworkers = 0;
+        for (const char *p = workers_env; *p && nworkers < COMPRESSION_MAX_WORKERS; p = strchr(p, ',') ? strchr(p, ',') + 1 : "") {
+            int n = atoi(p);
+            if (n >= 1 && n <= COMPRESSION_MAX_WORKERS) {
+                workers[nworkers++] = n;
+            }
+        }
+        if (nworkers == 0) {
+            workers[nworkers++] = 1;
+        }
+    }
+
+    spi_flash_lock = xSemaphoreCreateMutex();
+    rawlog_t log;
+    bool have_rawlog = rawlog_open(&log, RAWLOG_DEFAULT_LABEL, 0) == ESP_OK;
+    s_failed |= !check_reclaim(dir);
+
+    static const size_t sizes[] = { 100u * 1024, 1024u * 1024, 10u * 1024 * 1024, 100u * 1024 * 1024 };
+    static const int cols[] = { 2, 8, 16 };
+    static const char *noise_names[] = { "flat", "walk", "rand" };
+    static const char *algos[] = { "rle", "delta", "gorilla", "lz", "dict" };
+
+    printf("%-22s %-10s %9s %10s %7s %7s %9s %9s %8s %9s %9s %6s\n",
+           "dataset", "codec", "in_MB", "out_KB", "ratio", "B/row", "enc_MB/s", "dec_MB/s", "heap_KB", "lock_ms", "lock_max", "w_amp");
+
+    char csv[128];
+    snprintf(csv, sizeof(csv), "%s/sensor_data.csv", dir);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        if (sizes[s] > max_mb * 1024 * 1024) {
+            break;
+        }
+        for (size_t c = 0; c < sizeof(cols) / sizeof(cols[0]); c++) {
+            for (int noise = 0; noise < 3; noise++) {
+                bench_case_t bc = { .bytes = sizes[s], .cols = cols[c], .noise = noise };
+                size_t rows = generate_csv(csv, &bc);
+                long csv_bytes = file_size(csv);
+                char label[32];
+                snprintf(label, sizeof(label), "%uKB/%dcol/%s", (unsigned)(sizes[s] / 1024), cols[c], noise_names[noise]);
+                for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+                    for (int w = 0; w < nworkers; w++) {
+                        bench_codec(dir, csv, csv_bytes, rows, label, algos[a], workers[w]);
+                    }
+                }
+                bench_copy(dir, csv, csv_bytes, label);
+                if (have_rawlog) {
+                    bench_rawlog(&log, csv, csv_bytes, label);
+                }
+            }
+        }
+    }
+    remove(csv);
+    if (have_rawlog) {
+        rawlog_close(&log);
+    }
+    fflush(stdout);
+    exit(s_failed ? 1 : 0);
+}
@@ -0,0 +1,58 @@
+#include "stream_copy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "esp_log.h"
+
+static const char *TAG = "stream_copy";
+
+esp_err_t stream_copy_file(const char *src_path, const char *dst_path, size_t *copied)
+{
+    /* One buffer, read then write: the baseline transfer_file() overlaps. */
+    FILE *fin = fopen(src_path, "rb");
+    if (!fin) {
+        ESP_LOGE(TAG, "fopen(%s) failed: error=%d", src_path, errno);
+        return ESP_FAIL;
+    }
+    FILE *fout = fopen(dst_path, "wb");
+    if (!fout) {
+        ESP_LOGE(TAG, "fopen(%s) for write failed: error=%d", dst_path, errno);
+        fclose(fin);
+        return ESP_FAIL;
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(STREAM_COPY_CHUNK);
+    if (!buf) {
+        ESP_LOGE(TAG, "malloc buffer failed");
+        fclose(fin);
+        fclose(fout);
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t total_written = 0;
+    for (;;) {
+        size_t rd = fread(buf, 1, STREAM_COPY_CHUNK, fin);
+        if (rd == 0){
+            break;
+        }
+        size_t wr = fwrite(buf, 1, rd, fout);
+        if (wr != rd) {
+            ESP_LOGE(TAG, "Short write to %s (wrote %zu of %zu)", dst_path, wr, rd);
+            free(buf);
+            fclose(fin);
+            fclose(fout);
+            return ESP_FAIL;
+        }
+        total_written += wr;
+    }
+
+    free(buf);
+    fclose(fin);
+    fclose(fout);
+    if (copied) {
+        *copied = total_written;
+    }
+    return ESP_OK;
+}
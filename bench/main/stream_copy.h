@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+
+/* Chunk size used when streaming a file between file systems. */
+#define STREAM_COPY_CHUNK 4096
+
+/*
+ * Stream-copy src_path to dst_path (created or truncated) in STREAM_COPY_CHUNK blocks.
+ * The bench's baseline for transfer_file(): no SD/SPIFFS dependency and no overlap of reads and writes.
+ * copied (optional) receives the number of bytes written.
+ */
+esp_err_t stream_copy_file(const char *src_path, const char *dst_path, size_t *copied);
@@ -0,0 +1,241 @@
+#include "codec.h"
+#include "page_write.h"
+
+#include "esp_log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *TAG = "codec";
+
+/* Registry: built-ins first, developer codecs appended by codec_register(). */
+static const compression_codec_t *s_codecs[CODEC_MAX_REGISTERED] = {
+    &codec_rle,
+    &codec_delta,
+    &codec_gorilla,
+    &codec_lz,
+    &codec_dict,
+};
+static size_t s_codec_count = 5;
+
+esp_err_t codec_register(const compression_codec_t *codec) {
+    if (!codec || !codec->name || !codec->init || !codec->encode_chunk || !codec->flush || !codec->decode) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (codec->persist_size > CODEC_STATE_MAX || codec->persist_size > codec->state_size) {
+        ESP_LOGE(TAG, "Codec %s persisted state too large (%u > %u)", codec->name, (unsigned)codec->persist_size, (unsigned)CODEC_STATE_MAX);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < s_codec_count; i++) {
+        if (strcasecmp(s_codecs[i]->name, codec->name) == 0 || s_codecs[i]->id == codec->id) {
+            ESP_LOGE(TAG, "Codec %s (id %u) already registered", codec->name, codec->id);
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    if (s_codec_count == CODEC_MAX_REGISTERED) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_codecs[s_codec_count++] = codec;
+    ESP_LOGI(TAG, "Registered codec %s (id %u)", codec->name, codec->id);
+    return ESP_OK;
+}
+
+const compression_codec_t *codec_find(const char *name) {
+    if (!name) {
+        return NULL;
+    }
+    for (size_t i = 0; i < s_codec_count; i++) {
+        if (strcasecmp(s_codecs[i]->name, name) == 0) {
+            return s_codecs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Sink & Source. */
+
+void codec_sink_init(codec_sink_t *s, FILE *f, uint8_t *buf, size_t cap) {
+    s->f = f;
+    s->buf = buf;
+    s->cap = cap;
+    s->len = 0;
+    s->total = 0;
+    s->pos = 0;
+    if (f) {
+        long pos = ftell(f);
+        s->pos = pos > 0 ? (uint32_t)pos : 0;
+    }
+    s->lock = NULL;
+    s->err = ESP_OK;
+}
+
+void codec_sink_set_lock(codec_sink_t *s, const io_lock_t *lock) {
+    s->lock = lock;
+}
+
+/* Memory sink is full: double the buffer instead of writing it out. */
+static esp_err_t sink_grow(codec_sink_t *s) {
+    if (s->len < s->cap || s->err != ESP_OK) {
+        return s->err;
+    }
+    size_t cap = s->cap * 2;
+    uint8_t *buf = realloc(s->buf, cap);
+    if (!buf) {
+        ESP_LOGE(TAG, "Sink: out of memory growing to %u bytes", (unsigned)cap);
+        s->err = ESP_ERR_NO_MEM;
+        s->len = 0;   /* Keep putc/write in bounds; the output is lost anyway. */
+        return s->err;
+    }
+    s->buf = buf;
+    s->cap = cap;
+    return ESP_OK;
+}
+
+void codec_sink_init_mem(codec_sink_t *s, uint8_t *buf, size_t cap) {
+    codec_sink_init(s, NULL, buf, cap);
+}
+
+/* Write out the first n buffered bytes and move the rest to the front. */
+static esp_err_t sink_out(codec_sink_t *s, size_t n) {
+    if (n > 0 && s->err == ESP_OK) {
+        if (s->lock && !s->lock->take(s->lock->ctx)) {
+            ESP_LOGE(TAG, "Sink: lock timeout");
+            s->err = ESP_ERR_TIMEOUT;
+        } else {
+            if (page_write(s->f, s->buf, n) != n) {
+                ESP_LOGE(TAG, "Sink: short write");
+                s->err = ESP_FAIL;
+            }
+            if (s->lock) {
+                s->lock->give(s->lock->ctx);
+            }
+        }
+    }
+    if (s->err != ESP_OK) {
+        n = s->len;   /* Nothing reaches the file after an error: drop the rest too. */
+    }
+    memmove(s->buf, s->buf + n, s->len - n);
+    s->len -= n;
+    s->pos += (uint32_t)n;
+    return s->err;
+}
+
+esp_err_t codec_sink_spill(codec_sink_t *s) {
+    if (!s->f) {
+        return sink_grow(s);
+    }
+    /* A buffer smaller than a page may not reach a boundary: then it all goes. */
+    size_t n = page_write_aligned(s->pos, s->len);
+    return sink_out(s, n ? n : s->len);
+}
+
+esp_err_t codec_sink_flush(codec_sink_t *s) {
+    if (!s->f) {
+        return sink_grow(s);
+    }
+    return sink_out(s, s->len);
+}
+
+esp_err_t codec_sink_write(codec_sink_t *s, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    s->total += len;
+    while (len > 0) {
+        if (s->len == s->cap) {
+            codec_sink_spill(s);
+        }
+        size_t n = s->cap - s->len < len ? s->cap - s->len : len;
+        memcpy(s->buf + s->len, p, n);
+        s->len += n;
+        p += n;
+        len -= n;
+    }
+    return s->err;
+}
+
+void codec_src_init(codec_src_t *s, FILE *f, uint8_t *buf, size_t cap) {
+    s->f = f;
+    s->buf = buf;
+    s->cap = cap;
+    s->pos = 0;
+    s->len = 0;
+    s->left = SIZE_MAX;
+}
+
+int codec_src_getc(codec_src_t *s) {
+    if (s->pos == s->len) {
+        s->len = fread(s->buf, 1, s->cap < s->left ? s->cap : s->left, s->f);
+        s->left -= s->len;
+        s->pos = 0;
+        if (s->len == 0) {
+            return -1;
+        }
+    }
+    return s->buf[s->pos++];
+}
+
+/* Shared Encoding Helpers. */
+
+const int64_t codec_pow10[CODEC_MAX_DECIMALS + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+size_t codec_format_fixed(char *buf, int64_t v, int decimals) {
+    char tmp[CODEC_FIXED_MAX];
+    uint64_t mag = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+    size_t n = 0;
+    /* Digits come out last first. */
+    for (int i = 0; i < decimals && i < CODEC_MAX_DECIMALS; i++) {
+        tmp[n++] = (char)('0' + mag % 10);
+        mag /= 10;
+    }
+    if (n > 0) {
+        tmp[n++] = '.';
+    }
+    do {
+        tmp[n++] = (char)('0' + mag % 10);
+        mag /= 10;
+    } while (mag > 0);
+    if (v < 0) {
+        tmp[n++] = '-';
+    }
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = tmp[n - 1 - i];
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+size_t codec_put_varint(uint8_t *dst, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+    return n;
+}
+
+bool codec_get_varint(codec_src_t *in, uint64_t *v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = codec_src_getc(in);
+        if (c < 0) {
+            return false;
+        }
+        r |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+void codec_put_literal(codec_sink_t *out, const char *row, size_t len) {
+    uint8_t hdr[10];
+    codec_sink_write(out, hdr, codec_put_varint(hdr, len));
+    codec_sink_write(out, row, len);
+}
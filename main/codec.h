@@ -0,0 +1,214 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_err.h"
+#include "line_reader.h"
+#include "csv_field.h"
+
+/* Largest codec state prefix persisted in the compression checkpoint. */
+#define CODEC_STATE_MAX 512
+
+/* Max number of codecs in the registry (built-ins included). */
+#define CODEC_MAX_REGISTERED 8
+
+/*
+* Buffered output owned by the compression driver.
+* Codecs only append bytes; the driver decides where they land and when they are flushed.
+* A full file sink writes out whole pages up to a page boundary of the file and keeps the rest (see page_write.h);
+* only codec_sink_flush() writes a partial page.
+*/
+typedef struct {
+    FILE     *f;
+    uint8_t  *buf;
+    size_t    cap;
+    size_t    len;
+    size_t    total;   /* Bytes accepted since the sink was opened. */
+    uint32_t  pos;     /* File offset buf[0] goes to. */
+    const io_lock_t *lock;  /* Taken around each write to f when set. */
+    esp_err_t err;     /* First write error, sticky. */
+} codec_sink_t;
+
+/*
+* Buffered input handed to decoders.
+*/
+typedef struct {
+    FILE    *f;
+    uint8_t *buf;
+    size_t   cap;
+    size_t   pos;
+    size_t   len;
+    size_t   left;    /* Bytes that may still be read from f (SIZE_MAX: until EOF). */
+} codec_src_t;
+
+/*
+* Codec interface. A codec keeps all of its state in a caller-provided block of state_size bytes.
+* The first persist_size bytes are saved in the checkpoint between passes (so they must not hold pointers);
+* anything after them is working memory that only has to survive within one pass, up to flush.
+*   init:         reset state before the first row (also used before decoding).
+*   encode_chunk: encode a chunk of complete rows, each terminated by '\n'.
+*   flush:        called at the end of every pass; anything still buffered in state must be made decodable.
+*   decode:       decode a whole stream produced by encode_chunk/flush back to CSV.
+*/
+typedef struct {
+    const char *name;
+    uint8_t     id;
+    size_t      state_size;
+    size_t      persist_size;
+    void      (*init)(void *state);
+    esp_err_t (*encode_chunk)(void *state, const char *rows, size_t len, codec_sink_t *out);
+    esp_err_t (*flush)(void *state, codec_sink_t *out);
+    esp_err_t (*decode)(void *state, codec_src_t *in, codec_sink_t *out);
+} compression_codec_t;
+
+/*
+* Add a codec to the registry. Names are matched case-insensitively and must be unique.
+*/
+esp_err_t codec_register(const compression_codec_t *codec);
+
+/*
+* Look up a registered codec by name. Returns NULL if unknown.
+*/
+const compression_codec_t *codec_find(const char *name);
+
+/* Sink & Source Helpers. */
+
+/* File sink writing at the current position of f; cap should be a multiple of PAGE_WRITE_SIZE. */
+void codec_sink_init(codec_sink_t *s, FILE *f, uint8_t *buf, size_t cap);
+void codec_sink_set_lock(codec_sink_t *s, const io_lock_t *lock);
+
+/*
+* Memory sink: output accumulates in buf (malloc'd, cap > 0), which is realloc'd to twice its size
+* when full instead of being written out. The caller owns and frees s->buf; s->len is the output size.
+* A failed grow sets err to ESP_ERR_NO_MEM and drops the buffered output.
+*/
+#define CODEC_SINK_MEM_MIN 1024
+void codec_sink_init_mem(codec_sink_t *s, uint8_t *buf, size_t cap);
+esp_err_t codec_sink_flush(codec_sink_t *s);
+esp_err_t codec_sink_write(codec_sink_t *s, const void *data, size_t len);
+
+/* Make room in a full sink: write out its whole pages (or grow a memory sink). */
+esp_err_t codec_sink_spill(codec_sink_t *s);
+
+static inline void codec_sink_putc(codec_sink_t *s, uint8_t c) {
+    if (s->len == s->cap) {
+        codec_sink_spill(s);
+    }
+    s->buf[s->len++] = c;
+    s->total++;
+}
+
+static inline void codec_sink_puts(codec_sink_t *s, const char *str) {
+    codec_sink_write(s, str, strlen(str));
+}
+
+void codec_src_init(codec_src_t *s, FILE *f, uint8_t *buf, size_t cap);
+
+/* Restrict the source to the next n bytes of f (one frame payload); buffered bytes are dropped. */
+static inline void codec_src_limit(codec_src_t *s, size_t n) {
+    s->pos = 0;
+    s->len = 0;
+    s->left = n;
+}
+
+/* Next byte, or -1 at end of input. */
+int codec_src_getc(codec_src_t *s);
+
+/* Shared Encoding Helpers. */
+
+#define CODEC_MAX_DECIMALS CSV_MAX_DECIMALS
+
+extern const int64_t codec_pow10[CODEC_MAX_DECIMALS + 1];
+
+/* Longest fixed-point text: sign, the 20 digits of an int64, point and terminator. */
+#define CODEC_FIXED_MAX 24
+
+/*
+* Print v with exactly `decimals` (0 to CODEC_MAX_DECIMALS) fractional digits into buf, which holds
+* CODEC_FIXED_MAX bytes. Returns the length, terminator excluded.
+*/
+size_t codec_format_fixed(char *buf, int64_t v, int decimals);
+
+static inline void codec_sink_put_fixed(codec_sink_t *s, int64_t v, int decimals) {
+    char buf[CODEC_FIXED_MAX];
+    codec_sink_write(s, buf, codec_format_fixed(buf, v, decimals));
+}
+
+/* Split the next '\n'-terminated line off [*p, end), keeping any '\r'. Returns false when no lines are left. */
+static inline bool codec_next_line(const char **p, const char *end, const char **row, size_t *len) {
+    if (*p >= end) {
+        return false;
+    }
+    size_t n = line_find(*p, (size_t)(end - *p));
+    *row = *p;
+    *len = n;
+    *p = n < (size_t)(end - *p) ? *p + n + 1 : end;
+    return true;
+}
+
+/* As codec_next_line(), with trailing '\r's dropped: the row as the numeric codecs parse it. */
+static inline bool codec_next_row(const char **p, const char *end, const char **row, size_t *len) {
+    if (!codec_next_line(p, end, row, len)) {
+        return false;
+    }
+    while (*len && (*row)[*len - 1] == '\r') {
+        (*len)--;
+    }
+    return true;
+}
+
+size_t codec_put_varint(uint8_t *dst, uint64_t v);
+bool codec_get_varint(codec_src_t *in, uint64_t *v);
+
+static inline uint64_t codec_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t codec_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+* Timestamp column: an integer first column (esp_log_timestamp() milliseconds) is coded as the change of its
+* interval, its delta-of-delta, which stays 0 while rows arrive at a steady cadence. Wrapping arithmetic, so any
+* int64 sequence round-trips exactly.
+*/
+typedef struct {
+    int64_t prev;
+    int64_t delta;
+} codec_ts_t;
+
+/* Delta-of-delta of ts against the previous timestamp and interval; advances t. */
+static inline int64_t codec_ts_encode(codec_ts_t *t, int64_t ts) {
+    int64_t delta = (int64_t)((uint64_t)ts - (uint64_t)t->prev);
+    int64_t dod = (int64_t)((uint64_t)delta - (uint64_t)t->delta);
+    t->prev = ts;
+    t->delta = delta;
+    return dod;
+}
+
+/* Inverse of codec_ts_encode: the timestamp dod leads to. */
+static inline int64_t codec_ts_decode(codec_ts_t *t, int64_t dod) {
+    t->delta = (int64_t)((uint64_t)t->delta + (uint64_t)dod);
+    t->prev = (int64_t)((uint64_t)t->prev + (uint64_t)t->delta);
+    return t->prev;
+}
+
+/* Write a literal row as varint length + bytes. */
+void codec_put_literal(codec_sink_t *out, const char *row, size_t len);
+
+/* Built-in Codecs. */
+
+extern const compression_codec_t codec_rle;
+extern const compression_codec_t codec_delta;
+extern const compression_codec_t codec_gorilla;
+extern const compression_codec_t codec_lz;
+extern const compression_codec_t codec_dict;
+
+/*
+* Delta codec: fixed number of decimals for a column, or -1 to detect it from the first value.
+*/
+void codec_delta_set_decimals(int column, int decimals);
@@ -0,0 +1,213 @@
+#include "codec.h"
+
+#include "esp_log.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "codec_delta";
+
+/*
+* Delta Encoding Compression.
+* Binary stream, one record per row, starting with a varint tag:
+*   0          literal row: varint length + raw bytes (non-numeric or out-of-range rows).
+*   n (n > 0)  numeric row of n columns: per column a zigzag varint of the change in its fixed-point value.
+*              A column seen for the first time is preceded by one byte holding its number of decimals.
+*   33 + 2 * (n - 1) + s
+*              numeric row of n columns whose first column is an integer timestamp: s = 1 when its interval
+*              is unchanged, otherwise a zigzag varint of the change in interval (delta-of-delta) comes first.
+*              A steady cadence thus costs one bit of the tag. The timestamp column has no decimals byte;
+*              the other columns follow as above.
+* Column values are integers scaled by 10^decimals, so decoding is exact.
+*/
+#define DELTA_MAX_COLUMNS 32
+#define DELTA_TAG_LITERAL 0
+#define DELTA_TAG_TS      (DELTA_MAX_COLUMNS + 1)
+
+typedef struct {
+    int64_t     prev[DELTA_MAX_COLUMNS];
+    int64_t     ts_delta;   /* Last interval of column 0 while it is a timestamp. */
+    uint8_t     decimals[DELTA_MAX_COLUMNS];
+    uint8_t     ncols;
+    /* Working memory, not persisted. */
+    csv_field_t fields[DELTA_MAX_COLUMNS];
+} delta_state_t;
+
+static int8_t delta_decimals_cfg[DELTA_MAX_COLUMNS] = {
+    [0 ... DELTA_MAX_COLUMNS - 1] = -1 /* -1: detect from the first value seen. */
+};
+
+void codec_delta_set_decimals(int column, int decimals) {
+    if (column < 0 || column >= DELTA_MAX_COLUMNS || decimals > CODEC_MAX_DECIMALS) {
+        ESP_LOGW(TAG, "Ignoring decimals %d for column %d", decimals, column);
+        return;
+    }
+    delta_decimals_cfg[column] = (int8_t)(decimals < 0 ? -1 : decimals);
+}
+
+static void delta_write_literal(const char *row, size_t len, codec_sink_t *out) {
+    codec_sink_putc(out, DELTA_TAG_LITERAL);
+    codec_put_literal(out, row, len);
+}
+
+static void delta_encode_row(delta_state_t *st, const char *row, size_t len, codec_sink_t *out) {
+    if (len == 0) {
+        delta_write_literal(row, 0, out);   /* A blank line stays one. */
+        return;
+    }
+
+    int64_t values[DELTA_MAX_COLUMNS];
+    uint8_t decimals[DELTA_MAX_COLUMNS];
+    size_t count = csv_parse_row(row, len, st->fields, DELTA_MAX_COLUMNS);
+    if (count > DELTA_MAX_COLUMNS) {
+        delta_write_literal(row, len, out);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const csv_field_t *f = &st->fields[i];
+        int scale = i < st->ncols ? st->decimals[i]
+                  : delta_decimals_cfg[i] >= 0 ? delta_decimals_cfg[i] : f->decimals;
+        /* Never round: a non-numeric value, one finer than its column scale or too large to scale goes out literally. */
+        if (!csv_field_scaled(f, scale, &values[i])) {
+            delta_write_literal(row, len, out);
+            return;
+        }
+        decimals[i] = (uint8_t)scale;
+    }
+
+    uint8_t rec[10 + DELTA_MAX_COLUMNS * 11];
+    size_t n = 0;
+    size_t i = 0;
+    if (count > 0 && decimals[0] == 0) {
+        if (st->ncols == 0) {
+            st->decimals[0] = 0;
+            st->prev[0] = 0;
+            st->ts_delta = 0;
+        }
+        codec_ts_t ts = { st->prev[0], st->ts_delta };
+        int64_t dod = codec_ts_encode(&ts, values[0]);
+        n = codec_put_varint(rec, DELTA_TAG_TS + 2 * ((uint64_t)count - 1) + (dod == 0 ? 1 : 0));
+        if (dod != 0) {
+            n += codec_put_varint(rec + n, codec_zigzag(dod));
+        }
+        st->prev[0] = ts.prev;
+        st->ts_delta = ts.delta;
+        i = 1;
+    } else {
+        n = codec_put_varint(rec, (uint64_t)count);
+    }
+    for (; i < count; i++) {
+        if (i >= st->ncols) {
+            rec[n++] = decimals[i];
+            st->decimals[i] = decimals[i];
+            st->prev[i] = 0;
+        }
+        n += codec_put_varint(rec + n, codec_zigzag((int64_t)((uint64_t)values[i] - (uint64_t)st->prev[i])));
+        st->prev[i] = values[i];
+    }
+    if (count > st->ncols) {
+        st->ncols = (uint8_t)count;
+    }
+    codec_sink_write(out, rec, n);
+}
+
+static void delta_init(void *state) {
+    memset(state, 0, sizeof(delta_state_t));
+}
+
+static esp_err_t delta_encode_chunk(void *state, const char *rows, size_t len, codec_sink_t *out) {
+    const char *p = rows;
+    const char *end = rows + len;
+    const char *row;
+    size_t row_len;
+    while (codec_next_row(&p, end, &row, &row_len)) {
+        delta_encode_row((delta_state_t *)state, row, row_len, out);
+    }
+    return out->err;
+}
+
+/* Records are byte-aligned and self-delimiting: nothing to flush. */
+static esp_err_t delta_flush(void *state, codec_sink_t *out) {
+    (void)state;
+    return out->err;
+}
+
+static esp_err_t delta_decode(void *state, codec_src_t *in, codec_sink_t *out) {
+    delta_state_t *st = (delta_state_t *)state;
+    uint64_t tag;
+    while (codec_get_varint(in, &tag)) {
+        if (tag == DELTA_TAG_LITERAL) {
+            uint64_t len;
+            if (!codec_get_varint(in, &len)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            for (uint64_t i = 0; i < len; i++) {
+                int c = codec_src_getc(in);
+                if (c < 0) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                codec_sink_putc(out, (uint8_t)c);
+            }
+            codec_sink_putc(out, '\n');
+            continue;
+        }
+        uint64_t cols = tag;
+        uint64_t i = 0;
+        if (tag >= DELTA_TAG_TS) {
+            cols = (tag - DELTA_TAG_TS) / 2 + 1;
+            if (cols > DELTA_MAX_COLUMNS || (st->ncols > 0 && st->decimals[0] != 0)) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            uint64_t zz = 0;
+            if (!((tag - DELTA_TAG_TS) & 1) && !codec_get_varint(in, &zz)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (st->ncols == 0) {
+                st->decimals[0] = 0;
+                st->prev[0] = 0;
+                st->ts_delta = 0;
+            }
+            codec_ts_t ts = { st->prev[0], st->ts_delta };
+            st->prev[0] = codec_ts_decode(&ts, codec_unzigzag(zz));
+            st->ts_delta = ts.delta;
+            codec_sink_put_fixed(out, st->prev[0], 0);
+            i = 1;
+        }
+        for (; i < cols; i++) {
+            if (i >= st->ncols) {
+                int d = codec_src_getc(in);
+                if (d < 0 || d > CODEC_MAX_DECIMALS) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                st->decimals[i] = (uint8_t)d;
+                st->prev[i] = 0;
+            }
+            uint64_t zz;
+            if (!codec_get_varint(in, &zz)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            st->prev[i] = (int64_t)((uint64_t)st->prev[i] + (uint64_t)codec_unzigzag(zz));
+            if (i > 0) {
+                codec_sink_putc(out, ',');
+            }
+            codec_sink_put_fixed(out, st->prev[i], st->decimals[i]);
+        }
+        if (cols > st->ncols) {
+            st->ncols = (uint8_t)cols;
+        }
+        codec_sink_putc(out, '\n');
+    }
+    return out->err;
+}
+
+const compression_codec_t codec_delta = {
+    .name = "delta",
+    .id = 2,
+    .state_size = sizeof(delta_state_t),
+    .persist_size = offsetof(delta_state_t, fields),
+    .init = delta_init,
+    .encode_chunk = delta_encode_chunk,
+    .flush = delta_flush,
+    .decode = delta_decode,
+};
@@ -0,0 +1,354 @@
+#include "codec.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+* Dictionary Encoding: for rows that mix numbers with repeating text (status words, units, labels).
+* Binary stream, one record per row, starting with a varint tag:
+*   0          literal row: varint length + raw bytes (rows wider than DICT_MAX_COLUMNS).
+*   1          end of block: the decoder forgets its dictionary and column state.
+*   n + 2      row of n fields, each one varint v whose low two bits are the kind and v >> 2 its operand:
+*                0  number: zigzag change of the column's fixed-point value.
+*                1  dictionary entry v >> 2.
+*                2  text, followed by varint length + bytes; v >> 2 is 1 if it becomes the next dictionary entry.
+*                3  number at a new scale of v >> 2 decimals, followed by a zigzag varint change against the
+*                   previous value rescaled.
+*   35 + 2 * (n - 1) + s
+*              row of n fields whose first is an integer timestamp: s = 1 when its interval is unchanged,
+*              otherwise a zigzag varint of the change in interval (delta-of-delta) comes first. The other
+*              fields follow as above, so a steady cadence costs one bit of the tag.
+* Text values of up to DICT_MAX_LEN bytes are looked up per column in a dictionary of at most DICT_MAX_ENTRIES
+* (one byte per hit for the first 32 entries). A column whose values keep missing (DICT_SPILL_MIN new values and
+* more misses than hits) spills: its values go raw for the rest of the block, leaving the dictionary to the columns
+* that repeat.
+* Numbers are exact and come back in canonical fixed-point form; text comes back byte for byte.
+* flush ends the block, so the dictionary is bounded per frame and nothing is persisted between passes.
+*/
+#define DICT_MAX_COLUMNS  32
+#define DICT_MAX_ENTRIES  64
+#define DICT_MAX_LEN      32
+#define DICT_POOL_BYTES   (DICT_MAX_ENTRIES * 16)
+#define DICT_HASH_SIZE    128
+#define DICT_SPILL_MIN    8
+#define DICT_NO_SCALE     0xFF
+
+#define DICT_TAG_LITERAL  0
+#define DICT_TAG_RESET    1
+#define DICT_TAG_ROW      2
+#define DICT_TAG_TS       (DICT_TAG_ROW + DICT_MAX_COLUMNS + 1)
+
+#define DICT_KIND_NUM     0
+#define DICT_KIND_CODE    1
+#define DICT_KIND_TEXT    2
+#define DICT_KIND_SCALE   3
+#define DICT_KIND(k, operand) (((uint64_t)(operand) << 2) | (k))
+
+typedef struct {
+    uint16_t off;
+    uint8_t  len;
+    uint8_t  col;
+} dict_entry_t;
+
+typedef struct {
+    int64_t      prev[DICT_MAX_COLUMNS];
+    int64_t      ts_delta;                     /* Last interval of column 0 while it is a timestamp. */
+    uint8_t      decimals[DICT_MAX_COLUMNS];   /* DICT_NO_SCALE until the column's first number. */
+    uint8_t      spilled[DICT_MAX_COLUMNS];
+    uint16_t     hits[DICT_MAX_COLUMNS];
+    uint16_t     misses[DICT_MAX_COLUMNS];
+    uint8_t      nentries;
+    uint16_t     pool_len;
+    bool         dirty;                        /* Rows since the last end of block. */
+    dict_entry_t entries[DICT_MAX_ENTRIES];
+    uint8_t      hash[DICT_HASH_SIZE];         /* Entry index + 1, 0: free. */
+    char         pool[DICT_POOL_BYTES];
+    csv_field_t  fields[DICT_MAX_COLUMNS];
+} dict_state_t;
+
+static void dict_init(void *state) {
+    dict_state_t *st = (dict_state_t *)state;
+    memset(st, 0, offsetof(dict_state_t, fields));
+    memset(st->decimals, DICT_NO_SCALE, sizeof(st->decimals));
+}
+
+static uint32_t dict_hash(uint8_t col, const char *s, size_t len) {
+    uint32_t h = 2166136261u ^ col;
+    h *= 16777619u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Hash slot of (col, s): the entry's when present, otherwise the free slot it would go in. */
+static uint32_t dict_slot(const dict_state_t *st, uint8_t col, const char *s, size_t len) {
+    uint32_t i = dict_hash(col, s, len) & (DICT_HASH_SIZE - 1);
+    while (st->hash[i]) {
+        const dict_entry_t *e = &st->entries[st->hash[i] - 1];
+        if (e->col == col && e->len == len && memcmp(st->pool + e->off, s, len) == 0) {
+            break;
+        }
+        i = (i + 1) & (DICT_HASH_SIZE - 1);
+    }
+    return i;
+}
+
+/* Add an entry; false when the dictionary is full. */
+static bool dict_add(dict_state_t *st, uint8_t col, const char *s, size_t len) {
+    if (st->nentries == DICT_MAX_ENTRIES || st->pool_len + len > DICT_POOL_BYTES) {
+        return false;
+    }
+    dict_entry_t *e = &st->entries[st->nentries++];
+    e->off = st->pool_len;
+    e->len = (uint8_t)len;
+    e->col = col;
+    memcpy(st->pool + st->pool_len, s, len);
+    st->pool_len += (uint16_t)len;
+    return true;
+}
+
+static void dict_put_text(codec_sink_t *out, bool add, const char *s, size_t len) {
+    codec_sink_putc(out, (uint8_t)DICT_KIND(DICT_KIND_TEXT, add));
+    codec_put_literal(out, s, len);
+}
+
+static void dict_encode_text(dict_state_t *st, uint8_t col, const char *s, size_t len, codec_sink_t *out) {
+    if (st->spilled[col] || len > DICT_MAX_LEN) {
+        dict_put_text(out, false, s, len);
+        return;
+    }
+    uint32_t slot = dict_slot(st, col, s, len);
+    if (st->hash[slot]) {
+        uint8_t code[10];
+        st->hits[col]++;
+        codec_sink_write(out, code, codec_put_varint(code, DICT_KIND(DICT_KIND_CODE, st->hash[slot] - 1)));
+        return;
+    }
+    st->misses[col]++;
+    if (dict_add(st, col, s, len)) {
+        st->hash[slot] = st->nentries;
+        dict_put_text(out, true, s, len);
+    } else {
+        dict_put_text(out, false, s, len);
+    }
+    if (st->misses[col] >= DICT_SPILL_MIN && st->misses[col] > st->hits[col]) {
+        st->spilled[col] = 1;
+    }
+}
+
+static void dict_encode_row(dict_state_t *st, const char *row, size_t len, codec_sink_t *out) {
+    size_t count = csv_parse_row(row, len, st->fields, DICT_MAX_COLUMNS);
+    if (count > DICT_MAX_COLUMNS) {
+        codec_sink_putc(out, DICT_TAG_LITERAL);
+        codec_put_literal(out, row, len);
+        return;
+    }
+    uint8_t tag[20];
+    size_t i = 0;
+    int64_t v;
+    if (count > 0 && st->fields[0].status == CSV_FIELD_OK && st->fields[0].decimals == 0
+        && (st->decimals[0] == DICT_NO_SCALE || st->decimals[0] == 0) && csv_field_scaled(&st->fields[0], 0, &v)) {
+        if (st->decimals[0] == DICT_NO_SCALE) {
+            st->decimals[0] = 0;
+            st->prev[0] = 0;
+            st->ts_delta = 0;
+        }
+        codec_ts_t ts = { st->prev[0], st->ts_delta };
+        int64_t dod = codec_ts_encode(&ts, v);
+        size_t n = codec_put_varint(tag, DICT_TAG_TS + 2 * ((uint64_t)count - 1) + (dod == 0 ? 1 : 0));
+        if (dod != 0) {
+            n += codec_put_varint(tag + n, codec_zigzag(dod));
+        }
+        codec_sink_write(out, tag, n);
+        st->prev[0] = ts.prev;
+        st->ts_delta = ts.delta;
+        i = 1;
+    } else {
+        codec_sink_write(out, tag, codec_put_varint(tag, DICT_TAG_ROW + (uint64_t)count));
+    }
+    for (; i < count; i++) {
+        const csv_field_t *f = &st->fields[i];
+        uint8_t scale = st->decimals[i];
+        if (f->status == CSV_FIELD_OK && (scale == DICT_NO_SCALE || f->decimals > scale)) {
+            /* First number of the column, or a finer one: the column moves to this scale. */
+            int64_t prev;
+            if (csv_field_scaled(f, f->decimals, &v)
+                && (scale == DICT_NO_SCALE || !__builtin_mul_overflow(st->prev[i], codec_pow10[f->decimals - scale], &prev))) {
+                st->prev[i] = scale == DICT_NO_SCALE ? 0 : prev;
+                st->decimals[i] = f->decimals;
+                uint8_t rec[11];
+                rec[0] = (uint8_t)DICT_KIND(DICT_KIND_SCALE, f->decimals);
+                size_t n = 1 + codec_put_varint(rec + 1, codec_zigzag((int64_t)((uint64_t)v - (uint64_t)st->prev[i])));
+                codec_sink_write(out, rec, n);
+                st->prev[i] = v;
+                continue;
+            }
+        } else if (f->status == CSV_FIELD_OK && csv_field_scaled(f, scale, &v)) {
+            uint64_t zz = codec_zigzag((int64_t)((uint64_t)v - (uint64_t)st->prev[i]));
+            uint8_t rec[11];
+            size_t n;
+            if (zz >> 62) {
+                /* No room for the kind bits: restate the scale, which carries the change separately. */
+                rec[0] = (uint8_t)DICT_KIND(DICT_KIND_SCALE, scale);
+                n = 1 + codec_put_varint(rec + 1, zz);
+            } else {
+                n = codec_put_varint(rec, DICT_KIND(DICT_KIND_NUM, zz));
+            }
+            codec_sink_write(out, rec, n);
+            st->prev[i] = v;
+            continue;
+        }
+        dict_encode_text(st, (uint8_t)i, f->text, f->len, out);
+    }
+    st->dirty = true;
+}
+
+static esp_err_t dict_encode_chunk(void *state, const char *rows, size_t len, codec_sink_t *out) {
+    const char *p = rows;
+    const char *end = rows + len;
+    const char *row;
+    size_t row_len;
+    while (codec_next_row(&p, end, &row, &row_len)) {
+        dict_encode_row((dict_state_t *)state, row, row_len, out);
+    }
+    return out->err;
+}
+
+/* End the block: the next pass or frame starts with an empty dictionary. */
+static esp_err_t dict_flush(void *state, codec_sink_t *out) {
+    dict_state_t *st = (dict_state_t *)state;
+    if (st->dirty) {
+        codec_sink_putc(out, DICT_TAG_RESET);
+    }
+    dict_init(st);
+    return out->err;
+}
+
+/* Read a varint length and that many bytes into buf (cap bytes; longer values are copied straight to out). */
+static esp_err_t dict_get_raw(codec_src_t *in, codec_sink_t *out, char *buf, size_t cap, size_t *len) {
+    uint64_t n;
+    if (!codec_get_varint(in, &n)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        int c = codec_src_getc(in);
+        if (c < 0) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (i < cap) {
+            buf[i] = (char)c;
+        }
+        codec_sink_putc(out, (uint8_t)c);
+    }
+    *len = (size_t)n;
+    return ESP_OK;
+}
+
+static esp_err_t dict_decode(void *state, codec_src_t *in, codec_sink_t *out) {
+    dict_state_t *st = (dict_state_t *)state;
+    uint64_t tag;
+    while (codec_get_varint(in, &tag)) {
+        if (tag == DICT_TAG_RESET) {
+            dict_init(st);
+            continue;
+        }
+        if (tag == DICT_TAG_LITERAL) {
+            char skip[1];
+            size_t len;
+            esp_err_t err = dict_get_raw(in, out, skip, 0, &len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            codec_sink_putc(out, '\n');
+            continue;
+        }
+        uint64_t count = tag - DICT_TAG_ROW;
+        uint64_t i = 0;
+        if (tag >= DICT_TAG_TS) {
+            count = (tag - DICT_TAG_TS) / 2 + 1;
+            if (count > DICT_MAX_COLUMNS || (st->decimals[0] != DICT_NO_SCALE && st->decimals[0] != 0)) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            uint64_t zz = 0;
+            if (!((tag - DICT_TAG_TS) & 1) && !codec_get_varint(in, &zz)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (st->decimals[0] == DICT_NO_SCALE) {
+                st->decimals[0] = 0;
+                st->prev[0] = 0;
+                st->ts_delta = 0;
+            }
+            codec_ts_t ts = { st->prev[0], st->ts_delta };
+            st->prev[0] = codec_ts_decode(&ts, codec_unzigzag(zz));
+            st->ts_delta = ts.delta;
+            codec_sink_put_fixed(out, st->prev[0], 0);
+            i = 1;
+        }
+        for (; i < count; i++) {
+            if (i > 0) {
+                codec_sink_putc(out, ',');
+            }
+            uint64_t v;
+            if (!codec_get_varint(in, &v)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            uint64_t kind = v & 3;
+            uint64_t operand = v >> 2;
+            if (kind == DICT_KIND_TEXT) {
+                char val[DICT_MAX_LEN];
+                size_t len;
+                esp_err_t err = dict_get_raw(in, out, val, sizeof(val), &len);
+                if (err != ESP_OK) {
+                    return err;
+                }
+                if (operand && (len > DICT_MAX_LEN || !dict_add(st, (uint8_t)i, val, len))) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                continue;
+            }
+            if (kind == DICT_KIND_CODE) {
+                if (operand >= st->nentries || st->entries[operand].col != i) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                codec_sink_write(out, st->pool + st->entries[operand].off, st->entries[operand].len);
+                continue;
+            }
+            uint64_t zz = operand;
+            if (kind == DICT_KIND_SCALE) {
+                if (operand > CODEC_MAX_DECIMALS || (st->decimals[i] != DICT_NO_SCALE && operand < st->decimals[i])) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                int d = (int)operand;
+                int64_t prev = 0;
+                if (st->decimals[i] != DICT_NO_SCALE
+                    && __builtin_mul_overflow(st->prev[i], codec_pow10[d - st->decimals[i]], &prev)) {
+                    return ESP_ERR_INVALID_RESPONSE;   /* The encoder never rescales past an int64. */
+                }
+                st->prev[i] = prev;
+                st->decimals[i] = (uint8_t)d;
+                if (!codec_get_varint(in, &zz)) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+            } else if (st->decimals[i] == DICT_NO_SCALE) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            st->prev[i] = (int64_t)((uint64_t)st->prev[i] + (uint64_t)codec_unzigzag(zz));
+            codec_sink_put_fixed(out, st->prev[i], st->decimals[i]);
+        }
+        codec_sink_putc(out, '\n');
+    }
+    return out->err;
+}
+
+const compression_codec_t codec_dict = {
+    .name = "dict",
+    .id = 5,
+    .state_size = sizeof(dict_state_t),
+    .persist_size = 0, /* Each pass ends its block. */
+    .init = dict_init,
+    .encode_chunk = dict_encode_chunk,
+    .flush = dict_flush,
+    .decode = dict_decode,
+};
@@ -0,0 +1,427 @@
+#include "codec.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+* Gorilla Compression (XOR floats, delta-of-delta timestamps), bit-packed MSB first.
+* Row header:
+*   0                          numeric row, same shape as the previous numeric row
+*   10 + len:16 + bytes        literal row (non-numeric, not exact as float32, or wider than GORILLA_MAX_COLUMNS);
+*                              len 0xFFFF is followed by more:32, for rows of 0xFFFF + more bytes
+*   11 + ncols:6 + has_ts:1    numeric row with a new shape, then decimals:4 for every value column;
+*                              ncols == 0 marks end of pass, pad to a byte
+* Timestamp column (an integer first column): delta-of-delta in 1, 2+7, 3+9, 4+12 or 4+64 bits.
+* Value columns (float32): XOR with the previous value of the column; 0 if equal, otherwise
+*   10 + bits inside the previous leading/length window, or 11 + lead:5 + (len-1):5 + bits.
+* Values are printed in fixed point with their column's decimals, which only grow within a shape: "20.5" after
+* "20.25" comes back as "20.50". A row is only coded as numbers when every float32 rounds back to its value at
+* those decimals; otherwise it goes out literally.
+*/
+#define GORILLA_MAX_COLUMNS 32
+#define GORILLA_LITERAL_LONG 0xFFFFu
+
+typedef struct {
+    codec_ts_t ts;
+    uint32_t prev_bits[GORILLA_MAX_COLUMNS];
+    uint8_t  prev_lead[GORILLA_MAX_COLUMNS];
+    uint8_t  prev_len[GORILLA_MAX_COLUMNS]; /* 0: no reusable window yet. */
+    uint8_t  decimals[GORILLA_MAX_COLUMNS];
+    uint8_t  ncols;
+    bool     has_ts;
+    /* Bits not yet forming a whole byte; always empty after flush. */
+    uint8_t  pending_bits;
+    uint8_t  pending_nbits;
+    /* Working memory, not persisted. */
+    csv_field_t fields[GORILLA_MAX_COLUMNS];
+} gorilla_state_t;
+
+typedef struct {
+    codec_sink_t *out;
+    uint64_t      acc;
+    int           nbits;
+} bit_writer_t;
+
+static void bw_put(bit_writer_t *w, uint32_t v, int n) {
+    if (n == 0) {
+        return;
+    }
+    w->acc = (w->acc << n) | (n == 32 ? v : (v & ((1u << n) - 1)));
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        w->nbits -= 8;
+        codec_sink_putc(w->out, (uint8_t)(w->acc >> w->nbits));
+    }
+}
+
+static void bw_put64(bit_writer_t *w, uint64_t v) {
+    bw_put(w, (uint32_t)(v >> 32), 32);
+    bw_put(w, (uint32_t)v, 32);
+}
+
+static void bw_align(bit_writer_t *w) {
+    if (w->nbits > 0) {
+        bw_put(w, 0, 8 - w->nbits);
+    }
+}
+
+typedef struct {
+    codec_src_t *in;
+    uint64_t     acc;
+    int          nbits;
+} bit_reader_t;
+
+static bool br_get(bit_reader_t *r, int n, uint32_t *v) {
+    while (r->nbits < n) {
+        int c = codec_src_getc(r->in);
+        if (c < 0) {
+            return false;
+        }
+        r->acc = (r->acc << 8) | (uint8_t)c;
+        r->nbits += 8;
+    }
+    r->nbits -= n;
+    *v = n == 0 ? 0 : (uint32_t)(r->acc >> r->nbits) & (n == 32 ? 0xFFFFFFFFu : ((1u << n) - 1));
+    return true;
+}
+
+static bool br_get64(bit_reader_t *r, uint64_t *v) {
+    uint32_t hi, lo;
+    if (!br_get(r, 32, &hi) || !br_get(r, 32, &lo)) {
+        return false;
+    }
+    *v = ((uint64_t)hi << 32) | lo;
+    return true;
+}
+
+static void gorilla_put_ts(gorilla_state_t *st, bit_writer_t *w, int64_t ts) {
+    int64_t dod = codec_ts_encode(&st->ts, ts);
+    if (dod == 0) {
+        bw_put(w, 0x0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        bw_put(w, 0x2, 2);
+        bw_put(w, (uint32_t)dod, 7);
+    } else if (dod >= -255 && dod <= 256) {
+        bw_put(w, 0x6, 3);
+        bw_put(w, (uint32_t)dod, 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        bw_put(w, 0xE, 4);
+        bw_put(w, (uint32_t)dod, 12);
+    } else {
+        bw_put(w, 0xF, 4);
+        bw_put64(w, (uint64_t)dod);
+    }
+}
+
+static void gorilla_put_value(gorilla_state_t *st, bit_writer_t *w, int col, uint32_t bits) {
+    uint32_t x = bits ^ st->prev_bits[col];
+    st->prev_bits[col] = bits;
+    if (x == 0) {
+        bw_put(w, 0, 1);
+        return;
+    }
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+    if (lead > 31) {
+        lead = 31;
+    }
+    int plead = st->prev_lead[col];
+    int plen = st->prev_len[col];
+    if (plen != 0 && lead >= plead && trail >= 32 - plead - plen) {
+        bw_put(w, 0x2, 2);
+        bw_put(w, x >> (32 - plead - plen), plen);
+        return;
+    }
+    int len = 32 - lead - trail;
+    bw_put(w, 0x3, 2);
+    bw_put(w, (uint32_t)lead, 5);
+    bw_put(w, (uint32_t)(len - 1), 5);
+    bw_put(w, x >> trail, len);
+    st->prev_lead[col] = (uint8_t)lead;
+    st->prev_len[col] = (uint8_t)len;
+}
+
+static void gorilla_write_literal(bit_writer_t *w, const char *line, size_t len) {
+    bw_put(w, 0x2, 2);
+    if (len < GORILLA_LITERAL_LONG) {
+        bw_put(w, (uint32_t)len, 16);
+    } else {
+        bw_put(w, GORILLA_LITERAL_LONG, 16);
+        bw_put(w, (uint32_t)(len - GORILLA_LITERAL_LONG), 32);
+    }
+    for (size_t i = 0; i < len; i++) {
+        bw_put(w, (uint8_t)line[i], 8);
+    }
+}
+
+/* v in fixed point with `decimals` digits, rounded to nearest. The decoder's reading of every value. */
+static bool float_fixed(float v, int decimals, int64_t *mant) {
+    double x = (double)v * (double)codec_pow10[decimals];
+    if (!(x > -9e18 && x < 9e18)) {
+        return false;   /* Also NaN. */
+    }
+    *mant = (int64_t)(x < 0 ? x - 0.5 : x + 0.5);
+    return true;
+}
+
+/* Whether f reads back as field's value at `decimals` (no fewer than the field's own). */
+static bool float_exact(const csv_field_t *field, float f, int decimals) {
+    int64_t want, got;
+    return csv_field_scaled(field, decimals, &want) && float_fixed(f, decimals, &got) && got == want;
+}
+
+static void gorilla_encode_row(gorilla_state_t *st, bit_writer_t *w, const char *line, size_t len) {
+    int64_t ts = 0;
+    bool has_ts = false;
+    uint32_t bits[GORILLA_MAX_COLUMNS];
+    uint8_t decimals[GORILLA_MAX_COLUMNS];
+    int count = (int)csv_parse_row(line, len, st->fields, GORILLA_MAX_COLUMNS);
+    if (count > GORILLA_MAX_COLUMNS) {
+        count = -1;
+    }
+    if (len == 0) {
+        count = -1;   /* A blank line stays one. */
+    }
+    for (int i = 0; i < count; i++) {
+        const csv_field_t *field = &st->fields[i];
+        float f;
+        if (i == 0 && field->status == CSV_FIELD_OK && field->decimals == 0) {
+            ts = field->mant;
+            has_ts = true;
+        } else if (csv_field_float(field, &f)) {
+            /* Keep the column's decimals when the value fits them, so the shape can stay. */
+            int d = field->decimals;
+            if (i < st->ncols && st->decimals[i] > d && float_exact(field, f, st->decimals[i])) {
+                d = st->decimals[i];
+            } else if (!float_exact(field, f, d)) {
+                count = -1;
+                break;
+            }
+            memcpy(&bits[i], &f, sizeof(f));
+            decimals[i] = (uint8_t)d;
+        } else {
+            count = -1;
+            break;
+        }
+    }
+
+    if (count < 0) {
+        gorilla_write_literal(w, line, len);
+        return;
+    }
+    bool same = count == st->ncols && has_ts == st->has_ts;
+    for (int i = has_ts ? 1 : 0; same && i < count; i++) {
+        same = decimals[i] == st->decimals[i];
+    }
+    if (same) {
+        bw_put(w, 0x0, 1);
+    } else {
+        bw_put(w, 0x3, 2);
+        bw_put(w, (uint32_t)count, 6);
+        bw_put(w, has_ts ? 1 : 0, 1);
+        for (int i = has_ts ? 1 : 0; i < count; i++) {
+            bw_put(w, decimals[i], 4);
+            st->decimals[i] = decimals[i];
+        }
+        for (int i = st->ncols; i < count; i++) {
+            st->prev_bits[i] = 0;
+            st->prev_len[i] = 0;
+        }
+        st->ncols = (uint8_t)count;
+        st->has_ts = has_ts;
+    }
+    for (int i = 0; i < count; i++) {
+        if (i == 0 && has_ts) {
+            gorilla_put_ts(st, w, ts);
+        } else {
+            gorilla_put_value(st, w, i, bits[i]);
+        }
+    }
+}
+
+static void gorilla_init(void *state) {
+    memset(state, 0, sizeof(gorilla_state_t));
+}
+
+static esp_err_t gorilla_encode_chunk(void *state, const char *rows, size_t len, codec_sink_t *out) {
+    gorilla_state_t *st = (gorilla_state_t *)state;
+    bit_writer_t w = { .out = out, .acc = st->pending_bits, .nbits = st->pending_nbits };
+    const char *p = rows;
+    const char *end = rows + len;
+    const char *row;
+    size_t row_len;
+    while (codec_next_row(&p, end, &row, &row_len)) {
+        gorilla_encode_row(st, &w, row, row_len);
+    }
+    st->pending_bits = (uint8_t)(w.acc & 0xFF);
+    st->pending_nbits = (uint8_t)w.nbits;
+    return out->err;
+}
+
+/* End of pass marker, then pad so the next pass starts on a byte boundary. */
+static esp_err_t gorilla_flush(void *state, codec_sink_t *out) {
+    gorilla_state_t *st = (gorilla_state_t *)state;
+    bit_writer_t w = { .out = out, .acc = st->pending_bits, .nbits = st->pending_nbits };
+    bw_put(&w, 0x3, 2);
+    bw_put(&w, 0, 7);
+    bw_align(&w);
+    st->pending_bits = 0;
+    st->pending_nbits = 0;
+    return out->err;
+}
+
+static bool gorilla_get_ts(gorilla_state_t *st, bit_reader_t *r, int64_t *ts) {
+    uint32_t b;
+    int64_t dod = 0;
+    int prefix = 0;
+    while (prefix < 4) {
+        if (!br_get(r, 1, &b)) {
+            return false;
+        }
+        if (!b) {
+            break;
+        }
+        prefix++;
+    }
+    static const int dod_bits[5] = { 0, 7, 9, 12, 64 };
+    if (prefix == 4) {
+        uint64_t v;
+        if (!br_get64(r, &v)) {
+            return false;
+        }
+        dod = (int64_t)v;
+    } else if (prefix > 0) {
+        int n = dod_bits[prefix];
+        if (!br_get(r, n, &b)) {
+            return false;
+        }
+        /* Sign-extend, then map the one positive value above the range back down (e.g. 64 for 7 bits). */
+        dod = (int64_t)(int32_t)(b << (32 - n)) >> (32 - n);
+        if (dod < -((1 << (n - 1)) - 1)) {
+            dod += (int64_t)1 << n;
+        }
+    }
+    *ts = codec_ts_decode(&st->ts, dod);
+    return true;
+}
+
+static bool gorilla_get_value(gorilla_state_t *st, bit_reader_t *r, int col, float *out) {
+    uint32_t b;
+    if (!br_get(r, 1, &b)) {
+        return false;
+    }
+    if (b) {
+        if (!br_get(r, 1, &b)) {
+            return false;
+        }
+        if (b) {
+            uint32_t lead, len;
+            if (!br_get(r, 5, &lead) || !br_get(r, 5, &len)) {
+                return false;
+            }
+            st->prev_lead[col] = (uint8_t)lead;
+            st->prev_len[col] = (uint8_t)(len + 1);
+        } else if (st->prev_len[col] == 0) {
+            return false;
+        }
+        int plead = st->prev_lead[col];
+        int plen = st->prev_len[col];
+        uint32_t x;
+        if (plead + plen > 32 || !br_get(r, plen, &x)) {
+            return false;
+        }
+        st->prev_bits[col] ^= x << (32 - plead - plen);
+    }
+    memcpy(out, &st->prev_bits[col], sizeof(*out));
+    return true;
+}
+
+static esp_err_t gorilla_decode(void *state, codec_src_t *in, codec_sink_t *out) {
+    gorilla_state_t *st = (gorilla_state_t *)state;
+    bit_reader_t r = { .in = in };
+    uint32_t b;
+    while (br_get(&r, 1, &b)) {
+        if (b) {
+            if (!br_get(&r, 1, &b)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (!b) {
+                uint32_t len;
+                uint32_t more = 0;
+                if (!br_get(&r, 16, &len) || (len == GORILLA_LITERAL_LONG && !br_get(&r, 32, &more))) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                len += more;
+                for (uint32_t i = 0; i < len; i++) {
+                    if (!br_get(&r, 8, &b)) {
+                        return ESP_ERR_INVALID_SIZE;
+                    }
+                    codec_sink_putc(out, (uint8_t)b);
+                }
+                codec_sink_putc(out, '\n');
+                continue;
+            }
+            uint32_t ncols, has_ts;
+            if (!br_get(&r, 6, &ncols) || !br_get(&r, 1, &has_ts)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            if (ncols == 0) {
+                r.nbits -= r.nbits % 8;
+                continue;
+            }
+            if (ncols > GORILLA_MAX_COLUMNS) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            for (uint32_t i = has_ts ? 1 : 0; i < ncols; i++) {
+                if (!br_get(&r, 4, &b)) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                if (b > CODEC_MAX_DECIMALS) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                st->decimals[i] = (uint8_t)b;
+            }
+            for (uint32_t i = st->ncols; i < ncols; i++) {
+                st->prev_bits[i] = 0;
+                st->prev_len[i] = 0;
+            }
+            st->ncols = (uint8_t)ncols;
+            st->has_ts = has_ts != 0;
+        }
+        for (int i = 0; i < st->ncols; i++) {
+            if (i > 0) {
+                codec_sink_putc(out, ',');
+            }
+            if (i == 0 && st->has_ts) {
+                int64_t ts;
+                if (!gorilla_get_ts(st, &r, &ts)) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                codec_sink_put_fixed(out, ts, 0);
+            } else {
+                float v;
+                int64_t mant;
+                if (!gorilla_get_value(st, &r, i, &v)) {
+                    return ESP_ERR_INVALID_SIZE;
+                }
+                if (!float_fixed(v, st->decimals[i], &mant)) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                codec_sink_put_fixed(out, mant, st->decimals[i]);
+            }
+        }
+        codec_sink_putc(out, '\n');
+    }
+    return out->err;
+}
+
+const compression_codec_t codec_gorilla = {
+    .name = "gorilla",
+    .id = 3,
+    .state_size = sizeof(gorilla_state_t),
+    .persist_size = offsetof(gorilla_state_t, fields),
+    .init = gorilla_init,
+    .encode_chunk = gorilla_encode_chunk,
+    .flush = gorilla_flush,
+    .decode = gorilla_decode,
+};
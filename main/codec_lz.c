@@ -0,0 +1,226 @@
+#include "codec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+* LZ Compression: byte-oriented LZ77 over a small sliding window, one block per pass.
+* Sequence := token, [literal length ext], literals, [offset:16 LE, [match length ext]]
+*   token high nibble: literal count (15 = more in ext bytes), low nibble: match length - 3 (0 = no match).
+*   ext bytes add 255 each until a byte below 255.
+* A token of 0x00 ends the block; the decoder then forgets its history, so every pass decodes on its own.
+* All memory (window, lookahead, hash heads) lives in the codec state: no allocation while encoding.
+*/
+#define LZ_WINDOW     2048                 /* Max match distance; also the decoder's history size. */
+#define LZ_BUF_SIZE   (2u * LZ_WINDOW)     /* Window + lookahead; slides down by LZ_WINDOW when full. */
+#define LZ_HASH_BITS  10
+#define LZ_HASH_SIZE  (1 << LZ_HASH_BITS)
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_MATCH  264
+#define LZ_EMPTY      0xFFFF
+
+typedef struct {
+    uint16_t fill;       /* Bytes buffered in buf. */
+    uint16_t pos;        /* Next position to encode. */
+    uint16_t lit_start;  /* First literal not yet emitted. */
+    uint16_t head[LZ_HASH_SIZE];
+    uint8_t  buf[LZ_BUF_SIZE];
+} lz_state_t;
+
+typedef struct {
+    uint16_t hpos;
+    uint8_t  hist[LZ_WINDOW];
+} lz_decode_state_t;
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void lz_put_ext(codec_sink_t *out, size_t n) {
+    while (n >= 255) {
+        codec_sink_putc(out, 255);
+        n -= 255;
+    }
+    codec_sink_putc(out, (uint8_t)n);
+}
+
+static void lz_emit(codec_sink_t *out, const uint8_t *lit, size_t nlit, size_t mlen, size_t dist) {
+    size_t mcode = mlen ? mlen - 3 : 0;
+    codec_sink_putc(out, (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15)));
+    if (nlit >= 15) {
+        lz_put_ext(out, nlit - 15);
+    }
+    codec_sink_write(out, lit, nlit);
+    if (mlen) {
+        codec_sink_putc(out, (uint8_t)dist);
+        codec_sink_putc(out, (uint8_t)(dist >> 8));
+        if (mcode >= 15) {
+            lz_put_ext(out, mcode - 15);
+        }
+    }
+}
+
+/* Encode up to the lookahead limit, or everything when final. */
+static void lz_compress(lz_state_t *st, codec_sink_t *out, bool final) {
+    size_t end = st->fill;
+    size_t limit = final ? end : (end > LZ_MAX_MATCH ? end - LZ_MAX_MATCH : 0);
+    const uint8_t *buf = st->buf;
+
+    while (st->pos < limit) {
+        size_t p = st->pos;
+        if (p + LZ_MIN_MATCH > end) {
+            st->pos = (uint16_t)end;
+            break;
+        }
+        uint32_t h = lz_hash(buf + p);
+        size_t cand = st->head[h];
+        st->head[h] = (uint16_t)p;
+
+        size_t len = 0;
+        if (cand != LZ_EMPTY && cand < p && p - cand <= LZ_WINDOW) {
+            size_t max = end - p < LZ_MAX_MATCH ? end - p : LZ_MAX_MATCH;
+            while (len < max && buf[cand + len] == buf[p + len]) {
+                len++;
+            }
+        }
+        if (len < LZ_MIN_MATCH) {
+            st->pos++;
+            continue;
+        }
+
+        lz_emit(out, buf + st->lit_start, p - st->lit_start, len, p - cand);
+        for (size_t q = p + 1; q < p + len && q + LZ_MIN_MATCH <= end; q++) {
+            st->head[lz_hash(buf + q)] = (uint16_t)q;
+        }
+        st->pos = (uint16_t)(p + len);
+        st->lit_start = st->pos;
+    }
+}
+
+/* Drop the oldest LZ_WINDOW bytes; pending literals in that half are emitted first. */
+static void lz_slide(lz_state_t *st, codec_sink_t *out) {
+    if (st->lit_start < LZ_WINDOW && st->pos > st->lit_start) {
+        lz_emit(out, st->buf + st->lit_start, st->pos - st->lit_start, 0, 0);
+        st->lit_start = st->pos;
+    }
+    memmove(st->buf, st->buf + LZ_WINDOW, st->fill - LZ_WINDOW);
+    st->fill -= LZ_WINDOW;
+    st->pos -= LZ_WINDOW;
+    st->lit_start -= LZ_WINDOW;
+    for (size_t i = 0; i < LZ_HASH_SIZE; i++) {
+        st->head[i] = (st->head[i] != LZ_EMPTY && st->head[i] >= LZ_WINDOW) ? st->head[i] - LZ_WINDOW : LZ_EMPTY;
+    }
+}
+
+static void lz_init(void *state) {
+    lz_state_t *st = (lz_state_t *)state;
+    st->fill = 0;
+    st->pos = 0;
+    st->lit_start = 0;
+    memset(st->head, 0xFF, sizeof(st->head));
+}
+
+static esp_err_t lz_encode_chunk(void *state, const char *rows, size_t len, codec_sink_t *out) {
+    lz_state_t *st = (lz_state_t *)state;
+    while (len > 0) {
+        if (st->fill == LZ_BUF_SIZE) {
+            lz_slide(st, out);
+        }
+        size_t n = LZ_BUF_SIZE - st->fill < len ? LZ_BUF_SIZE - st->fill : len;
+        memcpy(st->buf + st->fill, rows, n);
+        st->fill += (uint16_t)n;
+        rows += n;
+        len -= n;
+        lz_compress(st, out, false);
+    }
+    return out->err;
+}
+
+/* Close the block: encode the lookahead, emit trailing literals and the end token. */
+static esp_err_t lz_flush(void *state, codec_sink_t *out) {
+    lz_state_t *st = (lz_state_t *)state;
+    lz_compress(st, out, true);
+    if (st->lit_start < st->fill) {
+        lz_emit(out, st->buf + st->lit_start, st->fill - st->lit_start, 0, 0);
+    }
+    codec_sink_putc(out, 0x00);
+    lz_init(st);
+    return out->err;
+}
+
+static bool lz_get_ext(codec_src_t *in, size_t *n) {
+    int c;
+    do {
+        c = codec_src_getc(in);
+        if (c < 0) {
+            return false;
+        }
+        *n += (size_t)c;
+    } while (c == 255);
+    return true;
+}
+
+static inline void lz_out(lz_decode_state_t *st, codec_sink_t *out, uint8_t b) {
+    st->hist[st->hpos] = b;
+    st->hpos = (st->hpos + 1) & (LZ_WINDOW - 1);
+    codec_sink_putc(out, b);
+}
+
+static esp_err_t lz_decode(void *state, codec_src_t *in, codec_sink_t *out) {
+    lz_decode_state_t *st = (lz_decode_state_t *)state;
+    st->hpos = 0;
+    size_t produced = 0; /* Bytes in history since the block started. */
+    int token;
+    while ((token = codec_src_getc(in)) >= 0) {
+        if (token == 0) {
+            st->hpos = 0;
+            produced = 0;
+            continue;
+        }
+        size_t nlit = (size_t)token >> 4;
+        if (nlit == 15 && !lz_get_ext(in, &nlit)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        for (size_t i = 0; i < nlit; i++) {
+            int c = codec_src_getc(in);
+            if (c < 0) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            lz_out(st, out, (uint8_t)c);
+        }
+        produced += nlit;
+
+        size_t mcode = (size_t)token & 0x0F;
+        if (mcode == 0) {
+            continue;
+        }
+        int lo = codec_src_getc(in);
+        int hi = codec_src_getc(in);
+        if (lo < 0 || hi < 0 || (mcode == 15 && !lz_get_ext(in, &mcode))) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t dist = (size_t)lo | ((size_t)hi << 8);
+        if (dist == 0 || dist > LZ_WINDOW || dist > produced) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        size_t mlen = mcode + 3;
+        for (size_t i = 0; i < mlen; i++) {
+            lz_out(st, out, st->hist[(st->hpos - dist) & (LZ_WINDOW - 1)]);
+        }
+        produced += mlen;
+    }
+    return out->err;
+}
+
+const compression_codec_t codec_lz = {
+    .name = "lz",
+    .id = 4,
+    .state_size = sizeof(lz_state_t) > sizeof(lz_decode_state_t) ? sizeof(lz_state_t) : sizeof(lz_decode_state_t),
+    .persist_size = 0, /* Each pass is a closed block. */
+    .init = lz_init,
+    .encode_chunk = lz_encode_chunk,
+    .flush = lz_flush,
+    .decode = lz_decode,
+};
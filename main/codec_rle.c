@@ -0,0 +1,114 @@
+#include "codec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+* RLE Compression: one text record "count,row" per run of identical rows.
+* The open run stays in state until a different row ends it or the pass/frame is flushed.
+* Rows longer than RLE_MAX_ROW are never merged and go out as "1,row".
+*/
+#define RLE_MAX_ROW 256
+
+typedef struct {
+    char     prev_row[RLE_MAX_ROW];
+    uint16_t prev_len;
+    uint32_t count;
+} rle_state_t;
+
+static void rle_put_run(codec_sink_t *out, const char *row, size_t len, uint32_t count) {
+    char hdr[16];
+    int n = snprintf(hdr, sizeof(hdr), "%u,", (unsigned)count);
+    codec_sink_write(out, hdr, (size_t)n);
+    codec_sink_write(out, row, len);
+    codec_sink_putc(out, '\n');
+}
+
+static void rle_init(void *state) {
+    memset(state, 0, sizeof(rle_state_t));
+}
+
+static esp_err_t rle_encode_chunk(void *state, const char *rows, size_t len, codec_sink_t *out) {
+    rle_state_t *st = (rle_state_t *)state;
+    const char *p = rows;
+    const char *end = rows + len;
+    const char *row;
+    size_t row_len;
+
+    /* Whole lines, '\r' included, so CRLF files decode byte for byte. */
+    while (codec_next_line(&p, end, &row, &row_len)) {
+        if (st->count > 0 && row_len == st->prev_len && memcmp(row, st->prev_row, row_len) == 0) {
+            st->count++;
+            continue;
+        }
+        if (st->count > 0) {
+            rle_put_run(out, st->prev_row, st->prev_len, st->count);
+            st->count = 0;
+        }
+        if (row_len > RLE_MAX_ROW) {
+            rle_put_run(out, row, row_len, 1);
+            continue;
+        }
+        memcpy(st->prev_row, row, row_len);
+        st->prev_len = (uint16_t)row_len;
+        st->count = 1;
+    }
+    return out->err;
+}
+
+/* Emit the open run so the output decodes up to here; the next row starts a new run. */
+static esp_err_t rle_flush(void *state, codec_sink_t *out) {
+    rle_state_t *st = (rle_state_t *)state;
+    if (st->count > 0) {
+        rle_put_run(out, st->prev_row, st->prev_len, st->count);
+        st->count = 0;
+    }
+    return out->err;
+}
+
+static esp_err_t rle_decode(void *state, codec_src_t *in, codec_sink_t *out) {
+    (void)state;
+    char row[RLE_MAX_ROW];
+    int c;
+    while ((c = codec_src_getc(in)) >= 0) {
+        uint32_t count = 0;
+        while (c >= '0' && c <= '9') {
+            count = count * 10 + (uint32_t)(c - '0');
+            c = codec_src_getc(in);
+        }
+        if (c != ',' || count == 0) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (count == 1) {
+            /* Single rows may be longer than RLE_MAX_ROW: stream them through. */
+            while ((c = codec_src_getc(in)) >= 0 && c != '\n') {
+                codec_sink_putc(out, (uint8_t)c);
+            }
+            codec_sink_putc(out, '\n');
+            continue;
+        }
+        size_t len = 0;
+        while ((c = codec_src_getc(in)) >= 0 && c != '\n') {
+            if (len == sizeof(row)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            row[len++] = (char)c;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            codec_sink_write(out, row, len);
+            codec_sink_putc(out, '\n');
+        }
+    }
+    return out->err;
+}
+
+const compression_codec_t codec_rle = {
+    .name = "rle",
+    .id = 1,
+    .state_size = sizeof(rle_state_t),
+    .persist_size = 0, /* flush closes the open run at the end of every pass. */
+    .init = rle_init,
+    .encode_chunk = rle_encode_chunk,
+    .flush = rle_flush,
+    .decode = rle_decode,
+};
@@ -1,153 +1,1037 @@
 #include "compression.h"
+#include "codec.h"
+#include "container.h"
+#include "line_reader.h"
+#include "io_lock.h"
+#include "page_write.h"
+#include "segment.h"
+#include "metrics.h"
+#include "trace.h"
 #include "global.h" 
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static const char *TAG = "compress";
 
 static TaskHandle_t c_task = NULL;
-static char compression_algorithm[16] = "rle"; // Default: Run Length Encoding
-static char s_in[128];
-static char s_out[128];
+/* compression_stop() asks the task to leave between passes; the task clears c_running on its way out. */
+static _Atomic bool c_stop = false;
+static _Atomic bool c_running = false;
 static int  compression_freq = 30000;
+static uint32_t s_frame_rows = COMPRESSION_FRAME_ROWS;  /* For streams created from now on. */
 
-/* RLE Compression Function. */
-static void run_rle_compression(const char *input_file, const char *output_file) {
-    if (!spi_flash_lock || xSemaphoreTake(spi_flash_lock, pdMS_TO_TICKS(5000)) != pdTRUE) {
-        ESP_LOGE(TAG, "RLE Compression: Timeout");
-        return;
+/* Driver output block size (input goes through the line reader). */
+#define COMPRESSION_OUT_BLOCK 1024
+
+/* Outputs set aside by rebuilds ("<output>.1" ...) before one refuses to run. */
+#define COMPRESSION_ASIDE_MAX 9
+
+#define COMPRESSION_TASK_STACK 4096
+
+/* Longest wait for spi_flash_lock before a pass gives up. */
+#define COMPRESSION_LOCK_TICKS pdMS_TO_TICKS(5000)
+
+/* Checkpoint Format Identifiers. */
+#define CKPT_MAGIC   0x4B435A53u /* "SZCK" */
+#define CKPT_VERSION 8u
+
+/* Reclaims committed in the checkpoint whose temp file may not have been renamed over the original yet. */
+#define CKPT_SWAP_IN  1u
+#define CKPT_SWAP_OUT 2u
+
+/*
+* Persisted progress of the incremental compressor.
+* in_offset is the first input byte not yet compressed, out_size is the output length that matches it.
+* frames counts the closed frames; the open frame (if any) is described by the frame_* fields.
+* in_dropped / out_dropped count the bytes reclaimed from the front of the input and output (see retention.h).
+* state holds the first persist_size bytes of the codec's state, carried from one pass to the next.
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char     algo[16];
+    uint32_t in_offset;
+    uint32_t out_size;
+    uint32_t frames;
+    uint32_t frame_open;
+    uint32_t frame_off;
+    uint32_t frame_rows;
+    int64_t  frame_first_ts;
+    uint32_t in_dropped;
+    uint32_t out_dropped;
+    uint32_t swap;           /* CKPT_SWAP_* */
+    uint32_t swap_in_size;   /* Input size when its tail was copied to the temp file. */
+    uint64_t state[CODEC_STATE_MAX / sizeof(uint64_t)];
+    uint32_t checksum;
+} compression_ckpt_t;
+
+/* Everything one input/output pair needs between passes. */
+struct compression_stream {
+    char in[128];
+    char out[128];
+    char ckpt_path[144];
+    char ckpt_tmp_path[148];
+    char idx_path[144];
+    char in_tmp_path[132];
+    char in_old_path[132];
+    char out_tmp_path[132];
+    const compression_codec_t *codec;
+    uint32_t frame_rows;
+    segment_store_t *store;            /* Segment mode when set. */
+    compression_ckpt_t ckpt;
+    bool ckpt_loaded;
+    /* Live codec state (persisted prefix + working memory), allocated for the active codec. */
+    void *state;
+    const compression_codec_t *state_codec;
+    compression_stats_t stats;         /* Statistics of the most recent pass. */
+    int64_t lock_taken_us;
+    io_lock_t io;                      /* Per-access locking for the line reader and the output sink. */
+};
+
+/* The stream behind compression_start() and the other functions without a stream argument. */
+static compression_stream_t s_default = { .codec = &codec_rle, .frame_rows = COMPRESSION_FRAME_ROWS }; // Default: Run Length Encoding
+
+/* FNV-1a over everything but the trailing checksum. */
+static uint32_t ckpt_checksum(const compression_ckpt_t *c) {
+    const uint8_t *p = (const uint8_t *)c;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(compression_ckpt_t, checksum); i++) {
+        h = (h ^ p[i]) * 16777619u;
     }
+    return h;
+}
 
-    FILE *in = fopen(input_file, "r");
-    FILE *out = NULL;
-    if (in){
-       out = fopen(output_file, "w");
+static void ckpt_reset(compression_ckpt_t *c, const compression_codec_t *codec, void *state) {
+    memset(c, 0, sizeof(*c));
+    c->magic = CKPT_MAGIC;
+    c->version = CKPT_VERSION;
+    strncpy(c->algo, codec->name, sizeof(c->algo) - 1);
+    codec->init(state);
+}
+
+static bool ckpt_read(const char *path, compression_ckpt_t *c) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
     }
+    size_t rd = fread(c, 1, sizeof(*c), f);
+    fclose(f);
+    return rd == sizeof(*c) && c->magic == CKPT_MAGIC && c->version == CKPT_VERSION && c->checksum == ckpt_checksum(c);
+}
 
-    if (!in || !out) {
-        ESP_LOGE(TAG, "RLE Compression: fopen failed (in=%p, out=%p)", (void*)in, (void*)out);
-        if (in){
-            fclose(in);
+/* Write temp, fsync, then swap in. SPIFFS rename does not replace an existing file. */
+static esp_err_t ckpt_write(compression_stream_t *cs, compression_ckpt_t *c) {
+    c->checksum = ckpt_checksum(c);
+    FILE *f = fopen(cs->ckpt_tmp_path, "wb");
+    if (!f) {
+        ESP_LOGE(TAG, "Checkpoint: fopen(%s) failed", cs->ckpt_tmp_path);
+        return ESP_FAIL;
+    }
+    size_t wr = page_write(f, c, sizeof(*c));
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    if (wr != sizeof(*c)) {
+        ESP_LOGE(TAG, "Checkpoint: short write (%zu/%zu)", wr, sizeof(*c));
+        return ESP_FAIL;
+    }
+    remove(cs->ckpt_path);
+    if (rename(cs->ckpt_tmp_path, cs->ckpt_path) != 0) {
+        ESP_LOGE(TAG, "Checkpoint: rename failed");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ckpt_save(compression_stream_t *cs, compression_ckpt_t *c, const compression_codec_t *codec, const void *state) {
+    memcpy(c->state, state, codec->persist_size);
+    return ckpt_write(cs, c);
+}
+
+/*
+* Copy [from, to) of src to the end of dst, taking lock around each block when set.
+* Blocks end on pages of dst, which should be unbuffered.
+*/
+static esp_err_t copy_range(FILE *src, uint32_t from, uint32_t to, FILE *dst, const io_lock_t *lock) {
+    uint8_t *buf = malloc(COMPRESSION_OUT_BLOCK);
+    if (!buf || fseek(dst, 0, SEEK_END) != 0) {
+        free(buf);
+        return buf ? ESP_FAIL : ESP_ERR_NO_MEM;
+    }
+    uint32_t at = (uint32_t)ftell(dst);
+    esp_err_t err = ESP_OK;
+    for (uint32_t pos = from; err == ESP_OK && pos < to;) {
+        size_t n = COMPRESSION_OUT_BLOCK - at % PAGE_WRITE_SIZE;
+        n = to - pos < n ? to - pos : n;
+        if (lock && !lock->take(lock->ctx)) {
+            err = ESP_ERR_TIMEOUT;
+            break;
         }
-        if (out){
-            fclose(out);
+        if (fseek(src, (long)pos, SEEK_SET) != 0 || fread(buf, 1, n, src) != n || page_write(dst, buf, n) != n) {
+            err = ESP_FAIL;
+        }
+        if (lock) {
+            lock->give(lock->ctx);
+        }
+        pos += (uint32_t)n;
+        at += (uint32_t)n;
+    }
+    free(buf);
+    return err;
+}
+
+/* Append all of path from offset from to dst; false if path cannot be read. */
+static bool carry_over(const char *path, uint32_t from, FILE *dst) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    if ((uint32_t)st.st_size > from) {
+        ESP_LOGW(TAG, "%s: carrying %u late bytes over", path, (unsigned)(st.st_size - from));
+        copy_range(f, from, (uint32_t)st.st_size, dst, NULL);
+    }
+    fclose(f);
+    return true;
+}
+
+/*
+* Finish a reclaim the checkpoint committed: its temp file is complete, but may not have replaced the original.
+* The input is moved aside to "<input>.old" before the temp file takes its name, so rows appended after the tail
+* was copied are found in the old file (past swap_in_size) and, if a writer recreated the input, all through it.
+* Without a committed reclaim, temp files are leftovers of one interrupted before its commit.
+* Caller holds spi_flash_lock.
+*/
+static void swap_finish(compression_stream_t *cs, compression_ckpt_t *c) {
+    struct stat st;
+    if (!(c->swap & CKPT_SWAP_IN)) {
+        remove(cs->in_tmp_path);
+    } else if (stat(cs->in_tmp_path, &st) == 0) {
+        FILE *tmp = fopen(cs->in_tmp_path, "ab");
+        if (tmp) {
+            setvbuf(tmp, NULL, _IONBF, 0);
+            if (carry_over(cs->in_old_path, c->swap_in_size, tmp)) {
+                carry_over(cs->in, 0, tmp);
+            } else {
+                carry_over(cs->in, c->swap_in_size, tmp);
+            }
+            fflush(tmp);
+            fsync(fileno(tmp));
+            fclose(tmp);
+        }
+        remove(cs->in);
+        rename(cs->in_tmp_path, cs->in);
+    }
+    remove(cs->in_old_path);
+    if (!(c->swap & CKPT_SWAP_OUT)) {
+        remove(cs->out_tmp_path);
+    } else if (stat(cs->out_tmp_path, &st) == 0) {
+        remove(cs->out);
+        rename(cs->out_tmp_path, cs->out);
+        /* Its entries may still hold the old offsets: readers walk the headers, new frames are indexed again. */
+        remove(cs->idx_path);
+    }
+    if (c->swap) {
+        ESP_LOGW(TAG, "Finished an interrupted reclaim of %s / %s", cs->in, cs->out);
+        c->swap = 0;
+        ckpt_write(cs, c);
+    }
+}
+
+/* Restore the last checkpoint. A leftover temp file means a crash hit between remove and rename. */
+static void ckpt_load(compression_stream_t *cs, compression_ckpt_t *c, const compression_codec_t *codec, void *state) {
+    if (ckpt_read(cs->ckpt_path, c) || ckpt_read(cs->ckpt_tmp_path, c)) {
+        ESP_LOGI(TAG, "Resuming from checkpoint: offset=%u out=%u algo=%s", (unsigned)c->in_offset, (unsigned)c->out_size, c->algo);
+        swap_finish(cs, c);
+        codec->init(state);
+        if (strcmp(c->algo, codec->name) == 0) {
+            memcpy(state, c->state, codec->persist_size);
         }
-        
-        xSemaphoreGive(spi_flash_lock);
         return;
     }
+    ckpt_reset(c, codec, state);
+}
+
+/* Flash lock wrappers that account wait and hold time in the stream's stats. */
+static bool flash_lock_take(compression_stream_t *cs, TickType_t ticks) {
+    int64_t t0 = esp_timer_get_time();
+    if (!metrics_lock_take(METRIC_SITE_COMPRESS, ticks)) {
+        return false;
+    }
+    cs->lock_taken_us = esp_timer_get_time();
+    cs->stats.lock_wait_us += cs->lock_taken_us - t0;
+    return true;
+}
+
+static void flash_lock_give(compression_stream_t *cs) {
+    int64_t held = esp_timer_get_time() - cs->lock_taken_us;
+    cs->stats.lock_hold_us += held;
+    if (held > cs->stats.lock_hold_max_us) {
+        cs->stats.lock_hold_max_us = held;
+    }
+    cs->stats.lock_sections++;
+    metrics_lock_give(METRIC_SITE_COMPRESS);
+}
+
+static bool flash_io_take(void *ctx) {
+    return flash_lock_take((compression_stream_t *)ctx, COMPRESSION_LOCK_TICKS);
+}
 
-    char prev_line[256] = "";
-    char curr_line[256];
-    int count = 0;
+static void flash_io_give(void *ctx) {
+    flash_lock_give((compression_stream_t *)ctx);
+}
+
+/* Output side of a pass: the container, its index and the sink the codec writes through. */
+typedef struct {
+    compression_stream_t      *cs;
+    FILE                      *out;
+    FILE                      *idx;
+    codec_sink_t               sink;
+    uint32_t                   base;   /* Output size when the sink was opened. */
+    const compression_codec_t *codec;
+} frame_writer_t;
 
-    while (fgets(curr_line, sizeof(curr_line), in)) {
-        if (strcmp(curr_line, prev_line) ==0) {
-            count++;
-        } else {
-            if (count > 0) {
-                fprintf(out, "%s,%d\n", prev_line, count);
+static void frame_begin(frame_writer_t *w, const char *row, size_t len) {
+    compression_stream_t *cs = w->cs;
+    const char *nl = memchr(row, '\n', len);
+    container_frame_t fh = { .magic = CONTAINER_FRAME_MAGIC };
+    cs->ckpt.frame_open = 1;
+    cs->ckpt.frame_off = w->base + (uint32_t)w->sink.total;
+    cs->ckpt.frame_rows = 0;
+    cs->ckpt.frame_first_ts = container_row_ts(row, nl ? (size_t)(nl - row) : len);
+    codec_sink_write(&w->sink, &fh, sizeof(fh));
+    w->codec->init(cs->state);
+}
+
+/*
+* Make the open frame decodable up to here: flush the codec, then rewrite the frame header and its index entry.
+* With close set the frame is finished and the next row starts a new one.
+*/
+static esp_err_t frame_end(frame_writer_t *w, bool close) {
+    compression_stream_t *cs = w->cs;
+    TRACE_BEGIN("codec.flush", cs->ckpt.frame_rows);
+    esp_err_t err = w->codec->flush(cs->state, &w->sink);
+    TRACE_END("codec.flush");
+    if (err == ESP_OK) {
+        err = codec_sink_flush(&w->sink);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint32_t end = w->base + (uint32_t)w->sink.total;
+    container_frame_t fh = {
+        .magic = CONTAINER_FRAME_MAGIC,
+        .rows = cs->ckpt.frame_rows,
+        .payload_len = end - cs->ckpt.frame_off - (uint32_t)sizeof(fh),
+        .first_ts = cs->ckpt.frame_first_ts,
+    };
+    container_index_t e = {
+        .first_ts = cs->ckpt.frame_first_ts,
+        .rows = cs->ckpt.frame_rows,
+        .offset = cs->ckpt.frame_off,
+    };
+    if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (fseek(w->out, (long)cs->ckpt.frame_off, SEEK_SET) != 0
+        || page_write(w->out, &fh, sizeof(fh)) != sizeof(fh)
+        || fseek(w->out, 0, SEEK_END) != 0) {
+        ESP_LOGE(TAG, "Frame %u: header update failed", (unsigned)cs->ckpt.frames);
+        flash_lock_give(cs);
+        return ESP_FAIL;
+    }
+    /* The index is only a cache of the frame headers: a failed update slows readers down but loses nothing. */
+    if (fseek(w->idx, (long)(cs->ckpt.frames * sizeof(e)), SEEK_SET) != 0
+        || page_write(w->idx, &e, sizeof(e)) != sizeof(e)) {
+        ESP_LOGW(TAG, "Frame %u: index update failed", (unsigned)cs->ckpt.frames);
+    }
+    flash_lock_give(cs);
+    if (close) {
+        cs->ckpt.frames++;
+        cs->ckpt.frame_open = 0;
+    }
+    return ESP_OK;
+}
+
+/* Encode a chunk of complete rows, cutting a new frame every cs->frame_rows rows. */
+static esp_err_t frame_encode(frame_writer_t *w, const char *rows, size_t len) {
+    compression_stream_t *cs = w->cs;
+    const char *p = rows;
+    const char *end = rows + len;
+    while (p < end) {
+        if (!cs->ckpt.frame_open) {
+            frame_begin(w, p, (size_t)(end - p));
+        }
+        const char *q = end;
+        uint32_t n = (uint32_t)line_count(p, (size_t)(end - p));
+        if (cs->ckpt.frame_rows + n > cs->frame_rows) {
+            /* Cut the chunk where the frame fills up. */
+            q = p;
+            n = 0;
+            while (q < end && cs->ckpt.frame_rows + n < cs->frame_rows) {
+                q += line_find(q, (size_t)(end - q)) + 1;
+                n++;
+            }
+        }
+        TRACE_BEGIN("codec.encode", q - p);
+        esp_err_t err = w->codec->encode_chunk(cs->state, p, (size_t)(q - p), &w->sink);
+        TRACE_END("codec.encode");
+        if (err != ESP_OK) {
+            return err;
+        }
+        cs->ckpt.frame_rows += n;
+        p = q;
+        if (cs->ckpt.frame_rows >= cs->frame_rows) {
+            err = frame_end(w, true);
+            if (err != ESP_OK) {
+                return err;
             }
-            strncpy(prev_line, curr_line, sizeof(prev_line) - 1);
-            prev_line[sizeof(prev_line) - 1] = '\0';
-            count =1;
         }
     }
-    if (count >0) {
-        fprintf(out, "%s,%d\n", prev_line, count);
+    return w->sink.err;
+}
+
+/*
+* Parallel Encoding.
+* Full frames of a long pass are independent, so they are cut from the input here, encoded by a pool of
+* encoder tasks (one per core by default) into memory, and written out in input order. A frame holds the same
+* rows whichever task encodes it, so the output does not depend on the number of workers. The open frame and
+* the trailing partial one go through frame_encode() as before, since their codec state is carried across passes.
+*/
+#define ENCODER_TASK_STACK 4096
+
+typedef struct {
+    const compression_codec_t *codec;
+    char             *rows;     /* Input: the frame's rows, copied out of the line reader. */
+    size_t            len;
+    size_t            cap;
+    uint32_t          nrows;
+    codec_sink_t      out;      /* Payload, in memory. */
+    void             *state;
+    esp_err_t         err;
+    SemaphoreHandle_t done;     /* The batch's: given once per finished job. */
+} encode_job_t;
+
+typedef struct {
+    encode_job_t      jobs[COMPRESSION_MAX_WORKERS];
+    int               count;    /* Frames per batch. */
+    SemaphoreHandle_t done;
+} encode_batch_t;
+
+_Static_assert(METRIC_MAX_TASKS >= 8 + COMPRESSION_MAX_WORKERS, "the metrics task table must fit every encoder");
+
+static int s_workers = portNUM_PROCESSORS;
+static QueueHandle_t s_enc_queue = NULL;
+static int s_enc_claimed = 0;               /* Encoder tasks being or already created. */
+static _Atomic int s_enc_running = 0;
+static portMUX_TYPE s_enc_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void encode_job(encode_job_t *j) {
+    TRACE_BEGIN("codec.encode_frame", j->len);
+    j->codec->init(j->state);
+    j->err = j->codec->encode_chunk(j->state, j->rows, j->len, &j->out);
+    if (j->err == ESP_OK) {
+        j->err = j->codec->flush(j->state, &j->out);
+    }
+    if (j->err == ESP_OK) {
+        j->err = j->out.err;
     }
+    TRACE_END("codec.encode_frame");
+}
 
-    fclose(in);
-    fclose(out);
-    xSemaphoreGive(spi_flash_lock);
+static void encoder_task(void *arg) {
+    char name[16];
+    snprintf(name, sizeof(name), "encoder%d", (int)(intptr_t)arg);
+    metrics_register_task(xTaskGetCurrentTaskHandle(), name, ENCODER_TASK_STACK);
+    for (;;) {
+        encode_job_t *j;
+        if (xQueueReceive(s_enc_queue, &j, portMAX_DELAY) == pdTRUE) {
+            encode_job(j);
+            xSemaphoreGive(j->done);
+        }
+    }
+}
+
+/* Grow the pool to want tasks, pinned round-robin over the cores. Returns the number running. */
+static int encoder_pool_grow(int want) {
+    /* The queue exists before any task is claimed: a task never starts on a missing one. */
+    portENTER_CRITICAL(&s_enc_mux);
+    bool have_queue = s_enc_queue != NULL;
+    portEXIT_CRITICAL(&s_enc_mux);
+    if (!have_queue) {
+        QueueHandle_t q = xQueueCreate(COMPRESSION_MAX_WORKERS, sizeof(encode_job_t *));
+        if (!q) {
+            ESP_LOGE(TAG, "No memory for the encoder queue: encoding sequentially");
+            return s_enc_running;
+        }
+        portENTER_CRITICAL(&s_enc_mux);
+        have_queue = s_enc_queue != NULL;   /* Another pass got there first. */
+        if (!have_queue) {
+            s_enc_queue = q;
+        }
+        portEXIT_CRITICAL(&s_enc_mux);
+        if (have_queue) {
+            vQueueDelete(q);
+        }
+    }
+    for (;;) {
+        portENTER_CRITICAL(&s_enc_mux);
+        int i = s_enc_claimed;
+        bool grow = i < want;
+        if (grow) {
+            s_enc_claimed++;
+        }
+        portEXIT_CRITICAL(&s_enc_mux);
+        if (!grow) {
+            break;
+        }
+        if (xTaskCreatePinnedToCore(encoder_task, "encoder_task", ENCODER_TASK_STACK, (void *)(intptr_t)i, 4, NULL,
+                                    i % portNUM_PROCESSORS) != pdPASS) {
+            ESP_LOGE(TAG, "Could not start encoder %d", i);
+            portENTER_CRITICAL(&s_enc_mux);
+            s_enc_claimed--;
+            portEXIT_CRITICAL(&s_enc_mux);
+            break;
+        }
+        s_enc_running++;
+    }
+    return s_enc_running;
+}
 
-    ESP_LOGI(TAG, "RLE Compression done: %s -> %s", input_file, output_file);
+static void batch_free(encode_batch_t *b) {
+    for (int i = 0; i < COMPRESSION_MAX_WORKERS; i++) {
+        free(b->jobs[i].rows);
+        free(b->jobs[i].out.buf);
+        free(b->jobs[i].state);
+    }
+    if (b->done) {
+        vSemaphoreDelete(b->done);
+    }
 }
 
-/* Delta Encoding Compression. */
-static void run_delta_encoding_compression(const char *input_file, const char *output_file) {
-    if (!spi_flash_lock || xSemaphoreTake(spi_flash_lock, pdMS_TO_TICKS(5000)) != pdTRUE) {
-        ESP_LOGE(TAG, "Delta: lock timeout");
-        return;
+static bool batch_init(encode_batch_t *b, const compression_codec_t *codec, int count) {
+    memset(b, 0, sizeof(*b));
+    b->count = count;
+    b->done = xSemaphoreCreateCounting(count, 0);
+    bool ok = b->done != NULL;
+    for (int i = 0; i < count && ok; i++) {
+        encode_job_t *j = &b->jobs[i];
+        j->codec = codec;
+        j->done = b->done;
+        j->state = malloc(codec->state_size);
+        codec_sink_init_mem(&j->out, malloc(CODEC_SINK_MEM_MIN), CODEC_SINK_MEM_MIN);
+        ok = j->state && j->out.buf;
+    }
+    return ok;
+}
+
+/* Append whole rows to a job's input. */
+static bool job_append(encode_job_t *j, const char *rows, size_t len) {
+    if (j->len + len > j->cap) {
+        size_t cap = j->cap ? j->cap : LINE_READER_BLOCK;
+        while (cap < j->len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(j->rows, cap);
+        if (!buf) {
+            return false;
+        }
+        j->rows = buf;
+        j->cap = cap;
+    }
+    memcpy(j->rows + j->len, rows, len);
+    j->len += len;
+    return true;
+}
+
+/* Write an encoded frame after the ones before it: header, payload, index entry. */
+static esp_err_t frame_put(frame_writer_t *w, const encode_job_t *j) {
+    compression_stream_t *cs = w->cs;
+    const char *nl = memchr(j->rows, '\n', j->len);
+    container_frame_t fh = {
+        .magic = CONTAINER_FRAME_MAGIC,
+        .rows = j->nrows,
+        .payload_len = (uint32_t)j->out.len,
+        .first_ts = container_row_ts(j->rows, nl ? (size_t)(nl - j->rows) : j->len),
+    };
+    container_index_t e = {
+        .first_ts = fh.first_ts,
+        .rows = fh.rows,
+        .offset = w->base + (uint32_t)w->sink.total,
+    };
+    codec_sink_write(&w->sink, &fh, sizeof(fh));
+    codec_sink_write(&w->sink, j->out.buf, j->out.len);
+    if (w->sink.err != ESP_OK) {
+        return w->sink.err;
+    }
+    if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (fseek(w->idx, (long)(cs->ckpt.frames * sizeof(e)), SEEK_SET) != 0
+        || page_write(w->idx, &e, sizeof(e)) != sizeof(e)) {
+        ESP_LOGW(TAG, "Frame %u: index update failed", (unsigned)cs->ckpt.frames);
+    }
+    flash_lock_give(cs);
+    cs->ckpt.frames++;
+    return ESP_OK;
+}
+
+/* Encode the first n (full) jobs of the batch on the pool, write them in order and empty them. */
+static esp_err_t batch_run(frame_writer_t *w, encode_batch_t *b, int n) {
+    for (int i = 0; i < n; i++) {
+        encode_job_t *j = &b->jobs[i];
+        j->out.len = 0;
+        j->out.total = 0;
+        encode_job_t *jp = j;
+        xQueueSend(s_enc_queue, &jp, portMAX_DELAY);
+    }
+    for (int i = 0; i < n; i++) {
+        xSemaphoreTake(b->done, portMAX_DELAY);
+    }
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < n; i++) {
+        encode_job_t *j = &b->jobs[i];
+        if (err == ESP_OK) {
+            err = j->err != ESP_OK ? j->err : frame_put(w, j);
+        }
+        j->len = 0;
+        j->nrows = 0;
+    }
+    return err;
+}
+
+/* End of the first rows of [p, end), at most want of them; *got is how many. */
+static const char *rows_cut(const char *p, const char *end, uint32_t want, uint32_t *got) {
+    uint32_t n = (uint32_t)line_count(p, (size_t)(end - p));
+    if (n <= want) {
+        *got = n;
+        return end;
+    }
+    const char *q = p;
+    for (n = 0; n < want; n++) {
+        q += line_find(q, (size_t)(end - q)) + 1;
+    }
+    *got = n;
+    return q;
+}
+
+/*
+* Rest of the pass with workers frames in flight. Rows that finish the open frame are encoded here first;
+* rows that do not make a full frame at the end open one through frame_encode().
+* If frame buffers cannot be allocated the pass carries on sequentially, with the same output.
+*/
+static esp_err_t encode_parallel(frame_writer_t *w, line_reader_t *lr, int workers) {
+    compression_stream_t *cs = w->cs;
+    encode_batch_t *b = calloc(1, sizeof(*b));
+    bool streaming = !b || !batch_init(b, w->codec, workers);
+    if (streaming) {
+        ESP_LOGW(TAG, "No memory for %d parallel frames: encoding sequentially", workers);
+    }
+    esp_err_t err = ESP_OK;
+    int cur = 0;   /* Job being filled; the ones before it hold full frames. */
+    const char *rows;
+    size_t n;
+    while (err == ESP_OK && line_reader_rows(lr, &rows, &n)) {
+        TRACE_BEGIN("compress.chunk", n);
+        const char *p = rows;
+        const char *end = rows + n;
+        while (err == ESP_OK && p < end) {
+            uint32_t got;
+            if (!streaming && cs->ckpt.frame_open && cs->ckpt.frame_rows >= cs->frame_rows) {
+                err = frame_end(w, true);   /* Frame size was lowered since the frame was opened. */
+                continue;
+            }
+            if (streaming || cs->ckpt.frame_open) {
+                const char *q = streaming ? end : rows_cut(p, end, cs->frame_rows - cs->ckpt.frame_rows, &got);
+                err = frame_encode(w, p, (size_t)(q - p));
+                p = q;
+                continue;
+            }
+            encode_job_t *j = &b->jobs[cur];
+            const char *q = rows_cut(p, end, cs->frame_rows - j->nrows, &got);
+            if (!job_append(j, p, (size_t)(q - p))) {
+                ESP_LOGW(TAG, "No memory for frame input: encoding the rest of the pass sequentially");
+                err = batch_run(w, b, cur);
+                if (err == ESP_OK && j->len > 0) {
+                    err = frame_encode(w, j->rows, j->len);
+                }
+                cur = 0;
+                streaming = true;
+                continue;
+            }
+            j->nrows += got;
+            p = q;
+            if (j->nrows >= cs->frame_rows && ++cur == b->count) {
+                err = batch_run(w, b, cur);
+                cur = 0;
+            }
+        }
+        TRACE_END("compress.chunk");
+    }
+    if (err == ESP_OK && !streaming) {
+        err = batch_run(w, b, cur);
+        if (err == ESP_OK && b->jobs[cur].len > 0) {
+            err = frame_encode(w, b->jobs[cur].rows, b->jobs[cur].len);
+        }
+    }
+    if (b) {
+        batch_free(b);
+        free(b);
+    }
+    return err;
+}
+
+void compression_set_workers(int workers) {
+    s_workers = workers < 1 ? 1 : workers > COMPRESSION_MAX_WORKERS ? COMPRESSION_MAX_WORKERS : workers;
+}
+
+/*
+* The output holds rows no longer in the input, so a rebuild must not truncate it: rename it to the first free
+* "<output>.<n>" and let the rebuild start a new one. Caller holds spi_flash_lock.
+*/
+static esp_err_t output_set_aside(compression_stream_t *cs, const char *output_file) {
+    char path[144];
+    struct stat st;
+    for (int n = 1; n <= COMPRESSION_ASIDE_MAX; n++) {
+        snprintf(path, sizeof(path), "%s.%d", output_file, n);
+        if (stat(path, &st) == 0) {
+            continue;
+        }
+        if (rename(output_file, path) != 0) {
+            break;
+        }
+        remove(cs->idx_path);
+        ESP_LOGW(TAG, "%s holds reclaimed input: kept as %s, rebuilding from what is left", output_file, path);
+        return ESP_OK;
     }
+    ESP_LOGE(TAG, "%s holds reclaimed input and cannot be set aside: not rebuilding", output_file);
+    return ESP_FAIL;
+}
 
-    FILE *in = fopen(input_file, "r");
+/*
+* One incremental pass: compress only the bytes appended since the last checkpoint and append the result.
+* The driver owns locking, files, framing and buffering; the codec only sees chunks of complete rows.
+* Falls back to a full rebuild when the input shrank, the output went missing or the algorithm changed; an output
+* that is the only copy of reclaimed rows is set aside first (see output_set_aside()).
+* The input is read as a snapshot of the size seen at the start. spi_flash_lock is held for setup, for each
+* block read or write and for the final checkpoint, never across encoding, so writers can append in between.
+*/
+static esp_err_t run_compression_pass(compression_stream_t *cs, const char *input_file, const char *output_file, const compression_codec_t *codec) {
+    int64_t pass_start = esp_timer_get_time();
+    memset(&cs->stats, 0, sizeof(cs->stats));
+    if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+        ESP_LOGE(TAG, "Compression (%s): lock timeout", codec->name);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (cs->state_codec != codec) {
+        free(cs->state);
+        cs->state = malloc(codec->state_size);
+        cs->state_codec = cs->state ? codec : NULL;
+        cs->ckpt_loaded = false;
+        if (!cs->state) {
+            ESP_LOGE(TAG, "Compression (%s): no memory for %u byte state", codec->name, (unsigned)codec->state_size);
+            flash_lock_give(cs);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (!cs->ckpt_loaded) {
+        ckpt_load(cs, &cs->ckpt, codec, cs->state);
+        cs->ckpt_loaded = true;
+    }
+    if (cs->ckpt.in_dropped > 0 && strcmp(cs->ckpt.algo, codec->name) != 0 && codec_find(cs->ckpt.algo)) {
+        /* A rebuild would recompress only what is left of the input: the output keeps its codec. */
+        ESP_LOGW(TAG, "%s: input already reclaimed, staying with %s instead of %s", input_file, cs->ckpt.algo, codec->name);
+        cs->codec = codec_find(cs->ckpt.algo);
+        flash_lock_give(cs);
+        return run_compression_pass(cs, input_file, output_file, cs->codec);
+    }
+
+    struct stat in_st;
+    if (stat(input_file, &in_st) != 0) {
+        ESP_LOGE(TAG, "Compression: stat(%s) failed", input_file);
+        flash_lock_give(cs);
+        return ESP_FAIL;
+    }
+
+    struct stat out_st;
+    bool have_out = stat(output_file, &out_st) == 0;
+    bool rebuild = strcmp(cs->ckpt.algo, codec->name) != 0
+                || (uint32_t)in_st.st_size < cs->ckpt.in_offset
+                || !have_out
+                || cs->ckpt.out_size == 0
+                || (uint32_t)out_st.st_size < cs->ckpt.out_size;
+    /* The checkpoint may be what went missing: the header flag and a leftover "<input>.old" tell too. */
+    struct stat old_st;
+    if (rebuild && have_out && (cs->ckpt.in_dropped > 0 || stat(cs->in_old_path, &old_st) == 0
+                                || (container_get_flags(output_file) & CONTAINER_FLAG_INPUT_DROPPED))
+        && output_set_aside(cs, output_file) != ESP_OK) {
+        flash_lock_give(cs);
+        return ESP_FAIL;
+    }
+    if (rebuild) {
+        if (cs->ckpt.in_offset > 0) {
+            ESP_LOGW(TAG, "Checkpoint no longer matches %s / %s, recompressing from start", input_file, output_file);
+        }
+        ckpt_reset(&cs->ckpt, codec, cs->state);
+    } else if ((uint32_t)in_st.st_size == cs->ckpt.in_offset && (uint32_t)out_st.st_size == cs->ckpt.out_size) {
+        ESP_LOGD(TAG, "Compression: no new data (%u bytes)", (unsigned)cs->ckpt.in_offset);
+        flash_lock_give(cs);
+        return ESP_OK;
+    } else if ((uint32_t)out_st.st_size > cs->ckpt.out_size) {
+        /* Output written after the last checkpoint belongs to an interrupted pass; this pass rewrites the open frame header. */
+        truncate(output_file, cs->ckpt.out_size);
+        truncate(cs->idx_path, (cs->ckpt.frames + cs->ckpt.frame_open) * sizeof(container_index_t));
+    }
+
+    uint8_t *out_buf = malloc(COMPRESSION_OUT_BLOCK);
+    FILE *in = NULL;
     FILE *out = NULL;
+    FILE *idx = NULL;
+    if (out_buf) {
+        in = fopen(input_file, "rb");
+    }
     if (in){
-       out = fopen(output_file, "w");
+       out = fopen(output_file, rebuild ? "w+b" : "r+b");
+    }
+    if (out) {
+        /* The sink hands over whole pages: no second copy in a stdio buffer. */
+        setvbuf(out, NULL, _IONBF, 0);
+        idx = fopen(cs->idx_path, rebuild ? "w+b" : "r+b");
+        if (!idx) {
+            /* Index went missing: frames written from now on are indexed, readers walk the rest. */
+            idx = fopen(cs->idx_path, "w+b");
+        }
     }
 
-    if (!in || !out) {
-        ESP_LOGE(TAG, "Delta: fopen failed (in=%p, out=%p)", (void*)in, (void*)out);
+    line_reader_t lr = { 0 };
+    bool ready = in && out && idx && line_reader_init(&lr, in, cs->ckpt.in_offset, LINE_READER_BLOCK) == ESP_OK;
+    /* Seal the snapshot: rows appended after the stat above wait for the next pass. */
+    line_reader_set_limit(&lr, (uint32_t)in_st.st_size);
+    if (ready && rebuild) {
+        /* The header's schema comes from the first row of the input. */
+        const char *row = NULL;
+        size_t row_len = 0;
+        if (!line_reader_peek(&lr, &row, &row_len)) {
+            row = NULL;
+        }
+        ready = container_write_header(out, codec, cs->frame_rows, row, row_len) == ESP_OK;
+    }
+    if (!ready || fseek(out, 0, SEEK_END) != 0) {
+        ESP_LOGE(TAG, "Compression: open failed (in=%p, out=%p, idx=%p, bufs=%p/%p)", (void*)in, (void*)out, (void*)idx, (void*)lr.buf, (void*)out_buf);
         if (in){
             fclose(in);
-        } 
+        }
         if (out){
             fclose(out);
         }
-        xSemaphoreGive(spi_flash_lock);
-        return;
+        if (idx){
+            fclose(idx);
+        }
+        line_reader_free(&lr);
+        free(out_buf);
+        cs->ckpt_loaded = false;
+        flash_lock_give(cs);
+        return ESP_FAIL;
     }
 
-    char line[256];
-    float prev_values[32] = {0};
-    bool first_line = true;
+    frame_writer_t w = { .cs = cs, .out = out, .idx = idx, .base = (uint32_t)ftell(out), .codec = codec };
+    codec_sink_init(&w.sink, out, out_buf, COMPRESSION_OUT_BLOCK);
+    codec_sink_set_lock(&w.sink, &cs->io);
+    line_reader_set_lock(&lr, &cs->io);
+    flash_lock_give(cs);
 
-    while (fgets(line, sizeof(line), in)) {
-        float values[32];
-        int count = 0;
-        char *saveptr = NULL;
-        char *tkn = strtok_r(line, ",", &saveptr);
-        while (tkn != NULL && count < 32) {
-            values[count++] = strtof(tkn, NULL);
-            tkn = strtok_r(NULL, ",", &saveptr);
-        }
+    uint32_t start_offset = cs->ckpt.in_offset;
+    uint32_t start_out = cs->ckpt.out_size;
+    esp_err_t err = ESP_OK;
 
-        if (first_line) {
-            for (int i = 0; i < count; i++) {
-                // fprintf(out, "%.6f%s", values[i], (i < count - 1) ? "," : "");
-                prev_values[i] = values[i];
-            }
-            fprintf(out, "\n");
-            first_line = false;
-        } else {
-            for (int i = 0; i < count; i++) {
-                float delta = values[i] - prev_values[i];
-                // fprintf(out, "%.6f%s", delta, (i < count - 1) ? "," : "");
-                prev_values[i] = values[i];
-            }
-            fprintf(out, "\n");
+    /* A trailing partial row is still being written: the reader leaves it for the next pass. */
+    int workers = s_workers > 1 ? encoder_pool_grow(s_workers) : 1;
+    if (workers > s_workers) {
+        workers = s_workers;
+    }
+    if (workers > 1) {
+        err = encode_parallel(&w, &lr, workers);
+    } else {
+        const char *rows;
+        size_t n;
+        while (err == ESP_OK && line_reader_rows(&lr, &rows, &n)) {
+            TRACE_BEGIN("compress.chunk", n);
+            err = frame_encode(&w, rows, n);
+            TRACE_END("compress.chunk");
         }
     }
+    if (err == ESP_OK) {
+        err = lr.err;
+    }
+    uint32_t offset = lr.offset;
 
+    if (err == ESP_OK && cs->ckpt.frame_open) {
+        err = frame_end(&w, false);
+    }
+    if (err == ESP_OK) {
+        err = codec_sink_flush(&w.sink);
+    }
+    bool locked = flash_lock_take(cs, COMPRESSION_LOCK_TICKS);
+    if (!locked && err == ESP_OK) {
+        err = ESP_ERR_TIMEOUT;
+    }
+    fflush(out);
+    fsync(fileno(out));
+    fflush(idx);
+    fsync(fileno(idx));
+    long out_size = ftell(out);
     fclose(in);
     fclose(out);
-    xSemaphoreGive(spi_flash_lock);
+    fclose(idx);
+    line_reader_free(&lr);
+    free(out_buf);
+
+    if (err == ESP_OK && out_size >= 0) {
+        cs->ckpt.in_offset = offset;
+        cs->ckpt.out_size = (uint32_t)out_size;
+        ckpt_save(cs, &cs->ckpt, codec, cs->state);
+    } else {
+        /* State may be ahead of what was written: reload the last checkpoint next pass. */
+        ESP_LOGE(TAG, "Compression (%s) failed: %s", codec->name, esp_err_to_name(err));
+        cs->ckpt_loaded = false;
+    }
+    if (locked) {
+        flash_lock_give(cs);
+    }
+
+    cs->stats.bytes_in = offset - start_offset;
+    cs->stats.bytes_out = (err == ESP_OK && out_size >= 0) ? (uint32_t)out_size - start_out : 0;
+    cs->stats.pass_us = esp_timer_get_time() - pass_start;
+    metrics_count(METRIC_COMP_PASSES, 1);
+    metrics_count(METRIC_COMP_BYTES_IN, cs->stats.bytes_in);
+    metrics_count(METRIC_COMP_BYTES_OUT, cs->stats.bytes_out);
+    metrics_count(METRIC_COMP_ERRORS, err != ESP_OK);
+    metrics_observe(METRIC_COMP_PASS_US, (uint32_t)cs->stats.pass_us);
+    if (cs->stats.bytes_in > 0 && cs->stats.bytes_out > 0) {
+        metrics_observe(METRIC_COMP_RATIO_X100, (uint32_t)((uint64_t)cs->stats.bytes_in * 100 / cs->stats.bytes_out));
+    }
+    ESP_LOGI(TAG, "Compression (%s) done: %s -> %s (+%u input bytes)", codec->name, input_file, output_file, (unsigned)(offset - start_offset));
+    return err;
+}
 
-    ESP_LOGI(TAG, "Delta done: %s -> %s", input_file, output_file);
+static void set_paths(compression_stream_t *cs, const char *input_csv_path, const char *output_csv_path) {
+    strncpy(cs->in, input_csv_path, sizeof(cs->in)-1);
+    strncpy(cs->out, output_csv_path, sizeof(cs->out)-1);
+    snprintf(cs->ckpt_path, sizeof(cs->ckpt_path), "%s.ckpt", cs->out);
+    snprintf(cs->ckpt_tmp_path, sizeof(cs->ckpt_tmp_path), "%s.tmp", cs->ckpt_path);
+    snprintf(cs->idx_path, sizeof(cs->idx_path), "%s.idx", cs->out);
+    snprintf(cs->in_tmp_path, sizeof(cs->in_tmp_path), "%s.tmp", cs->in);
+    snprintf(cs->in_old_path, sizeof(cs->in_old_path), "%s.old", cs->in);
+    snprintf(cs->out_tmp_path, sizeof(cs->out_tmp_path), "%s.tmp", cs->out);
+    cs->ckpt_loaded = false;
+    cs->io = (io_lock_t){ .take = flash_io_take, .give = flash_io_give, .ctx = cs };
 }
 
+/*
+* Segment mode: compress each sealed segment not yet compressed into its own container, oldest first.
+* A sealed segment never changes, so once its pass completes it is marked compressed and never read again.
+*/
+static esp_err_t compress_sealed_segments(compression_stream_t *cs, const compression_codec_t *codec) {
+    for (;;) {
+        if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        uint32_t n = cs->store->compressed;
+        bool sealed = n < cs->store->active;
+        flash_lock_give(cs);
+        if (!sealed) {
+            return ESP_OK;
+        }
+
+        char in[112];
+        char out[112];
+        segment_path(cs->store, n, in, sizeof(in));
+        segment_compressed_path(cs->store, n, out, sizeof(out));
+        set_paths(cs, in, out);
+        ESP_LOGI(TAG, "Compressing sealed segment (algo=%s): %s -> %s", codec->name, in, out);
+        esp_err_t err = run_compression_pass(cs, in, out, codec);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        /* Nothing will be appended to resume from: the checkpoint can go. */
+        if (segment_mark_compressed(cs->store, n) == ESP_OK) {
+            remove(cs->ckpt_path);
+            remove(cs->ckpt_tmp_path);
+        }
+        flash_lock_give(cs);
+        cs->ckpt_loaded = false;
+    }
+}
+
+/* One pass of a stream: its file, or every sealed segment in segment mode. */
+static esp_err_t stream_pass(compression_stream_t *cs) {
+    const compression_codec_t *codec = cs->codec;
+    if (cs->store) {
+        return compress_sealed_segments(cs, codec);
+    }
+    ESP_LOGI(TAG, "Compressing (algo=%s): %s -> %s", codec->name, cs->in, cs->out);
+    return run_compression_pass(cs, cs->in, cs->out, codec);
+}
+
+static compression_pass_cb_t s_pass_cb = NULL;
+
 /* Compression Task Func.*/
 static void compression_task(void *arg) {
     (void) arg;
-    for (;;) {
-        vTaskDelay(pdMS_TO_TICKS(compression_freq));
-
-        const char *algo = compression_algorithm;
-        ESP_LOGI(TAG, "Compressing (algo=%s): %s -> %s", algo, s_in, s_out);
-        if (strcmp(algo, "delta") == 0) {
-            run_delta_encoding_compression(s_in, s_out);
-        } else {
-            run_rle_compression(s_in, s_out);
+    metrics_register_task(xTaskGetCurrentTaskHandle(), "compression", COMPRESSION_TASK_STACK);
+    while (!atomic_load(&c_stop)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(compression_freq));
+        if (atomic_load(&c_stop)) {
+            break;
+        }
+        esp_err_t err = stream_pass(&s_default);
+        compression_pass_cb_t cb = s_pass_cb;
+        if (cb) {
+            cb(&s_default, err);
         }
     }
+    /* Between passes: spi_flash_lock is free and the pass buffers are back. */
+    metrics_unregister_task(xTaskGetCurrentTaskHandle());
+    atomic_store(&c_running, false);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t start_task(void) {
+    atomic_store(&c_stop, false);
+    atomic_store(&c_running, true);
+    if (xTaskCreate(compression_task, "compression_task", COMPRESSION_TASK_STACK, NULL, 4, &c_task) != pdPASS) {
+        c_task = NULL;
+        atomic_store(&c_running, false);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void compression_set_pass_cb(compression_pass_cb_t cb) {
+    s_pass_cb = cb;
 }
 
 /* Developer Functions.*/
@@ -159,51 +1043,73 @@ esp_err_t compression_start(const char *input_csv_path, const char *output_csv_p
     if (c_task){
         return ESP_OK;
     }
+    if (algo && compression_set_algorithm(algo) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
 
-    strncpy(s_in, input_csv_path, sizeof(s_in)-1);
-    strncpy(s_out, output_csv_path, sizeof(s_out)-1);
+    set_paths(&s_default, input_csv_path, output_csv_path);
     compression_freq = interval_ms;
+    s_default.store = NULL;
 
-    if (algo) {
-        char lower[16] = {0};
-        strncpy(lower, algo, sizeof(lower)-1);
-        for (char *p = lower; *p; ++p){
-            if (*p >= 'A' && *p <= 'Z') {
-                *p += 32;
-            }
-        }
-        if (strcmp(lower, "delta") == 0) {
-            strncpy(compression_algorithm, "delta", sizeof(compression_algorithm) - 1);
-        } else {
-            strncpy(compression_algorithm, "rle", sizeof(compression_algorithm) - 1);
-        }
-    } else {
-        strncpy(compression_algorithm, "rle", sizeof(compression_algorithm) - 1);
+    return start_task();
+}
+
+esp_err_t compression_start_segments(segment_store_t *store, int interval_ms, const char *algo)
+{
+    if (!store || interval_ms <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (c_task){
+        return ESP_OK;
+    }
+    if (algo && compression_set_algorithm(algo) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
     }
 
-    BaseType_t ok = xTaskCreate(compression_task, "compression_task", 4096, NULL, 4, &c_task);
-    if (ok != pdPASS){
-        return ESP_FAIL;
+    s_default.store = store;
+    compression_freq = interval_ms;
+
+    esp_err_t err = start_task();
+    if (err != ESP_OK){
+        s_default.store = NULL;
     }
-    return ESP_OK;
+    return err;
 }
 
-void compression_set_algorithm(const char *algo) {
-    if (!algo){
-        return;
+esp_err_t compression_run_once(const char *input_csv_path, const char *output_csv_path, const char *algo)
+{
+    if (!input_csv_path || !output_csv_path) {
+        return ESP_ERR_INVALID_ARG;
     }
-    char lower[16] = {0};
-    strncpy(lower, algo, sizeof(lower) - 1);
-    for (char *p = lower; *p; ++p){
-        if (*p >= 'A' && *p <= 'Z'){
-            *p += 32;
-        }
+    if (c_task){
+        return ESP_ERR_INVALID_STATE;
     }
-    if (strcmp(lower, "delta") == 0){
-        strncpy(compression_algorithm, "delta", sizeof(compression_algorithm) - 1);
-    } else {
-        strncpy(compression_algorithm, "rle", sizeof(compression_algorithm) - 1);
+    if (algo && compression_set_algorithm(algo) != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (strcmp(s_default.in, input_csv_path) != 0 || strcmp(s_default.out, output_csv_path) != 0) {
+        set_paths(&s_default, input_csv_path, output_csv_path);
     }
+    return run_compression_pass(&s_default, s_default.in, s_default.out, s_default.codec);
+}
+
+void compression_get_stats(compression_stats_t *out) {
+    if (out) {
+        *out = s_default.stats;
+    }
+}
+
+esp_err_t compression_set_algorithm(const char *algo) {
+    if (!algo){
+        return ESP_ERR_INVALID_ARG;
+    }
+    const compression_codec_t *codec = codec_find(algo);
+    if (!codec) {
+        ESP_LOGE(TAG, "Unknown compression algorithm \"%s\" (keeping %s)", algo, s_default.codec->name);
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_default.codec = codec;
+    return ESP_OK;
 }
 
 void compression_set_interval(int interval_ms) {
@@ -216,6 +1122,322 @@ void compression_stop(void) {
     if (!c_task){
         return;
     }
-    vTaskDelete(c_task);
+    atomic_store(&c_stop, true);
+    xTaskNotifyGive(c_task);
+    /* A pass in progress runs to the end, so its locks are given back and its buffers freed. */
+    while (atomic_load(&c_running)) {
+        vTaskDelay(1);
+    }
     c_task = NULL;
-}
\ No newline at end of file
+}
+
+void compression_set_frame_rows(uint32_t rows) {
+    if (rows > 0) {
+        s_frame_rows = rows;
+        s_default.frame_rows = rows;
+    }
+}
+
+/* Streams. */
+
+esp_err_t compression_stream_create(const char *input_csv_path, const char *output_path, const char *algo, compression_stream_t **out)
+{
+    if (!input_csv_path || !output_path || !out) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const compression_codec_t *codec = algo ? codec_find(algo) : s_default.codec;
+    if (!codec) {
+        ESP_LOGE(TAG, "Unknown compression algorithm \"%s\"", algo);
+        return ESP_ERR_NOT_FOUND;
+    }
+    compression_stream_t *cs = calloc(1, sizeof(*cs));
+    if (!cs) {
+        return ESP_ERR_NO_MEM;
+    }
+    cs->codec = codec;
+    cs->frame_rows = s_frame_rows;
+    set_paths(cs, input_csv_path, output_path);
+    *out = cs;
+    return ESP_OK;
+}
+
+esp_err_t compression_stream_pass(compression_stream_t *cs) {
+    return cs ? stream_pass(cs) : ESP_ERR_INVALID_ARG;
+}
+
+void compression_stream_get_stats(const compression_stream_t *cs, compression_stats_t *out) {
+    if (cs && out) {
+        *out = cs->stats;
+    }
+}
+
+void compression_stream_destroy(compression_stream_t *cs) {
+    if (cs) {
+        free(cs->state);
+        free(cs);
+    }
+}
+
+/*
+* Space Reclamation.
+* Both rewrite a file without its reclaimed front into "<file>.tmp", fsync it, commit the new offsets in the
+* checkpoint with the swap still pending, and only then replace the original. swap_finish() completes a swap
+* a crash interrupted, so rows are never in neither file and the checkpoint always matches what it names.
+*/
+esp_err_t compression_stream_reclaim_input(compression_stream_t *cs, uint32_t min_bytes, void (*release_input)(void), uint32_t *reclaimed) {
+    if (reclaimed) {
+        *reclaimed = 0;
+    }
+    if (!cs || cs->store) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!cs->ckpt_loaded || cs->ckpt.in_offset == 0 || cs->ckpt.in_offset < min_bytes) {
+        return ESP_OK;
+    }
+    /* Held throughout: rows appended while the tail is copied would be lost with the old file. */
+    if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    compression_ckpt_t before = cs->ckpt;
+    esp_err_t err = ESP_FAIL;
+    struct stat st;
+    FILE *in = NULL;
+    FILE *tmp = NULL;
+    if (stat(cs->in, &st) != 0 || (uint32_t)st.st_size < cs->ckpt.in_offset) {
+        /* Shrank under the checkpoint: the next pass rebuilds, nothing to reclaim. */
+        err = ESP_ERR_INVALID_STATE;
+    } else if ((in = fopen(cs->in, "rb")) != NULL && (tmp = fopen(cs->in_tmp_path, "wb")) != NULL) {
+        setvbuf(tmp, NULL, _IONBF, 0);
+        err = copy_range(in, cs->ckpt.in_offset, (uint32_t)st.st_size, tmp, NULL);
+        if (err == ESP_OK && (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0)) {
+            err = ESP_FAIL;
+        }
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (tmp) {
+        fclose(tmp);
+    }
+    if (err == ESP_OK) {
+        /* Marked before the commit: even without the checkpoint, no rebuild may truncate the output now. */
+        err = container_add_flags(cs->out, CONTAINER_FLAG_INPUT_DROPPED);
+    }
+    if (err == ESP_OK) {
+        cs->ckpt.in_dropped += cs->ckpt.in_offset;
+        cs->ckpt.in_offset = 0;
+        cs->ckpt.swap = CKPT_SWAP_IN;
+        cs->ckpt.swap_in_size = (uint32_t)st.st_size;
+        err = ckpt_write(cs, &cs->ckpt);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Reclaim %s failed: %s", cs->in, esp_err_to_name(err));
+        cs->ckpt = before;
+        remove(cs->in_tmp_path);
+        flash_lock_give(cs);
+        return err;
+    }
+    if (release_input) {
+        release_input();
+    }
+    remove(cs->in_old_path);
+    if (rename(cs->in, cs->in_old_path) != 0 || rename(cs->in_tmp_path, cs->in) != 0) {
+        /* Committed: the next checkpoint load retries the rename. */
+        ESP_LOGE(TAG, "Reclaim %s: rename failed", cs->in);
+        cs->ckpt_loaded = false;
+        flash_lock_give(cs);
+        return ESP_FAIL;
+    }
+    remove(cs->in_old_path);
+    cs->ckpt.swap = 0;
+    ckpt_write(cs, &cs->ckpt);
+    flash_lock_give(cs);
+    ESP_LOGI(TAG, "Reclaimed %u compressed bytes of %s (%u kept)", (unsigned)before.in_offset, cs->in,
+             (unsigned)(st.st_size - before.in_offset));
+    if (reclaimed) {
+        *reclaimed = before.in_offset;
+    }
+    return ESP_OK;
+}
+
+/* Walk the closed frames from the first until bytes of them are covered. Caller holds spi_flash_lock. */
+static esp_err_t frames_cut(compression_stream_t *cs, uint32_t bytes, uint32_t *data_start, uint32_t *cut, uint32_t *count) {
+    FILE *f = fopen(cs->out, "rb");
+    if (!f) {
+        return ESP_FAIL;
+    }
+    container_header_t hdr;
+    if (fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr) || hdr.magic != CONTAINER_MAGIC) {
+        fclose(f);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    esp_err_t err = ESP_OK;
+    *data_start = (uint32_t)sizeof(hdr) + hdr.schema_len;
+    *cut = *data_start;
+    *count = 0;
+    while (err == ESP_OK && *count < cs->ckpt.frames && *cut - *data_start < bytes) {
+        container_frame_t fh;
+        if (fseek(f, (long)*cut, SEEK_SET) != 0 || fread(&fh, 1, sizeof(fh), f) != sizeof(fh)
+            || fh.magic != CONTAINER_FRAME_MAGIC) {
+            err = ESP_ERR_INVALID_RESPONSE;
+            break;
+        }
+        *cut += (uint32_t)sizeof(fh) + fh.payload_len;
+        (*count)++;
+    }
+    fclose(f);
+    return err;
+}
+
+esp_err_t compression_stream_drop_frames(compression_stream_t *cs, uint32_t bytes, uint32_t *dropped) {
+    if (dropped) {
+        *dropped = 0;
+    }
+    if (!cs || cs->store) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!cs->ckpt_loaded || cs->ckpt.frames == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (!flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    uint32_t data_start = 0;
+    uint32_t cut = 0;
+    uint32_t count = 0;
+    esp_err_t err = frames_cut(cs, bytes, &data_start, &cut, &count);
+    FILE *out = NULL;
+    FILE *tmp = NULL;
+    if (err == ESP_OK && ((out = fopen(cs->out, "rb")) == NULL || (tmp = fopen(cs->out_tmp_path, "wb")) == NULL)) {
+        err = ESP_FAIL;
+    } else if (tmp) {
+        setvbuf(tmp, NULL, _IONBF, 0);
+    }
+    flash_lock_give(cs);
+
+    /* Only this task writes the output: the copy can let other writers in between blocks. */
+    if (err == ESP_OK) {
+        err = copy_range(out, 0, data_start, tmp, &cs->io);
+    }
+    if (err == ESP_OK) {
+        err = copy_range(out, cut, cs->ckpt.out_size, tmp, &cs->io);
+    }
+
+    bool locked = flash_lock_take(cs, COMPRESSION_LOCK_TICKS);
+    if (err == ESP_OK && !locked) {
+        err = ESP_ERR_TIMEOUT;
+    }
+    if (tmp && err == ESP_OK && (fflush(tmp) != 0 || fsync(fileno(tmp)) != 0)) {
+        err = ESP_FAIL;
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (tmp) {
+        fclose(tmp);
+    }
+    compression_ckpt_t before = cs->ckpt;
+    uint32_t shift = err == ESP_OK ? cut - data_start : 0;
+    if (err == ESP_OK) {
+        cs->ckpt.frames -= count;
+        if (cs->ckpt.frame_open) {
+            cs->ckpt.frame_off -= shift;
+        }
+        cs->ckpt.out_size -= shift;
+        cs->ckpt.out_dropped += shift;
+        cs->ckpt.swap = CKPT_SWAP_OUT;
+        err = ckpt_write(cs, &cs->ckpt);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Dropping frames of %s failed: %s", cs->out, esp_err_to_name(err));
+        cs->ckpt = before;
+        /* The temp copy is no use now; without the lock it stays until the next drop truncates it. */
+        if (locked || flash_lock_take(cs, COMPRESSION_LOCK_TICKS)) {
+            remove(cs->out_tmp_path);
+            flash_lock_give(cs);
+        }
+        return err;
+    }
+    remove(cs->out);
+    if (rename(cs->out_tmp_path, cs->out) != 0) {
+        ESP_LOGE(TAG, "Dropping frames of %s: rename failed", cs->out);
+        cs->ckpt_loaded = false;
+        flash_lock_give(cs);
+        return ESP_FAIL;
+    }
+
+    /* Shift the surviving index entries down. A failure only costs readers a header walk. */
+    uint32_t kept = before.frames + before.frame_open - count;
+    container_index_t *entries = NULL;
+    bool indexed = true;
+    if (kept > 0) {   /* Otherwise the index is only emptied. */
+        entries = malloc(kept * sizeof(*entries));
+        FILE *in = fopen(cs->idx_path, "rb");
+        indexed = entries && in && fseek(in, (long)(count * sizeof(*entries)), SEEK_SET) == 0
+               && fread(entries, sizeof(*entries), kept, in) == kept;
+        if (in) {
+            fclose(in);
+        }
+    }
+    FILE *idx = indexed ? fopen(cs->idx_path, "wb") : NULL;
+    indexed = idx != NULL;
+    if (idx) {
+        for (uint32_t i = 0; i < kept; i++) {
+            entries[i].offset -= shift;
+        }
+        indexed = page_write(idx, entries, kept * sizeof(*entries)) == kept * sizeof(*entries);
+        fclose(idx);
+    }
+    if (!indexed) {
+        remove(cs->idx_path);
+    }
+    free(entries);
+
+    cs->ckpt.swap = 0;
+    ckpt_write(cs, &cs->ckpt);
+    flash_lock_give(cs);
+    ESP_LOGI(TAG, "Dropped the %u oldest frames of %s (%u bytes)", (unsigned)count, cs->out, (unsigned)shift);
+    if (dropped) {
+        *dropped = shift;
+    }
+    return ESP_OK;
+}
+
+void compression_set_column_decimals(int column, int decimals) {
+    codec_delta_set_decimals(column, decimals);
+}
+
+esp_err_t compression_decode_file(const char *compressed_path, const char *csv_path, const char *algo) {
+    if (!compressed_path || !csv_path) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    container_reader_t r;
+    esp_err_t err = container_open(&r, compressed_path);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (algo && strcasecmp(algo, r.codec->name) != 0) {
+        ESP_LOGE(TAG, "Decode: %s was written with %s, not %s", compressed_path, r.codec->name, algo);
+        container_close(&r);
+        return ESP_ERR_INVALID_ARG;
+    }
+    FILE *out = fopen(csv_path, "w");
+    if (!out) {
+        ESP_LOGE(TAG, "Decode: fopen(%s) failed", csv_path);
+        container_close(&r);
+        return ESP_FAIL;
+    }
+    /* Frames are decoded through a page-aligned sink. */
+    setvbuf(out, NULL, _IONBF, 0);
+    while ((err = container_read_frame(&r, out, NULL)) == ESP_OK) {
+    }
+    if (err == ESP_ERR_NOT_FOUND) {
+        err = ESP_OK;
+    }
+    fclose(out);
+    container_close(&r);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Decode: corrupt input %s (%s)", compressed_path, esp_err_to_name(err));
+    }
+    return err;
+}
@@ -1,22 +1,151 @@
 #pragma once
+#include <stdint.h>
 #include "esp_err.h"
+#include "segment.h"
+
+/*
+* Figures for the most recent compression pass.
+*/
+typedef struct {
+    uint32_t bytes_in;      /* Input bytes consumed. */
+    uint32_t bytes_out;     /* Output bytes appended. */
+    int64_t  pass_us;       /* Wall time of the whole pass. */
+    int64_t  lock_wait_us;  /* Time spent waiting for spi_flash_lock. */
+    int64_t  lock_hold_us;  /* Time spi_flash_lock was held, all sections together. */
+    int64_t  lock_hold_max_us; /* Longest single hold: how long a writer may have had to wait. */
+    uint32_t lock_sections; /* Number of times the lock was taken. */
+} compression_stats_t;
+
+/* Default rows per output frame. */
+#define COMPRESSION_FRAME_ROWS 512
 
 /* 
 * A task for periodic compression of sensing data csv.
+* Each pass only compresses rows appended since the last pass and appends to the output.
+* The output is a framed container (see container.h): a header naming codec and schema, then frames of
+* up to COMPRESSION_FRAME_ROWS rows that decode independently, indexed in "<output_csv_path>.idx".
+* Progress is checkpointed to "<output_csv_path>.ckpt" so a restart resumes where it left off.
 */
 esp_err_t compression_start(const char *input_csv_path, const char *output_csv_path, int interval_ms,const char *algo);
 
+/*
+* Same task over a segment store: every interval, each sealed segment not yet compressed is compressed once
+* into its own container "<base>.NNNNNN.z" (see segment.h). The active segment is left alone until it is sealed.
+*/
+esp_err_t compression_start_segments(segment_store_t *store, int interval_ms, const char *algo);
+
 /* 
 * Developer can set which compression algorithm to use on their data.
+* "rle" (default), "delta" (fixed-point varint deltas), "gorilla" (XOR floats, delta-of-delta timestamps),
+* "lz" (general-purpose sliding-window LZ, ~6 KB of RAM),
+* "dict" (numbers as deltas, repeating text columns such as status or unit strings as one-byte dictionary codes),
+* or any codec added with codec_register() (see codec.h). Unknown names are rejected with ESP_ERR_NOT_FOUND.
+* "delta", "gorilla" and "dict" code an integer first column as a delta-of-delta timestamp: rows at a steady
+* interval spend about one bit on it.
+* All of them decode every row to the same values; only "rle" and "lz" also keep its text byte for byte.
+* "delta" and "dict" pad each value to its column's fixed-point decimals, which may grow along the file ("21.25"
+* as "21.250", "18" as "18.000" after a finer value). "gorilla" pads the same way ("20.5" after "20.25" as "20.50")
+* and sends rows whose values float32 cannot hold exactly as literals.
 */
-void compression_set_algorithm(const char *algo);
+esp_err_t compression_set_algorithm(const char *algo);
 
 /* 
 * Developers can set the interval of their compression (frequency).
 */
 void compression_set_interval(int interval_ms);
 
+/*
+* Run one incremental pass synchronously (same checkpointing as the task).
+* Returns ESP_ERR_INVALID_STATE while the periodic task is running.
+*/
+esp_err_t compression_run_once(const char *input_csv_path, const char *output_csv_path, const char *algo);
+
+/*
+* Copy the statistics of the most recent pass.
+*/
+void compression_get_stats(compression_stats_t *out);
+
+/*
+* Rows per output frame for frames started from now on. Smaller frames seek finer and compress a bit worse.
+*/
+void compression_set_frame_rows(uint32_t rows);
+
+/*
+* Encoder tasks a pass spreads its full frames over, 1 to COMPRESSION_MAX_WORKERS. The default is one per core;
+* 1 encodes in the calling task. Frames are written in input order and hold the same rows for any setting, so the
+* output is identical; each worker costs a 4 KB task stack plus one frame of input and output in RAM during a pass.
+*/
+#define COMPRESSION_MAX_WORKERS 4
+void compression_set_workers(int workers);
+
 /* 
 * Stop the periodic compression task.
 */
 void compression_stop(void);
+
+/*
+* Independent streams, for boards with several sensor files. Each has its own input, output, checkpoint and codec;
+* the functions above drive one built-in stream. Nothing here starts a task: call compression_stream_pass() from
+* whatever schedules the work (see pipeline.h). Passes of different streams may run in different tasks.
+*/
+typedef struct compression_stream compression_stream_t;
+
+/*
+* output_path gets the same ".idx" / ".ckpt" companions as with compression_start(). algo NULL takes the
+* algorithm set with compression_set_algorithm(); frames use the compression_set_frame_rows() size.
+*/
+esp_err_t compression_stream_create(const char *input_csv_path, const char *output_path, const char *algo, compression_stream_t **out);
+
+/* One incremental pass, as the periodic task does. */
+esp_err_t compression_stream_pass(compression_stream_t *cs);
+
+void compression_stream_get_stats(const compression_stream_t *cs, compression_stats_t *out);
+
+/* Free a stream that no pass is running on. Its files stay. */
+void compression_stream_destroy(compression_stream_t *cs);
+
+/*
+* Called from the compression task after every pass of the built-in stream, with that stream and the pass result.
+* Register (or with NULL, remove) the one callback; it runs in the compression task, so it may use the functions
+* below on the stream (see retention.h).
+*/
+typedef void (*compression_pass_cb_t)(compression_stream_t *cs, esp_err_t err);
+void compression_set_pass_cb(compression_pass_cb_t cb);
+
+/*
+* Space Reclamation (not in segment mode, where whole segment files go instead; see segment.h).
+* Only between passes of the stream, from the task that runs them.
+*/
+
+/*
+* Drop the input rows the last checkpoint has durably compressed, once there are at least min_bytes of them.
+* The uncompressed tail is copied to "<input>.tmp", fsynced and committed in the checkpoint; the input is then moved
+* to "<input>.old" and the temp file takes its name, all under spi_flash_lock, so a crash at any point keeps every
+* row in exactly one place, rows appended meanwhile included. release_input (optional) is called under the lock just
+* before the input is moved, for writers holding it open (ingest_release_file()).
+* reclaimed (optional) receives the bytes dropped. Once any input is dropped, the output keeps its codec:
+* compression_set_algorithm() no longer triggers a rebuild for this stream. The output header is flagged
+* (CONTAINER_FLAG_INPUT_DROPPED), so a rebuild for another reason, such as a lost checkpoint, renames it to
+* "<output>.1" (.2, ...) instead of truncating it.
+*/
+esp_err_t compression_stream_reclaim_input(compression_stream_t *cs, uint32_t min_bytes, void (*release_input)(void), uint32_t *reclaimed);
+
+/*
+* Drop the oldest closed frames of the output, as many as it takes to cover bytes (at most every closed frame; the
+* open one stays). The rest is copied to "<output>.tmp" and swapped in the same crash-safe way, which needs free
+* space for the frames kept. dropped (optional) receives the bytes removed. ESP_ERR_NOT_FOUND without closed frames.
+*/
+esp_err_t compression_stream_drop_frames(compression_stream_t *cs, uint32_t bytes, uint32_t *dropped);
+
+/*
+* Delta codec: fix the number of decimals kept for a column (0-based) instead of detecting it
+* from the first value. Pass -1 to go back to detection.
+*/
+void compression_set_column_decimals(int column, int decimals);
+
+/*
+* Decode a compressed file back into CSV (numeric rows come back in canonical fixed-point form).
+* The codec is read from the file header; algo may be NULL, otherwise it must match.
+* To read only part of a file, use the container_* reader in container.h.
+*/
+esp_err_t compression_decode_file(const char *compressed_path, const char *csv_path, const char *algo);
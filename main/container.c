@@ -0,0 +1,327 @@
+#include "container.h"
+#include "page_write.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char *TAG = "container";
+
+/* Reader I/O block sizes. */
+#define CONTAINER_IN_BLOCK  1024
+#define CONTAINER_OUT_BLOCK 1024
+
+int64_t container_row_ts(const char *row, size_t len) {
+    const char *comma = memchr(row, ',', len);
+    const char *end = comma ? comma : row + len;
+    int64_t mant;
+    int decimals;
+    if (csv_parse_decimal(row, end, &mant, &decimals) != CSV_FIELD_OK) {
+        return CONTAINER_NO_TS;
+    }
+    return mant / codec_pow10[decimals];
+}
+
+esp_err_t container_write_header(FILE *f, const compression_codec_t *codec, uint32_t frame_rows, const char *first_row, size_t len) {
+    container_header_t hdr = {
+        .magic = CONTAINER_MAGIC,
+        .version = CONTAINER_VERSION,
+        .frame_rows = frame_rows,
+        .codec_id = codec->id,
+    };
+    strncpy(hdr.codec, codec->name, sizeof(hdr.codec) - 1);
+
+    if (first_row) {
+        hdr.columns = 1;
+        for (size_t i = 0; i < len; i++) {
+            hdr.columns += first_row[i] == ',';
+        }
+        /* A first row that doesn't start with a number names the columns. */
+        if (container_row_ts(first_row, len) == CONTAINER_NO_TS) {
+            hdr.schema_len = (uint16_t)(len < CONTAINER_SCHEMA_MAX ? len : CONTAINER_SCHEMA_MAX);
+        }
+    }
+
+    /* One write for both. */
+    uint8_t buf[sizeof(hdr) + CONTAINER_SCHEMA_MAX];
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (hdr.schema_len) {
+        memcpy(buf + sizeof(hdr), first_row, hdr.schema_len);
+    }
+    if (page_write(f, buf, sizeof(hdr) + hdr.schema_len) != sizeof(hdr) + hdr.schema_len) {
+        ESP_LOGE(TAG, "Header: short write");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static bool read_header(FILE *f, container_header_t *hdr) {
+    return fseek(f, 0, SEEK_SET) == 0 && fread(hdr, 1, sizeof(*hdr), f) == sizeof(*hdr)
+        && hdr->magic == CONTAINER_MAGIC && hdr->version == CONTAINER_VERSION;
+}
+
+uint8_t container_get_flags(const char *path) {
+    container_header_t hdr;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    uint8_t flags = read_header(f, &hdr) ? hdr.flags : 0;
+    fclose(f);
+    return flags;
+}
+
+esp_err_t container_add_flags(const char *path, uint8_t flags) {
+    container_header_t hdr;
+    FILE *f = fopen(path, "r+b");
+    if (!f) {
+        return ESP_FAIL;
+    }
+    esp_err_t err = ESP_OK;
+    if (!read_header(f, &hdr)) {
+        err = ESP_ERR_INVALID_VERSION;
+    } else if ((hdr.flags & flags) != flags) {
+        hdr.flags |= flags;
+        long at = (long)offsetof(container_header_t, flags);
+        if (fseek(f, at, SEEK_SET) != 0 || page_write(f, &hdr.flags, 1) != 1 || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+            err = ESP_FAIL;
+        }
+    }
+    fclose(f);
+    return err;
+}
+
+/* Reader. All static helpers expect spi_flash_lock to be held. */
+
+static bool lock_take(void) {
+    if (!metrics_lock_take(METRIC_SITE_CONTAINER, pdMS_TO_TICKS(5000))) {
+        ESP_LOGE(TAG, "Lock timeout");
+        return false;
+    }
+    return true;
+}
+
+static uint32_t file_len(FILE *f) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 ? (uint32_t)st.st_size : 0;
+}
+
+/* Read and sanity-check the frame header at off. */
+static bool read_frame_header(container_reader_t *r, uint32_t off, container_frame_t *fh) {
+    uint32_t size = file_len(r->f);
+    return off >= r->data_start
+        && (uint64_t)off + sizeof(*fh) <= size
+        && fseek(r->f, (long)off, SEEK_SET) == 0
+        && fread(fh, 1, sizeof(*fh), r->f) == sizeof(*fh)
+        && fh->magic == CONTAINER_FRAME_MAGIC
+        && (uint64_t)off + sizeof(*fh) + fh->payload_len <= size;
+}
+
+static uint32_t index_count(container_reader_t *r) {
+    return r->idx ? file_len(r->idx) / sizeof(container_index_t) : 0;
+}
+
+/* Index entry n, accepted only if the frame it points to agrees. */
+static bool read_index(container_reader_t *r, uint32_t n, container_index_t *e) {
+    container_frame_t fh;
+    return n < index_count(r)
+        && fseek(r->idx, (long)(n * sizeof(*e)), SEEK_SET) == 0
+        && fread(e, 1, sizeof(*e), r->idx) == sizeof(*e)
+        && read_frame_header(r, e->offset, &fh)
+        && fh.first_ts == e->first_ts;
+}
+
+esp_err_t container_open(container_reader_t *r, const char *path) {
+    if (!r || !path) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(r, 0, sizeof(*r));
+    if (!lock_take()) {
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t err = ESP_OK;
+    r->f = fopen(path, "rb");
+    if (!r->f) {
+        ESP_LOGE(TAG, "Open: fopen(%s) failed", path);
+        err = ESP_FAIL;
+    } else if (fread(&r->hdr, 1, sizeof(r->hdr), r->f) != sizeof(r->hdr)
+               || r->hdr.magic != CONTAINER_MAGIC || r->hdr.version != CONTAINER_VERSION
+               || r->hdr.schema_len > CONTAINER_SCHEMA_MAX
+               || fread(r->schema, 1, r->hdr.schema_len, r->f) != r->hdr.schema_len) {
+        ESP_LOGE(TAG, "Open: %s is not a container", path);
+        err = ESP_ERR_INVALID_VERSION;
+    } else {
+        r->hdr.codec[sizeof(r->hdr.codec) - 1] = '\0';
+        r->codec = codec_find(r->hdr.codec);
+        if (!r->codec || r->codec->id != r->hdr.codec_id) {
+            ESP_LOGE(TAG, "Open: %s uses unknown codec %s", path, r->hdr.codec);
+            err = ESP_ERR_NOT_FOUND;
+        }
+    }
+    if (err == ESP_OK) {
+        char idx_path[144];
+        snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+        r->idx = fopen(idx_path, "rb");
+        r->data_start = (uint32_t)(sizeof(r->hdr) + r->hdr.schema_len);
+        r->next_off = r->data_start;
+        r->state = malloc(r->codec->state_size);
+        r->in_buf = malloc(CONTAINER_IN_BLOCK);
+        r->out_buf = malloc(CONTAINER_OUT_BLOCK);
+        if (!r->state || !r->in_buf || !r->out_buf) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    metrics_lock_give(METRIC_SITE_CONTAINER);
+    if (err != ESP_OK) {
+        container_close(r);
+    }
+    return err;
+}
+
+esp_err_t container_seek_frame(container_reader_t *r, uint32_t frame) {
+    if (!r || !r->f) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!lock_take()) {
+        return ESP_ERR_TIMEOUT;
+    }
+    container_index_t e;
+    uint32_t n = 0;
+    uint32_t off = r->data_start;
+    if (read_index(r, frame, &e)) {
+        n = frame;
+        off = e.offset;
+    }
+    /* Walk the frame headers for whatever the index could not answer. */
+    container_frame_t fh;
+    while (n < frame && read_frame_header(r, off, &fh)) {
+        off += (uint32_t)sizeof(fh) + fh.payload_len;
+        n++;
+    }
+    esp_err_t err = (n == frame && read_frame_header(r, off, &fh)) ? ESP_OK : ESP_ERR_NOT_FOUND;
+    if (err == ESP_OK) {
+        r->frame_no = frame;
+        r->next_off = off;
+    }
+    metrics_lock_give(METRIC_SITE_CONTAINER);
+    return err;
+}
+
+esp_err_t container_seek_time(container_reader_t *r, int64_t ts) {
+    if (!r || !r->f) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!lock_take()) {
+        return ESP_ERR_TIMEOUT;
+    }
+    uint32_t best = 0;
+    uint32_t best_off = r->data_start;
+    container_index_t e;
+
+    /* Binary search the index for the last frame starting at or before ts. */
+    uint32_t lo = 0;
+    uint32_t hi = index_count(r);
+    bool indexed = hi > 0;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (!read_index(r, mid, &e)) {
+            indexed = false;
+            break;
+        }
+        if (e.first_ts <= ts) {
+            best = mid;
+            best_off = e.offset;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* Frames after the indexed ones (or all of them, without a usable index) are walked. */
+    if (!indexed) {
+        best = 0;
+        best_off = r->data_start;
+    }
+    uint32_t n = best;
+    uint32_t off = best_off;
+    container_frame_t fh;
+    while (read_frame_header(r, off, &fh) && (fh.first_ts <= ts || n == 0)) {
+        if (fh.first_ts <= ts) {
+            best = n;
+            best_off = off;
+        }
+        off += (uint32_t)sizeof(fh) + fh.payload_len;
+        n++;
+    }
+    r->frame_no = best;
+    r->next_off = best_off;
+    metrics_lock_give(METRIC_SITE_CONTAINER);
+    return ESP_OK;
+}
+
+esp_err_t container_read_frame(container_reader_t *r, FILE *csv, container_index_t *info) {
+    if (!r || !r->f || !csv) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!lock_take()) {
+        return ESP_ERR_TIMEOUT;
+    }
+    container_frame_t fh;
+    if (!read_frame_header(r, r->next_off, &fh)) {
+        metrics_lock_give(METRIC_SITE_CONTAINER);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    codec_src_t src;
+    codec_sink_t sink;
+    codec_src_init(&src, r->f, r->in_buf, CONTAINER_IN_BLOCK);
+    codec_src_limit(&src, fh.payload_len);
+    codec_sink_init(&sink, csv, r->out_buf, CONTAINER_OUT_BLOCK);
+    r->codec->init(r->state);
+    TRACE_BEGIN("codec.decode", fh.payload_len);
+    esp_err_t err = r->codec->decode(r->state, &src, &sink);
+    TRACE_END("codec.decode");
+    esp_err_t flush_err = codec_sink_flush(&sink);
+    if (err == ESP_OK) {
+        err = flush_err;
+    }
+    metrics_lock_give(METRIC_SITE_CONTAINER);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Frame %u at %u: corrupt payload (%s)", (unsigned)r->frame_no, (unsigned)r->next_off, esp_err_to_name(err));
+        return err;
+    }
+    if (info) {
+        info->first_ts = fh.first_ts;
+        info->rows = fh.rows;
+        info->offset = r->next_off;
+    }
+    r->next_off += (uint32_t)sizeof(fh) + fh.payload_len;
+    r->frame_no++;
+    return ESP_OK;
+}
+
+void container_close(container_reader_t *r) {
+    if (!r) {
+        return;
+    }
+    if (r->f) {
+        fclose(r->f);
+    }
+    if (r->idx) {
+        fclose(r->idx);
+    }
+    free(r->state);
+    free(r->in_buf);
+    free(r->out_buf);
+    memset(r, 0, sizeof(*r));
+}
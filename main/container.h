@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+#include "codec.h"
+
+/*
+* Compressed Output Container.
+*   file  := container_header_t, schema (schema_len bytes), frame*
+*   frame := container_frame_t, payload (payload_len bytes)
+* A payload is one codec stream started from init, so every frame decodes on its own.
+* The last frame may still be open: the compressor keeps appending to it and rewrites its header after each pass.
+* "<file>.idx" holds one container_index_t per frame, in file order. It only caches the frame headers;
+* readers check each entry against the frame it points to and walk the headers when it is missing or stale.
+*/
+#define CONTAINER_MAGIC        0x46435A53u /* "SZCF" */
+#define CONTAINER_FRAME_MAGIC  0x52465A53u /* "SZFR" */
+#define CONTAINER_VERSION      1u
+#define CONTAINER_SCHEMA_MAX   255
+#define CONTAINER_NO_TS        INT64_MIN   /* Frame without a numeric first field. */
+
+/* Rows were dropped from the input once compressed here: this file is their only copy. */
+#define CONTAINER_FLAG_INPUT_DROPPED 0x01u
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t columns;      /* Fields in the first row. */
+    uint32_t frame_rows;   /* Target rows per frame when the file was created. */
+    uint8_t  codec_id;
+    uint8_t  flags;        /* CONTAINER_FLAG_* */
+    uint16_t schema_len;   /* Column-name row that follows, 0 if the data has no header row. */
+    char     codec[16];
+} container_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t payload_len;
+    uint32_t reserved;
+    int64_t  first_ts;     /* Integer part of the first field of the frame's first row. */
+} container_frame_t;
+
+typedef struct {
+    int64_t  first_ts;
+    uint32_t rows;
+    uint32_t offset;       /* File offset of the frame header. */
+} container_index_t;
+
+/*
+* Streaming reader. Each call takes spi_flash_lock for its own I/O only, so a reader can stay open
+* while the compressor keeps appending.
+*/
+typedef struct {
+    FILE                      *f;
+    FILE                      *idx;
+    const compression_codec_t *codec;
+    container_header_t         hdr;
+    char                       schema[CONTAINER_SCHEMA_MAX + 1];
+    uint32_t                   data_start;  /* Offset of the first frame. */
+    uint32_t                   frame_no;    /* Frame returned by the next container_read_frame(). */
+    uint32_t                   next_off;    /* Its header offset. */
+    void                      *state;
+    uint8_t                   *in_buf;
+    uint8_t                   *out_buf;
+} container_reader_t;
+
+/*
+* Open a container and position the reader on its first frame.
+*/
+esp_err_t container_open(container_reader_t *r, const char *path);
+
+/*
+* Position the reader on frame number frame (0-based). ESP_ERR_NOT_FOUND past the last frame.
+*/
+esp_err_t container_seek_frame(container_reader_t *r, uint32_t frame);
+
+/*
+* Position the reader on the last frame whose first timestamp is <= ts (the first frame if none is),
+* so reading from there on returns every row at or after ts. Rows before ts in that frame are the caller's to skip.
+*/
+esp_err_t container_seek_time(container_reader_t *r, int64_t ts);
+
+/*
+* Decode the current frame as CSV into csv and advance to the next one.
+* info (optional) receives the frame's index entry. Returns ESP_ERR_NOT_FOUND after the last frame.
+*/
+esp_err_t container_read_frame(container_reader_t *r, FILE *csv, container_index_t *info);
+
+void container_close(container_reader_t *r);
+
+/* Writer Helpers (used by the compressor). */
+
+/*
+* Write the file header. first_row is the input's first row without its '\n' (NULL while there is none yet);
+* the schema is taken from it when it is a column-name row.
+*/
+esp_err_t container_write_header(FILE *f, const compression_codec_t *codec, uint32_t frame_rows, const char *first_row, size_t len);
+
+/*
+* Header flags of the container at path, 0 if it has no valid header. container_add_flags() sets flags in place
+* and fsyncs. Caller holds spi_flash_lock for both.
+*/
+uint8_t container_get_flags(const char *path);
+esp_err_t container_add_flags(const char *path, uint8_t flags);
+
+/*
+* Integer part of the first field of row, or CONTAINER_NO_TS.
+*/
+int64_t container_row_ts(const char *row, size_t len);
@@ -0,0 +1,188 @@
+#include "csv_field.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CSV_MAX_DIGITS 18
+
+static const int64_t s_pow10[CSV_MAX_DECIMALS + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+/* Exact as float32 up to 1e10, so one division gives the correctly rounded result. */
+static const float s_pow10f[CSV_MAX_DECIMALS + 1] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f
+};
+
+static inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* SWAR: eight ASCII digits at once (first digit in the lowest byte). */
+static inline bool is_8_digits(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ull) | (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4))
+           == 0x3333333333333333ull;
+}
+
+static inline uint32_t parse_8_digits(uint64_t v) {
+    v -= 0x3030303030303030ull;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32)))
+       + (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+/*
+* Parse one field starting at s; stops at ',' or end. Returns the terminator (',' or end).
+*/
+static const char *parse_field(const char *s, const char *end, csv_field_t *f) {
+    const char *start = s;
+    f->mant = 0;
+    f->decimals = 0;
+    f->status = CSV_FIELD_OK;
+
+    while (s < end && is_blank(*s)) s++;
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = (*s == '-');
+        s++;
+    }
+
+    uint64_t m = 0;
+    int digits = 0;
+    int frac = -1;
+    for (;;) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        while (end - s >= 8 && digits + 8 <= CSV_MAX_DIGITS) {
+            uint64_t v;
+            memcpy(&v, s, sizeof(v));
+            if (!is_8_digits(v)) {
+                break;
+            }
+            m = m * 100000000u + parse_8_digits(v);
+            digits += 8;
+            if (frac >= 0) {
+                frac += 8;
+            }
+            s += 8;
+        }
+#endif
+        if (s == end) {
+            break;
+        }
+        char c = *s;
+        if (c >= '0' && c <= '9') {
+            if (digits == CSV_MAX_DIGITS) {
+                f->status = CSV_FIELD_RANGE;
+                break;
+            }
+            m = m * 10 + (uint64_t)(c - '0');
+            digits++;
+            if (frac >= 0) {
+                frac++;
+            }
+            s++;
+        } else if (c == '.' && frac < 0) {
+            frac = 0;
+            s++;
+        } else {
+            break;
+        }
+    }
+
+    while (s < end && is_blank(*s)) s++;
+    const char *stop = s;
+    if (s < end && *s != ',') {
+        f->status = f->status == CSV_FIELD_OK ? CSV_FIELD_INVALID : f->status;
+        stop = memchr(s, ',', (size_t)(end - s));
+        stop = stop ? stop : end;
+    } else if (digits == 0) {
+        f->status = CSV_FIELD_EMPTY;
+        for (const char *p = start; p < stop; p++) {
+            if (!is_blank(*p)) {
+                f->status = CSV_FIELD_INVALID;
+                break;
+            }
+        }
+    } else if (frac > CSV_MAX_DECIMALS) {
+        f->status = CSV_FIELD_RANGE;
+    }
+
+    f->text = start;
+    f->len = (size_t)(stop - start);
+    if (f->status == CSV_FIELD_OK) {
+        f->mant = neg ? -(int64_t)m : (int64_t)m;
+        f->decimals = (uint8_t)(frac < 0 ? 0 : frac);
+    }
+    return stop;
+}
+
+csv_field_status_t csv_parse_decimal(const char *s, const char *end, int64_t *mant, int *decimals) {
+    while (end > s && (end[-1] == '\n' || is_blank(end[-1]))) end--;
+    csv_field_t f;
+    const char *stop = parse_field(s, end, &f);
+    if (f.status == CSV_FIELD_OK && stop != end) {
+        f.status = CSV_FIELD_INVALID; /* A ',' inside a single field. */
+    }
+    if (f.status == CSV_FIELD_OK) {
+        *mant = f.mant;
+        *decimals = f.decimals;
+    }
+    return (csv_field_status_t)f.status;
+}
+
+size_t csv_parse_row(const char *row, size_t len, csv_field_t *fields, size_t max) {
+    const char *p = row;
+    const char *end = row + len;
+    size_t n = 0;
+    for (;;) {
+        const char *stop;
+        if (n < max) {
+            stop = parse_field(p, end, &fields[n]);
+        } else {
+            stop = memchr(p, ',', (size_t)(end - p));
+            stop = stop ? stop : end;
+        }
+        n++;
+        if (stop == end) {
+            return n;
+        }
+        p = stop + 1;
+    }
+}
+
+bool csv_field_float(const csv_field_t *field, float *out) {
+    if (field->status == CSV_FIELD_OK && field->mant > -(1 << 24) && field->mant < (1 << 24)) {
+        *out = (float)field->mant / s_pow10f[field->decimals];
+        return true;
+    }
+    /* Exponents, long mantissas, inf/nan: rare, leave them to strtof on a terminated copy. */
+    char tmp[48];
+    const char *s = field->text;
+    const char *e = field->text + field->len;
+    while (s < e && is_blank(*s)) s++;
+    while (e > s && is_blank(e[-1])) e--;
+    size_t n = (size_t)(e - s);
+    if (n == 0 || n >= sizeof(tmp)) {
+        return false;
+    }
+    memcpy(tmp, s, n);
+    tmp[n] = '\0';
+    char *stop = NULL;
+    *out = strtof(tmp, &stop);
+    return stop == tmp + n;
+}
+
+bool csv_field_scaled(const csv_field_t *field, int decimals, int64_t *out) {
+    if (field->status != CSV_FIELD_OK || field->decimals > decimals || decimals > CSV_MAX_DECIMALS) {
+        return false;
+    }
+    int64_t p = s_pow10[decimals - field->decimals];
+    if (field->mant > INT64_MAX / p || field->mant < INT64_MIN / p) {
+        return false;
+    }
+    *out = field->mant * p;
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* CSV Field Parser: decimal fields straight to fixed-point, no copies, no locale, no allocation.
+* A field is blanks, an optional sign, digits with at most one '.', blanks; its value is mant / 10^decimals.
+* Up to 18 significant digits and CSV_MAX_DECIMALS fractional digits are accepted.
+*/
+#define CSV_MAX_DECIMALS 9
+
+typedef enum {
+    CSV_FIELD_OK = 0,
+    CSV_FIELD_EMPTY,     /* Nothing but blanks. */
+    CSV_FIELD_INVALID,   /* Not a plain decimal (text, exponent, two dots, ...). */
+    CSV_FIELD_RANGE,     /* A decimal with too many digits or decimals. */
+} csv_field_status_t;
+
+typedef struct {
+    int64_t     mant;
+    uint8_t     decimals;
+    uint8_t     status;  /* csv_field_status_t */
+    size_t      len;     /* Raw field text, for callers that fall back to their own parsing. */
+    const char *text;
+} csv_field_t;
+
+/*
+* Parse [s, end) as a single decimal field. Returns a csv_field_status_t.
+*/
+csv_field_status_t csv_parse_decimal(const char *s, const char *end, int64_t *mant, int *decimals);
+
+/*
+* Split a row (without its '\n') on ',' and parse every field. A bad field only marks its own status.
+* Fills at most max entries and returns the row's field count, which is larger than max when the row is wider.
+*/
+size_t csv_parse_row(const char *row, size_t len, csv_field_t *fields, size_t max);
+
+/*
+* Field value as the float32 nearest to its text (what strtof would give). False if the text is not a number.
+*/
+bool csv_field_float(const csv_field_t *field, float *out);
+
+/*
+* Fixed-point value of a field rescaled to `decimals` fractional digits, without rounding.
+* False if the field is not OK, is finer than decimals, or does not fit.
+*/
+bool csv_field_scaled(const csv_field_t *field, int decimals, int64_t *out);
@@ -1,106 +1,226 @@
 #include "heartbeat.h"
 #include "global.h"
+#include "line_reader.h"
+#include "ingest.h"
+#include "metrics.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 
 static const char *TAG = "heartbeat";
 
-static TaskHandle_t heartbeat_task = NULL;
+static _Atomic(TaskHandle_t) heartbeat_task = NULL;
+/* Writer calls inside heartbeat_rows_written(): heartbeat_stop() waits for them before the task exits. */
+static _Atomic int s_notifying = 0;
+/* heartbeat_stop() asks the task to leave; the task clears s_running once it holds no lock or reader. */
+static _Atomic bool s_stop = false;
+static _Atomic bool s_running = false;
 static TaskHandle_t writer_task = NULL;
-static const char *sensing_data_csv = NULL;
-static int heartbeat_freq = 1000;
-static gpio_num_t s_gpio_pin = GPIO_NUM_NC;
 
-/* Count Number of lines to see if new data has been added to sensing data file. */
-static int line_count(const char *file_path) {
-    if (xSemaphoreTake(spi_flash_lock, pdMS_TO_TICKS(2000)) != pdTRUE) {
+/* GPIO pulse length, ended by a one-shot timer so the task never sleeps through a notification. */
+#define HEARTBEAT_PULSE_US 100000
+
+#define HEARTBEAT_TASK_STACK 4096
+
+/* The heartbeat behind heartbeat_start(). */
+static heartbeat_t s_hb = { .period_ms = 1000, .pin = GPIO_NUM_NC };
+
+/*
+* Count rows appended to the sensing data file since the last call.
+* stat() first so a quiet period costs one metadata lookup; only the tail from *known_size on is read.
+* Returns the number of new newlines, or -1 on error.
+*/
+static int count_appended_rows(const char *file_path, size_t *known_size) {
+    struct stat st;
+    if (stat(file_path, &st) != 0) {
+        ESP_LOGE(TAG, "stat failed: %s", file_path);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == *known_size) {
+        return 0;
+    }
+    if (size < *known_size) {
+        /* File was truncated or replaced: rescan it from the start, without reporting growth. */
+        ESP_LOGW(TAG, "%s shrank (%u -> %u bytes), rescanning", file_path, (unsigned)*known_size, (unsigned)size);
+        *known_size = 0;
+        return count_appended_rows(file_path, known_size) < 0 ? -1 : 0;
+    }
+
+    if (!metrics_lock_take(METRIC_SITE_HEARTBEAT, pdMS_TO_TICKS(2000))) {
         ESP_LOGW("HEARTBEAT", "Could not take lock to read %s", file_path);
         return -1;
     }
-    ESP_LOGW(TAG, "Acquired lock. -> Line Count");
-    FILE *f = fopen(file_path, "r");
+    ESP_LOGD(TAG, "Acquired lock. -> Tail Scan");
+    FILE *f = fopen(file_path, "rb");
     if (!f) {
         ESP_LOGE(TAG, "open failed: %s", file_path);
-        xSemaphoreGive(spi_flash_lock);
+        metrics_lock_give(METRIC_SITE_HEARTBEAT);
         return -1;
     }
-    int n = 0;
-    char buf[256];
-    while (fgets(buf, sizeof(buf), f)) n++;
+    line_reader_t lr;
+    if (line_reader_init(&lr, f, (uint32_t)*known_size, LINE_READER_BLOCK) != ESP_OK) {
+        ESP_LOGE(TAG, "tail read setup failed: %s", file_path);
+        line_reader_free(&lr);
+        fclose(f);
+        metrics_lock_give(METRIC_SITE_HEARTBEAT);
+        return -1;
+    }
+    int n = (int)line_reader_count(&lr);
     fclose(f);
+    metrics_lock_give(METRIC_SITE_HEARTBEAT);
 
-    xSemaphoreGive(spi_flash_lock);
+    *known_size = lr.offset;
+    line_reader_free(&lr);
     return n;
 }
 
-/* Heartbeat Task. */
-static void heartbeat_task_func(void *arg) {
-    (void)arg;
-    int last = line_count(sensing_data_csv);
-    if (last < 0) ESP_LOGW(TAG, "initial read failed (%s)", sensing_data_csv);
+static void pulse_end(void *arg) {
+    heartbeat_t *hb = (heartbeat_t *)arg;
+    gpio_set_level(hb->pin, 0);
+}
 
-    gpio_set_direction(s_gpio_pin, GPIO_MODE_OUTPUT);
+static void pulse(heartbeat_t *hb) {
+    gpio_set_level(hb->pin, 1);
+    esp_timer_stop(hb->pulse_timer);   /* Restarted: back-to-back rows stretch one pulse. */
+    esp_timer_start_once(hb->pulse_timer, HEARTBEAT_PULSE_US);
+}
 
-    for (;;) {
-        vTaskDelay(pdMS_TO_TICKS(heartbeat_freq));
-        int cur = line_count(sensing_data_csv);
-        if (cur > last) {
-            ESP_LOGI(TAG, "data grew: %d -> %d", last, cur);
-            gpio_set_level(s_gpio_pin, 1);
-            vTaskDelay(pdMS_TO_TICKS(100));
-            gpio_set_level(s_gpio_pin, 0);
-            last = cur;
-        } else {
-            ESP_LOGD(TAG, "no change (%d)", cur);
+esp_err_t heartbeat_init(heartbeat_t *hb, const char *csv_path, gpio_num_t pin, int period_ms) {
+    if (!hb || !csv_path || period_ms <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_timer_handle_t timer = hb->pulse_timer;
+    memset(hb, 0, sizeof(*hb));
+    strncpy(hb->csv_path, csv_path, sizeof(hb->csv_path) - 1);
+    hb->pin = pin;
+    hb->period_ms = period_ms;
+    hb->pulse_timer = timer;
+    if (!hb->pulse_timer) {
+        const esp_timer_create_args_t args = { .callback = pulse_end, .arg = hb, .name = "heartbeat_pulse" };
+        if (esp_timer_create(&args, &hb->pulse_timer) != ESP_OK) {
+            hb->pulse_timer = NULL;
+            return ESP_FAIL;
         }
     }
+    return ESP_OK;
 }
 
-/* Testing Purposes: Writer task that adds lines to sensing data file to mimic real world data collection. */
-typedef struct {
-    char path[128];
-    int  interval_ms;
-    char line[64];
-} writer_args_t;
-
-/* Adds a new line to the sensing data. */
-static void append_line(const char *path, const char *text) {
+void heartbeat_report(heartbeat_t *hb, uint32_t rows) {
+    if (atomic_fetch_add(&hb->pending_rows, rows) == 0) {
+        atomic_store(&hb->pending_since, (uint32_t)esp_timer_get_time());
+    }
+}
 
-    if (xSemaphoreTake(spi_flash_lock, pdMS_TO_TICKS(2000)) != pdTRUE) {
-        ESP_LOGW("HEARTBEAT", "Could not take lock to read %s", path);
+void heartbeat_check(heartbeat_t *hb) {
+    if (!hb->primed) {
+        hb->rows = count_appended_rows(hb->csv_path, &hb->known_size);
+        if (hb->rows < 0) {
+            ESP_LOGW(TAG, "initial read failed (%s)", hb->csv_path);
+            hb->rows = 0;
+        }
+        gpio_set_direction(hb->pin, GPIO_MODE_OUTPUT);
+        hb->primed = true;
         return;
     }
-    ESP_LOGW(TAG, "Acquired lock. -> Append Line.");
 
-    FILE *f = fopen(path, "a");
-    if (!f) {
-        ESP_LOGE(TAG, "append open failed: %s", path);
-        xSemaphoreGive(spi_flash_lock);
-        return;
+    int added = 0;
+    uint32_t since = atomic_load(&hb->pending_since);
+    uint32_t pending = atomic_exchange(&hb->pending_rows, 0);
+    if (pending > 0) {
+        hb->notified = true;
+        added = (int)pending;
+        metrics_observe(METRIC_HEARTBEAT_LATENCY_US, (uint32_t)esp_timer_get_time() - since);
+    } else if (!hb->notified) {
+        added = count_appended_rows(hb->csv_path, &hb->known_size);
     }
-    unsigned long ts = (unsigned long) esp_log_timestamp();
-    fprintf(f, "%lu, %s\n", ts, text ? text : "Test entry.");
-    fflush(f);
-    fclose(f);
 
-    ESP_LOGW(TAG, "Released lock. -> Append Line.");
-    xSemaphoreGive(spi_flash_lock);
+    if (added > 0) {
+        ESP_LOGI(TAG, "%s grew: %d -> %d", hb->csv_path, hb->rows, hb->rows + added);
+        hb->rows += added;
+        hb->quiet = false;
+        metrics_count(METRIC_HEARTBEAT_EVENTS, 1);
+        pulse(hb);
+    } else {
+        metrics_count(METRIC_HEARTBEAT_MISSES, 1);
+        if (!hb->quiet) {
+            ESP_LOGW(TAG, "%s: no data for %d ms (expected write frequency)", hb->csv_path, hb->period_ms);
+            hb->quiet = true;
+        }
+    }
+}
+
+void heartbeat_deinit(heartbeat_t *hb) {
+    if (hb && hb->pulse_timer) {
+        esp_timer_stop(hb->pulse_timer);
+        esp_timer_delete(hb->pulse_timer);
+        hb->pulse_timer = NULL;
+        gpio_set_level(hb->pin, 0);
+    }
+}
+
+/* Writers (the ingest flusher) report rows here; may be called from any task. */
+static void heartbeat_rows_written(uint32_t rows) {
+    atomic_fetch_add(&s_notifying, 1);
+    heartbeat_report(&s_hb, rows);
+    TaskHandle_t task = atomic_load(&heartbeat_task);
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+    atomic_fetch_sub(&s_notifying, 1);
+}
+
+/*
+* Heartbeat Task.
+* Blocks until a writer reports rows. Waking up on the timeout means nothing was written for a whole expected
+* write period: that is the watchdog. Until an in-process writer has reported once, the timeout also checks the
+* file, so data from other writers is still seen.
+*/
+static void heartbeat_task_func(void *arg) {
+    (void)arg;
+    metrics_register_task(xTaskGetCurrentTaskHandle(), "heartbeat", HEARTBEAT_TASK_STACK);
+    heartbeat_check(&s_hb);
+    while (!atomic_load(&s_stop)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(s_hb.period_ms));
+        if (!atomic_load(&s_stop)) {
+            heartbeat_check(&s_hb);
+        }
+    }
+    /* Outside heartbeat_check(): a tail scan holds spi_flash_lock and a line reader buffer. */
+    metrics_unregister_task(xTaskGetCurrentTaskHandle());
+    atomic_store(&s_running, false);
+    vTaskDelete(NULL);
 }
 
+/* Testing Purposes: Writer task that adds lines to sensing data file to mimic real world data collection. */
+typedef struct {
+    char path[128];
+    int  interval_ms;
+    char line[64];
+} writer_args_t;
+
 static void writer_task_func(void *arg) {
     writer_args_t a = *(writer_args_t *)arg;
     free(arg); /* Debugged: struct copied args need to be freed.*/
+    metrics_register_task(xTaskGetCurrentTaskHandle(), "test_writer", HEARTBEAT_TASK_STACK);
 
+    char row[96];
     for (;;) {
         vTaskDelay(pdMS_TO_TICKS(a.interval_ms));
-        append_line(a.path, a.line[0] ? a.line : "Test line.");
-        ESP_LOGI(TAG, "writer: appended to %s", a.path);
+        unsigned long ts = (unsigned long) esp_log_timestamp();
+        int n = snprintf(row, sizeof(row), "%lu, %s\n", ts, a.line[0] ? a.line : "Test line.");
+        if (ingest_push(row, (size_t)n < sizeof(row) ? (size_t)n : sizeof(row) - 1) != ESP_OK) {
+            ESP_LOGW(TAG, "writer: row dropped (ingest ring full)");
+        } else {
+            ESP_LOGD(TAG, "writer: queued row for %s", a.path);
+        }
     }
 }
 
@@ -109,38 +229,55 @@ esp_err_t heartbeat_start(const char *csv_path, gpio_num_t pin, int period_ms) {
     if (!csv_path || period_ms <= 0){
         return ESP_ERR_INVALID_ARG;
     }
-    if (heartbeat_task){
+    if (atomic_load(&heartbeat_task)){
         return ESP_OK;
     }
 
     /* Update set up given by developer inputs OR default. */
-    sensing_data_csv = csv_path;
-    s_gpio_pin = pin;
-    heartbeat_freq = period_ms;
+    esp_err_t err = heartbeat_init(&s_hb, csv_path, pin, period_ms);
+    if (err != ESP_OK) {
+        return err;
+    }
 
-    BaseType_t ok = xTaskCreate(heartbeat_task_func, "heartbeat_task", 4096, NULL, 5, &heartbeat_task);
+    TaskHandle_t task = NULL;
+    atomic_store(&s_stop, false);
+    atomic_store(&s_running, true);
+    BaseType_t ok = xTaskCreate(heartbeat_task_func, "heartbeat_task", HEARTBEAT_TASK_STACK, NULL, 5, &task);
 
     if (ok != pdPASS){
+        atomic_store(&s_running, false);
         return ESP_FAIL;
     } 
-    
+    atomic_store(&heartbeat_task, task);
+    ingest_set_written_cb(heartbeat_rows_written);
     return ESP_OK;
 }
 
 void heartbeat_set_period_ms(int period_ms) {
     if (period_ms > 0){
-        heartbeat_freq = period_ms;
+        s_hb.period_ms = period_ms;
     } else {
         ESP_LOGW(TAG, "Heartbeat Frequency entered < 0. Using Default Frequency.");
     }
 }
 
 void heartbeat_stop(void) {
-    if (!heartbeat_task){
+    TaskHandle_t task = atomic_exchange(&heartbeat_task, NULL);
+    if (!task){
         return;
     }
-    vTaskDelete(heartbeat_task);
-    heartbeat_task = NULL;
+    ingest_set_written_cb(NULL);
+    /* A writer may have read the handle just before it was cleared: let it finish notifying first. */
+    while (atomic_load(&s_notifying) > 0) {
+        vTaskDelay(1);
+    }
+    atomic_store(&s_stop, true);
+    xTaskNotifyGive(task);
+    while (atomic_load(&s_running)) {
+        vTaskDelay(1);
+    }
+    esp_timer_stop(s_hb.pulse_timer);
+    gpio_set_level(s_hb.pin, 0);
 }
 
 /* Heartbeat Testing Function Calls. */
@@ -153,6 +290,12 @@ esp_err_t test_writer_start(const char *csv_path, int interval_ms, const char *l
         return ESP_OK;
     }
 
+    /* Rows go through the ingest ring; its flusher owns the file. */
+    esp_err_t err = ingest_start(csv_path, 0, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+
     writer_args_t *args = (writer_args_t *) calloc(1, sizeof(writer_args_t));
     if (!args){
         return ESP_ERR_NO_MEM;
@@ -163,7 +306,7 @@ esp_err_t test_writer_start(const char *csv_path, int interval_ms, const char *l
         strncpy(args->line, line_text, sizeof(args->line)-1);
     }
 
-    BaseType_t ok = xTaskCreate(writer_task_func, "test_writer", 4096, args, 5, &writer_task);
+    BaseType_t ok = xTaskCreate(writer_task_func, "test_writer", HEARTBEAT_TASK_STACK, args, 5, &writer_task);
     if (ok != pdPASS){ 
         free(args); 
         return ESP_FAIL;
@@ -175,6 +318,8 @@ void test_writer_stop(void) {
     if (!writer_task){
         return;
     }
+    metrics_unregister_task(writer_task);
     vTaskDelete(writer_task);
     writer_task = NULL;
+    ingest_stop();
 }
\ No newline at end of file
@@ -1,16 +1,56 @@
 #pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 
+/*
+* One heartbeat: a pin pulsed when rows reach a CSV, and a watchdog for periods without any.
+* heartbeat_start() runs one in its own task; pipelines (see pipeline.h) drive theirs from a shared worker.
+*/
+typedef struct {
+    char               csv_path[128];
+    gpio_num_t         pin;
+    int                period_ms;       /* Expected write frequency. */
+    esp_timer_handle_t pulse_timer;
+    _Atomic uint32_t   pending_rows;    /* Reported by writers, not yet seen by heartbeat_check(). */
+    _Atomic uint32_t   pending_since;   /* esp_timer time (low 32 bits, us) of the oldest unseen report. */
+    bool               primed;          /* The file's existing rows have been counted. */
+    bool               notified;        /* An in-process writer has reported: stop looking at the file. */
+    bool               quiet;           /* The missing-data warning has been logged. */
+    size_t             known_size;
+    int                rows;
+} heartbeat_t;
+
+/* Set up hb (creating its pulse timer). hb must not move afterwards. */
+esp_err_t heartbeat_init(heartbeat_t *hb, const char *csv_path, gpio_num_t pin, int period_ms);
+
+/* A writer put rows on flash. Any task; the caller then wakes whoever calls heartbeat_check(). */
+void heartbeat_report(heartbeat_t *hb, uint32_t rows);
+
+/*
+* Consume the reported rows and pulse, or count a miss if there were none. Call it on every report and at
+* least once per period_ms. The first call only counts the rows already in the file.
+* Until a writer has reported, each call also checks the file for rows from other writers.
+*/
+void heartbeat_check(heartbeat_t *hb);
+
+/* Stop the pulse and delete its timer. */
+void heartbeat_deinit(heartbeat_t *hb);
+
 /*
 * Start Heartbeat Task. 
-* Reads sensing file periodically to see if new lines were added (indicating increase in data).
+* Pulses pin for every batch of rows the ingest flusher writes, as soon as it is on flash, without reading the file.
+* period_ms is the expected write frequency: a period without data is logged. Until ingest reports its first
+* batch, the task checks csv_path once per period and counts only the newly appended lines.
 */
 esp_err_t heartbeat_start(const char *csv_path, gpio_num_t pin, int period_ms);
 
 /*
-* Start Heartbeat Task. 
-* Sets the frequency at which the task checks the sensing csv for new data. 
+* Sets the expected write frequency: the watchdog period after which missing data is reported.
 */
 void heartbeat_set_period_ms(int period_ms);
 
@@ -21,6 +61,7 @@ void heartbeat_stop(void);
 
 /*
 * Testing: Starts the task that adds a new line to the csv to mimic data written to the file in the real world.
+* Rows are queued with ingest_push(); ingest is started on csv_path if it isn't running.
 */
 esp_err_t test_writer_start(const char *csv_path, int interval_ms, const char *line_text);
 
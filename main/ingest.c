@@ -0,0 +1,418 @@
+#include "ingest.h"
+#include "segment.h"
+#include "rawlog.h"
+#include "rollup.h"
+#include "line_reader.h"
+#include "page_write.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *TAG = "ingest";
+
+/* Longest wait for spi_flash_lock; on timeout the batch stays in the ring for the next wake-up. */
+#define INGEST_LOCK_TICKS pdMS_TO_TICKS(2000)
+
+#define INGEST_TASK_STACK 4096
+
+static TaskHandle_t s_task = NULL;
+static SemaphoreHandle_t s_done = NULL;
+static char s_path[128];
+static segment_store_t *s_store = NULL;
+static rawlog_t *s_log = NULL;
+static int s_latency_ms = INGEST_MAX_LATENCY_MS;
+static FILE *s_file = NULL;
+static volatile bool s_stopping = false;
+static ingest_written_cb_t s_written_cb = NULL;
+static ingest_row_cb_t s_row_cb = NULL;
+
+/*
+* The ring. head and tail are free-running byte counters: the producer only writes head, the flusher only writes tail.
+* The ring always holds whole rows, so whatever the flusher takes ends on a '\n'.
+*/
+static char *s_ring = NULL;
+static uint32_t s_size = 0;
+static uint32_t s_flush_bytes = 0;
+static _Atomic uint32_t s_head;
+static _Atomic uint32_t s_tail;
+
+static ingest_stats_t s_stats;
+
+/* Append tail..head to the current file under spi_flash_lock. */
+static esp_err_t write_file(uint32_t tail, uint32_t head, uint32_t *written, uint32_t *rows) {
+    if (!metrics_lock_take(METRIC_SITE_INGEST, INGEST_LOCK_TICKS)) {
+        ESP_LOGW(TAG, "Lock timeout, keeping %u bytes queued", (unsigned)(head - tail));
+        return ESP_ERR_TIMEOUT;
+    }
+    if (!s_file) {
+        if (s_store) {
+            segment_path(s_store, s_store->active, s_path, sizeof(s_path));
+        }
+        s_file = fopen(s_path, "a");
+        if (s_file) {
+            /* Batches are already page-sized: no second copy in a stdio buffer. */
+            setvbuf(s_file, NULL, _IONBF, 0);
+            fseek(s_file, 0, SEEK_END);
+        }
+    }
+    esp_err_t err = ESP_OK;
+    if (!s_file) {
+        ESP_LOGE(TAG, "fopen(%s) failed", s_path);
+        err = ESP_FAIL;
+    }
+    while (err == ESP_OK && tail + *written != head) {
+        uint32_t off = (tail + *written) & (s_size - 1);
+        uint32_t n = head - (tail + *written);
+        if (n > s_size - off) {
+            n = s_size - off;
+        }
+        TRACE_BEGIN("ingest.write", n);
+        size_t w = page_write(s_file, s_ring + off, n);
+        TRACE_END("ingest.write");
+        *rows += (uint32_t)line_count(s_ring + off, w);
+        *written += (uint32_t)w;
+        if (w != n) {
+            err = ESP_FAIL;
+        }
+    }
+    if (s_file && (fflush(s_file) != 0 || fsync(fileno(s_file)) != 0)) {
+        err = ESP_FAIL;
+    }
+    if (err != ESP_OK) {
+        /* Reopen next time: the bytes that did get written are not written again. */
+        if (s_file) {
+            fclose(s_file);
+            s_file = NULL;
+        }
+    } else if (s_store && ftell(s_file) >= (long)s_store->segment_bytes) {
+        /* Batches end on a row, so a segment never splits one. */
+        fclose(s_file);
+        s_file = NULL;
+        segment_seal(s_store);
+    }
+    metrics_lock_give(METRIC_SITE_INGEST);
+    return err;
+}
+
+/*
+* Append tail..head to the raw log, one record per slot. A record ends after the last '\n' that fits, so rows
+* only straddle records when one is longer than a slot. No spi_flash_lock: SPIFFS is not involved.
+*/
+static esp_err_t write_rawlog(uint32_t tail, uint32_t head, uint32_t *written, uint32_t *rows) {
+    char rec[INGEST_PAGE_SIZE * 4];
+    size_t max = rawlog_max_record(s_log);
+    if (max > sizeof(rec)) {
+        max = sizeof(rec);
+    }
+    esp_err_t err = ESP_OK;
+    while (err == ESP_OK && tail + *written != head) {
+        uint32_t pos = tail + *written;
+        uint32_t n = head - pos;
+        if (n > max) {
+            n = (uint32_t)max;
+        }
+        uint32_t off = pos & (s_size - 1);
+        uint32_t first = n < s_size - off ? n : s_size - off;
+        memcpy(rec, s_ring + off, first);
+        memcpy(rec + first, s_ring, n - first);
+        if (head - pos > n) {
+            uint32_t cut = n;
+            while (cut > 0 && rec[cut - 1] != '\n') {
+                cut--;
+            }
+            if (cut > 0) {
+                n = cut;
+            }
+        }
+        TRACE_BEGIN("ingest.write", n);
+        err = rawlog_append(s_log, rec, n, NULL);
+        TRACE_END("ingest.write");
+        if (err == ESP_OK) {
+            *rows += (uint32_t)line_count(rec, n);
+            *written += n;
+        }
+    }
+    return err;
+}
+
+/* Hand the rows of [tail, tail + len) to the row callback, then end the batch. */
+static void feed_rows(ingest_row_cb_t cb, uint32_t tail, uint32_t len) {
+    char wrapped[INGEST_PAGE_SIZE];
+    uint32_t pos = tail;
+    while (pos != tail + len) {
+        uint32_t off = pos & (s_size - 1);
+        uint32_t left = tail + len - pos;
+        uint32_t contig = left < s_size - off ? left : s_size - off;
+        size_t n = line_find(s_ring + off, contig);
+        if (n < contig || contig == left) {
+            cb(s_ring + off, n);
+            pos += (uint32_t)(n < contig ? n + 1 : n);
+            continue;
+        }
+        /* The row runs past the end of the ring. */
+        size_t rest = line_find(s_ring, left - contig);
+        if (contig + rest <= sizeof(wrapped)) {
+            memcpy(wrapped, s_ring + off, contig);
+            memcpy(wrapped + contig, s_ring, rest);
+            cb(wrapped, contig + rest);
+        } else {
+            /* A cut copy would end in a different number: leave the row out rather than aggregate it. */
+            s_stats.rows_unfed++;
+            ESP_LOGW(TAG, "%u byte row not passed to the row callback", (unsigned)(contig + rest));
+        }
+        pos += contig + (uint32_t)(rest < left - contig ? rest + 1 : rest);
+    }
+    cb(NULL, 0);
+}
+
+/* Write everything between tail and head. Called from the flusher task only. */
+static esp_err_t drain(void) {
+    uint32_t tail = atomic_load_explicit(&s_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&s_head, memory_order_acquire);
+    if (head == tail) {
+        return ESP_OK;
+    }
+    uint32_t written = 0;
+    uint32_t rows = 0;
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = s_log ? write_rawlog(tail, head, &written, &rows) : write_file(tail, head, &written, &rows);
+    if (err == ESP_ERR_TIMEOUT) {
+        return err;
+    }
+    if (written) {
+        metrics_observe(METRIC_INGEST_WRITE_US, (uint32_t)(esp_timer_get_time() - t0));
+        metrics_observe(METRIC_INGEST_BATCH_BYTES, written);
+        metrics_count(METRIC_INGEST_BYTES, written);
+        metrics_count(METRIC_INGEST_BATCHES, 1);
+    }
+
+    ingest_row_cb_t row_cb = s_row_cb;
+    if (row_cb && written) {
+        TRACE_BEGIN("ingest.rows", written);
+        feed_rows(row_cb, tail, written);
+        TRACE_END("ingest.rows");
+    }
+    atomic_store_explicit(&s_tail, tail + written, memory_order_release);
+    s_stats.bytes_written += written;
+    s_stats.batches += written > 0;
+    ingest_written_cb_t cb = s_written_cb;
+    if (cb && rows) {
+        cb(rows);
+    }
+    if (err != ESP_OK) {
+        s_stats.write_errors++;
+        ESP_LOGE(TAG, "Write to %s failed after %u of %u bytes", s_log ? s_log->part->label : s_path, (unsigned)written, (unsigned)(head - tail));
+    }
+    return err;
+}
+
+/* Flusher Task: woken by the producer at the size threshold, or by the timeout at the latest. */
+static void flusher_task(void *arg) {
+    (void)arg;
+    metrics_register_task(xTaskGetCurrentTaskHandle(), "ingest", INGEST_TASK_STACK);
+    while (!s_stopping) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(s_latency_ms));
+        drain();
+    }
+    drain();
+    if (metrics_lock_take(METRIC_SITE_INGEST, INGEST_LOCK_TICKS)) {
+        if (s_file) {
+            fclose(s_file);
+        }
+        metrics_lock_give(METRIC_SITE_INGEST);
+    } else if (s_file) {
+        fclose(s_file);
+    }
+    s_file = NULL;
+    metrics_unregister_task(xTaskGetCurrentTaskHandle());
+    xSemaphoreGive(s_done);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t ingest_begin(size_t ring_bytes, int max_latency_ms) {
+    if (ring_bytes == 0) {
+        ring_bytes = INGEST_RING_BYTES;
+    }
+    uint32_t size = INGEST_PAGE_SIZE;
+    while (size < ring_bytes && size < (1u << 30)) {
+        size <<= 1;
+    }
+
+    s_ring = malloc(size);
+    if (!s_done) {
+        s_done = xSemaphoreCreateBinary();
+    }
+    if (!s_ring || !s_done) {
+        free(s_ring);
+        s_ring = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    s_size = size;
+    /* Leave room for rows to keep arriving while a batch is written. */
+    s_flush_bytes = INGEST_FLUSH_PAGES * INGEST_PAGE_SIZE;
+    if (s_flush_bytes > size / 2) {
+        s_flush_bytes = size / 2;
+    }
+    s_latency_ms = max_latency_ms > 0 ? max_latency_ms : INGEST_MAX_LATENCY_MS;
+    atomic_store(&s_head, 0);
+    atomic_store(&s_tail, 0);
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stopping = false;
+
+    BaseType_t ok = xTaskCreate(flusher_task, "ingest_flusher", INGEST_TASK_STACK, NULL, 5, &s_task);
+    if (ok != pdPASS) {
+        s_task = NULL;
+        free(s_ring);
+        s_ring = NULL;
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Ingest -> %s (%u byte ring, flush at %u bytes or %d ms)", s_log ? s_log->part->label : (s_store ? s_store->base : s_path), (unsigned)s_size, (unsigned)s_flush_bytes, s_latency_ms);
+    return ESP_OK;
+}
+
+esp_err_t ingest_start(const char *csv_path, size_t ring_bytes, int max_latency_ms) {
+    if (!csv_path) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_task) {
+        return ESP_OK;
+    }
+    strncpy(s_path, csv_path, sizeof(s_path) - 1);
+    s_store = NULL;
+    s_log = NULL;
+    return ingest_begin(ring_bytes, max_latency_ms);
+}
+
+esp_err_t ingest_start_segments(segment_store_t *store, size_t ring_bytes, int max_latency_ms) {
+    if (!store) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_task) {
+        return ESP_OK;
+    }
+    s_store = store;
+    s_log = NULL;
+    return ingest_begin(ring_bytes, max_latency_ms);
+}
+
+esp_err_t ingest_start_rawlog(rawlog_t *log, size_t ring_bytes, int max_latency_ms) {
+    if (!log || !log->map) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_task) {
+        return ESP_OK;
+    }
+    s_store = NULL;
+    s_log = log;
+    return ingest_begin(ring_bytes, max_latency_ms);
+}
+
+esp_err_t ingest_push(const char *row, size_t len) {
+    if (!s_ring || s_stopping) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!row) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool nl = len == 0 || row[len - 1] != '\n';
+    size_t need = len + nl;
+    if (need > s_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t head = atomic_load_explicit(&s_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&s_tail, memory_order_acquire);
+    uint32_t used = head - tail;
+    if (need > s_size - used) {
+        s_stats.rows_dropped++;
+        metrics_count(METRIC_INGEST_DROPPED, 1);
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint32_t off = head & (s_size - 1);
+    size_t first = len < s_size - off ? len : s_size - off;
+    memcpy(s_ring + off, row, first);
+    memcpy(s_ring, row + first, len - first);
+    if (nl) {
+        s_ring[(head + len) & (s_size - 1)] = '\n';
+    }
+    atomic_store_explicit(&s_head, head + (uint32_t)need, memory_order_release);
+
+    s_stats.rows++;
+    metrics_count(METRIC_INGEST_ROWS, 1);
+    used += (uint32_t)need;
+    if (used > s_stats.high_water) {
+        s_stats.high_water = used;
+    }
+    /* Wake the flusher once, when the threshold is crossed. */
+    if (used >= s_flush_bytes && used - need < s_flush_bytes) {
+        xTaskNotifyGive(s_task);
+    }
+    return ESP_OK;
+}
+
+esp_err_t ingest_flush(int timeout_ms) {
+    if (!s_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint32_t target = atomic_load_explicit(&s_head, memory_order_acquire);
+    xTaskNotifyGive(s_task);
+    for (int waited = 0; (int32_t)(atomic_load_explicit(&s_tail, memory_order_acquire) - target) < 0; waited += 10) {
+        if (waited >= timeout_ms) {
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return ESP_OK;
+}
+
+void ingest_set_written_cb(ingest_written_cb_t cb) {
+    s_written_cb = cb;
+}
+
+void ingest_set_row_cb(ingest_row_cb_t cb) {
+    s_row_cb = cb;
+}
+
+void ingest_get_stats(ingest_stats_t *out) {
+    if (out) {
+        *out = s_stats;
+    }
+}
+
+void ingest_release_file(void) {
+    if (s_file) {
+        fclose(s_file);
+        s_file = NULL;
+    }
+}
+
+void ingest_stop(void) {
+    if (!s_task) {
+        return;
+    }
+    s_stopping = true;
+    xTaskNotifyGive(s_task);
+    if (xSemaphoreTake(s_done, pdMS_TO_TICKS(10000)) != pdTRUE) {
+        /* Stuck on flash: the ring must outlive the task, so leave both alone. */
+        ESP_LOGE(TAG, "Flusher did not stop");
+        return;
+    }
+    s_task = NULL;
+    free(s_ring);
+    s_ring = NULL;
+    /* The flusher fed its last rows: the open windows would otherwise only live until the next reset. */
+    rollup_flush();
+}
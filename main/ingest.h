@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "segment.h"
+#include "rawlog.h"
+
+/* SPIFFS logical page: the flusher writes whole batches of rows, at least this many pages at a time when busy. */
+#define INGEST_PAGE_SIZE       256
+
+/* Defaults for ingest_start(). */
+#define INGEST_RING_BYTES      8192
+#define INGEST_FLUSH_PAGES     8
+#define INGEST_MAX_LATENCY_MS  1000
+
+typedef struct {
+    uint32_t rows;          /* Rows accepted by ingest_push(). */
+    uint32_t rows_dropped;  /* Rows refused because the ring was full. */
+    uint32_t bytes_written; /* Bytes the flusher wrote to the file. */
+    uint32_t batches;       /* Flash writes (each one fwrite + fsync under spi_flash_lock). */
+    uint32_t high_water;    /* Most bytes ever waiting in the ring. */
+    uint32_t write_errors;
+    uint32_t rows_unfed;    /* Rows kept from the row callback: they wrap the ring and exceed INGEST_PAGE_SIZE. */
+} ingest_stats_t;
+
+/*
+* Sensor Data Ingest.
+* Rows are pushed into a lock-free single-producer/single-consumer ring in RAM; a flusher task appends them
+* to csv_path through one long-lived file handle. It writes when INGEST_FLUSH_PAGES pages are waiting or when the
+* oldest waiting row is max_latency_ms old, whichever comes first, taking spi_flash_lock once per batch.
+* ring_bytes is rounded up to a power of two (0: INGEST_RING_BYTES); max_latency_ms <= 0 uses INGEST_MAX_LATENCY_MS.
+* If ingest is already running it keeps its destination and this returns ESP_OK.
+*/
+esp_err_t ingest_start(const char *csv_path, size_t ring_bytes, int max_latency_ms);
+
+/*
+* Same, appending to the active segment of store and sealing it once it holds store->segment_bytes.
+* store must stay valid until ingest_stop().
+*/
+esp_err_t ingest_start_segments(segment_store_t *store, size_t ring_bytes, int max_latency_ms);
+
+/*
+* Same, appending to a raw partition log instead of SPIFFS. Each batch is cut into records of up to one slot,
+* ending on row boundaries, so reading the records back in order gives the CSV stream.
+* log must stay open until ingest_stop().
+*/
+esp_err_t ingest_start_rawlog(rawlog_t *log, size_t ring_bytes, int max_latency_ms);
+
+/*
+* Queue one row (a '\n' is added if missing). Never blocks and never touches flash.
+* Only one task may push. Returns ESP_ERR_NO_MEM when the ring is full: the row is dropped and counted.
+*/
+esp_err_t ingest_push(const char *row, size_t len);
+
+/*
+* Write everything pushed so far and wait (up to timeout_ms) until it is on flash.
+*/
+esp_err_t ingest_flush(int timeout_ms);
+
+/* Called from the flusher task after each batch is on flash, with the number of rows it held. */
+typedef void (*ingest_written_cb_t)(uint32_t rows);
+
+/*
+* Register (or with NULL, remove) the one batch-written callback. Keep it short: it runs between batches.
+*/
+void ingest_set_written_cb(ingest_written_cb_t cb);
+
+/*
+* Called from the flusher task for each row of a batch once it is on flash (row without its '\n'), then with
+* NULL when the batch is done. A row that wraps around the ring is passed as a copy if it fits INGEST_PAGE_SIZE
+* bytes and is otherwise skipped (counted in rows_unfed), never passed cut short.
+*/
+typedef void (*ingest_row_cb_t)(const char *row, size_t len);
+
+/*
+* Register (or with NULL, remove) the one row callback.
+*/
+void ingest_set_row_cb(ingest_row_cb_t cb);
+
+void ingest_get_stats(ingest_stats_t *out);
+
+/*
+* Close the flusher's file so its next batch opens csv_path again, e.g. because the file is being replaced.
+* The caller must hold spi_flash_lock, under which the flusher does all of its file access.
+*/
+void ingest_release_file(void);
+
+/*
+* Flush what is left, close the file and stop the flusher task, then write the open rollup windows (rollup.h).
+*/
+void ingest_stop(void);
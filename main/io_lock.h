@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+* Optional hooks around a single file access (one block read or one buffer write).
+* Lets long scans hold spi_flash_lock for one access at a time instead of for the whole scan.
+* take returns false on timeout; the access then fails with ESP_ERR_TIMEOUT. ctx is passed to both hooks.
+*/
+typedef struct {
+    bool (*take)(void *ctx);
+    void (*give)(void *ctx);
+    void *ctx;
+} io_lock_t;
@@ -0,0 +1,221 @@
+#include "line_reader.h"
+#include "trace.h"
+
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "line_reader";
+
+/* Word-at-a-time helpers: a word holds sizeof(uintptr_t) bytes, 4 on the ESP32. */
+#define LR_ONES  ((uintptr_t)-1 / 0xFF)
+#define LR_HIGHS (LR_ONES * 0x80)
+#define LR_NL    (LR_ONES * '\n')
+
+/* 0x80 in every byte of w that equals '\n', 0 elsewhere. */
+static inline uintptr_t nl_bytes(uintptr_t w) {
+    w ^= LR_NL;
+    return ~(((w & ~LR_HIGHS) + ~LR_HIGHS) | w | ~LR_HIGHS);
+}
+
+size_t line_find(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && ((uintptr_t)(p + i) & (sizeof(uintptr_t) - 1))) {
+        if (p[i] == '\n') {
+            return i;
+        }
+        i++;
+    }
+    for (; i + sizeof(uintptr_t) <= len; i += sizeof(uintptr_t)) {
+        uintptr_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (nl_bytes(w)) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (p[i] == '\n') {
+            return i;
+        }
+    }
+    return len;
+}
+
+size_t line_count(const char *p, size_t len) {
+    TRACE_BEGIN("line_count", len);
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len && ((uintptr_t)(p + i) & (sizeof(uintptr_t) - 1))) {
+        n += p[i++] == '\n';
+    }
+    for (; i + sizeof(uintptr_t) <= len; i += sizeof(uintptr_t)) {
+        uintptr_t w;
+        memcpy(&w, p + i, sizeof(w));
+        n += (size_t)__builtin_popcountl((unsigned long)nl_bytes(w));
+    }
+    for (; i < len; i++) {
+        n += p[i] == '\n';
+    }
+    TRACE_END("line_count");
+    return n;
+}
+
+/* Offset just past the last '\n' in p[0, len), or 0 if there is none. */
+static size_t last_row_end(const char *p, size_t len) {
+    while (len > 0 && p[len - 1] != '\n') {
+        len--;
+    }
+    return len;
+}
+
+esp_err_t line_reader_init(line_reader_t *r, FILE *f, uint32_t offset, size_t block) {
+    memset(r, 0, sizeof(*r));
+    r->f = f;
+    r->block = block ? block : LINE_READER_BLOCK;
+    r->cap = r->block;
+    r->offset = offset;
+    r->limit = UINT32_MAX;
+    r->buf = malloc(r->cap);
+    if (!r->buf) {
+        r->err = ESP_ERR_NO_MEM;
+        return r->err;
+    }
+    if (fseek(f, (long)offset, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "seek to %u failed", (unsigned)offset);
+        r->err = ESP_FAIL;
+    }
+    return r->err;
+}
+
+void line_reader_set_limit(line_reader_t *r, uint32_t end) {
+    r->limit = end;
+}
+
+void line_reader_set_lock(line_reader_t *r, const io_lock_t *lock) {
+    r->lock = lock;
+}
+
+/* Keep the unconsumed bytes, make room (growing for long rows) and read up to the next block boundary. */
+static bool refill(line_reader_t *r) {
+    if (r->err != ESP_OK) {
+        return false;
+    }
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len == r->cap) {
+        char *grown = realloc(r->buf, r->cap * 2);
+        if (!grown) {
+            ESP_LOGE(TAG, "no memory for a %u byte row", (unsigned)r->len);
+            r->err = ESP_ERR_NO_MEM;
+            return false;
+        }
+        r->buf = grown;
+        r->cap *= 2;
+    }
+    size_t room = r->cap - r->len;
+    size_t tail = (r->offset + r->len + room) % r->block;
+    size_t want = tail < room ? room - tail : room;
+    uint32_t at = r->offset + (uint32_t)r->len;
+    if (at >= r->limit) {
+        return false;
+    }
+    if (want > r->limit - at) {
+        want = r->limit - at;
+    }
+    if (r->lock && !r->lock->take(r->lock->ctx)) {
+        r->err = ESP_ERR_TIMEOUT;
+        return false;
+    }
+    size_t rd = fread(r->buf + r->len, 1, want, r->f);
+    if (r->lock) {
+        r->lock->give(r->lock->ctx);
+    }
+    if (rd == 0 && ferror(r->f)) {
+        ESP_LOGE(TAG, "read failed at %u", (unsigned)(r->offset + r->len));
+        r->err = ESP_FAIL;
+    }
+    r->len += rd;
+    return rd > 0;
+}
+
+/* Length of the next row (without '\n') once a complete row is buffered. */
+static bool find_row(line_reader_t *r, size_t *row_len) {
+    for (;;) {
+        size_t i = r->scanned + line_find(r->buf + r->pos + r->scanned, r->len - r->pos - r->scanned);
+        if (r->pos + i < r->len) {
+            *row_len = i;
+            return true;
+        }
+        r->scanned = r->len - r->pos;
+        if (!refill(r)) {
+            return false;
+        }
+    }
+}
+
+static void row_view(const line_reader_t *r, size_t n, const char **row, size_t *len) {
+    *row = r->buf + r->pos;
+    *len = n;
+    while (*len && (*row)[*len - 1] == '\r') {
+        (*len)--;
+    }
+}
+
+bool line_reader_peek(line_reader_t *r, const char **row, size_t *len) {
+    size_t n;
+    if (!find_row(r, &n)) {
+        return false;
+    }
+    row_view(r, n, row, len);
+    return true;
+}
+
+bool line_reader_next(line_reader_t *r, const char **row, size_t *len) {
+    size_t n;
+    if (!find_row(r, &n)) {
+        return false;
+    }
+    row_view(r, n, row, len);
+    r->pos += n + 1;
+    r->offset += (uint32_t)(n + 1);
+    r->scanned = 0;
+    return true;
+}
+
+bool line_reader_rows(line_reader_t *r, const char **rows, size_t *len) {
+    for (;;) {
+        size_t from = r->pos + r->scanned;
+        size_t n = last_row_end(r->buf + from, r->len - from);
+        if (n > 0) {
+            *rows = r->buf + r->pos;
+            *len = r->scanned + n;
+            r->pos += *len;
+            r->offset += (uint32_t)*len;
+            r->scanned = 0;
+            return true;
+        }
+        r->scanned = r->len - r->pos;
+        if (!refill(r)) {
+            return false;
+        }
+    }
+}
+
+size_t line_reader_count(line_reader_t *r) {
+    size_t n = 0;
+    do {
+        n += line_count(r->buf + r->pos, r->len - r->pos);
+        r->offset += (uint32_t)(r->len - r->pos);
+        r->pos = r->len = r->scanned = 0;
+    } while (refill(r));
+    return n;
+}
+
+void line_reader_free(line_reader_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+#include "io_lock.h"
+
+/* Default read size. Reads end on multiples of the block size in the file. */
+#define LINE_READER_BLOCK 4096
+
+/*
+* Buffered CSV row reader shared by the compressor, the heartbeat and anything else that scans sensing data.
+* Rows are handed out as (pointer, length) views into the reader's buffer, valid until the next call.
+* The buffer grows as needed, so rows of any length come back whole. A trailing row without its '\n'
+* is still being written: it is never returned and offset stays in front of it.
+* With a limit set the reader sees the file as it was at that size (a sealed snapshot), however much is appended meanwhile.
+*/
+typedef struct {
+    FILE     *f;
+    char     *buf;
+    size_t    cap;
+    size_t    block;
+    size_t    pos;      /* First unconsumed byte in buf. */
+    size_t    len;      /* Bytes held in buf. */
+    size_t    scanned;  /* Bytes from pos already known to hold no '\n'. */
+    uint32_t  offset;   /* File offset of buf[pos]: everything before it has been consumed. */
+    uint32_t  limit;    /* Nothing at or past this file offset is read (UINT32_MAX: no limit). */
+    const io_lock_t *lock;  /* Taken around each block read when set. */
+    esp_err_t err;      /* First read, lock or allocation error, sticky. */
+} line_reader_t;
+
+/*
+* Start reading f at offset. block is the read size (0: LINE_READER_BLOCK).
+*/
+esp_err_t line_reader_init(line_reader_t *r, FILE *f, uint32_t offset, size_t block);
+
+/*
+* Read only up to file offset end (e.g. the size seen when a pass started).
+*/
+void line_reader_set_limit(line_reader_t *r, uint32_t end);
+
+/*
+* Take lock around every block read from now on.
+*/
+void line_reader_set_lock(line_reader_t *r, const io_lock_t *lock);
+
+/*
+* Next row, without its '\n' and trailing '\r'. Returns false when no complete row is left.
+*/
+bool line_reader_next(line_reader_t *r, const char **row, size_t *len);
+
+/*
+* Like line_reader_next() but leaves the row unconsumed.
+*/
+bool line_reader_peek(line_reader_t *r, const char **row, size_t *len);
+
+/*
+* Every complete row currently buffered (at least one, refilling if needed), '\n's included.
+* The cheapest way to feed a codec. Returns false when no complete row is left.
+*/
+bool line_reader_rows(line_reader_t *r, const char **rows, size_t *len);
+
+/*
+* Count the '\n's from the current position to the end of the file, consuming everything (partial row included).
+*/
+size_t line_reader_count(line_reader_t *r);
+
+void line_reader_free(line_reader_t *r);
+
+/* Scanners (word at a time). */
+
+/* Index of the first '\n' in p[0, len), or len if there is none. */
+size_t line_find(const char *p, size_t len);
+
+/* Number of '\n' in p[0, len). */
+size_t line_count(const char *p, size_t len);
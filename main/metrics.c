@@ -0,0 +1,334 @@
+#include "metrics.h"
+#include "global.h"
+#include "trace.h"
+
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *TAG = "metrics";
+
+static const char *const s_counter_names[METRIC_COUNTER_COUNT] = {
+    "comp.passes", "comp.bytes_in", "comp.bytes_out", "comp.errors",
+    "ingest.rows", "ingest.dropped", "ingest.bytes", "ingest.batches",
+    "hb.events", "hb.misses", "ret.raw_bytes", "ret.dropped_bytes",
+    "flash.logical_bytes", "flash.physical_bytes", "flash.writes", "lock.timeouts",
+};
+
+static const char *const s_hist_names[METRIC_HIST_COUNT] = {
+    "comp.pass_us", "comp.ratio_x100", "ingest.batch_bytes", "ingest.write_us", "hb.latency_us",
+};
+
+static const char *const s_site_names[METRIC_SITE_COUNT] = {
+    "compress", "ingest", "heartbeat", "container", "segment", "transfer", "metrics", "trace", "rollup",
+    "retention",
+};
+
+/* Trace span names per site (string literals: the trace ring stores only the pointer). */
+static const char *const s_wait_spans[METRIC_SITE_COUNT] = {
+    "lock.wait compress", "lock.wait ingest", "lock.wait heartbeat", "lock.wait container",
+    "lock.wait segment", "lock.wait transfer", "lock.wait metrics", "lock.wait trace",
+    "lock.wait rollup", "lock.wait retention",
+};
+
+static const char *const s_hold_spans[METRIC_SITE_COUNT] = {
+    "lock.hold compress", "lock.hold ingest", "lock.hold heartbeat", "lock.hold container",
+    "lock.hold segment", "lock.hold transfer", "lock.hold metrics", "lock.hold trace",
+    "lock.hold rollup", "lock.hold retention",
+};
+
+static _Atomic uint32_t s_counters[METRIC_COUNTER_COUNT];
+static metric_histogram_t s_hists[METRIC_HIST_COUNT];
+static metric_histogram_t s_lock_wait[METRIC_SITE_COUNT];
+static metric_histogram_t s_lock_hold[METRIC_SITE_COUNT];
+static metric_task_t s_tasks[METRIC_MAX_TASKS];
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* spi_flash_lock is a mutex: one holder at a time, so one timestamp is enough. */
+static int64_t s_lock_taken_us;
+
+static TaskHandle_t s_task = NULL;
+/* metrics_stop() asks the task to leave; the task clears s_running once it can no longer hold the lock. */
+static _Atomic bool s_stop = false;
+static _Atomic bool s_running = false;
+static char s_path[128];
+static int s_interval_ms = 60000;
+
+static void hist_add(metric_histogram_t *h, uint32_t v) {
+    int b = v ? 32 - __builtin_clz(v) : 0;
+    portENTER_CRITICAL(&s_mux);
+    if (h->count == 0 || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->sum += v;
+    h->buckets[b]++;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+static void hist_copy(metric_histogram_t *out, const metric_histogram_t *h) {
+    portENTER_CRITICAL(&s_mux);
+    *out = *h;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+static uint32_t clamp_u32(int64_t v) {
+    return v < 0 ? 0 : (v > UINT32_MAX ? UINT32_MAX : (uint32_t)v);
+}
+
+void metrics_count(metric_counter_t id, uint32_t n) {
+    if (id < METRIC_COUNTER_COUNT) {
+        atomic_fetch_add_explicit(&s_counters[id], n, memory_order_relaxed);
+    }
+}
+
+void metrics_observe(metric_hist_t id, uint32_t value) {
+    if (id < METRIC_HIST_COUNT) {
+        hist_add(&s_hists[id], value);
+    }
+}
+
+uint32_t metrics_get_counter(metric_counter_t id) {
+    return id < METRIC_COUNTER_COUNT ? atomic_load_explicit(&s_counters[id], memory_order_relaxed) : 0;
+}
+
+void metrics_get_hist(metric_hist_t id, metric_histogram_t *out) {
+    if (out && id < METRIC_HIST_COUNT) {
+        hist_copy(out, &s_hists[id]);
+    }
+}
+
+void metrics_get_lock(metric_site_t site, metric_histogram_t *wait_us, metric_histogram_t *hold_us) {
+    if (site >= METRIC_SITE_COUNT) {
+        return;
+    }
+    if (wait_us) {
+        hist_copy(wait_us, &s_lock_wait[site]);
+    }
+    if (hold_us) {
+        hist_copy(hold_us, &s_lock_hold[site]);
+    }
+}
+
+uint32_t metrics_percentile(const metric_histogram_t *h, int pct) {
+    if (!h || h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)h->count * (uint64_t)pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t upper = b == 0 ? 0 : ((uint64_t)1 << b) - 1;
+            return upper < h->max ? (uint32_t)upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+bool metrics_lock_take(metric_site_t site, TickType_t ticks) {
+    if (site >= METRIC_SITE_COUNT) {
+        site = METRIC_SITE_METRICS;
+    }
+    TRACE_BEGIN(s_wait_spans[site], 0);
+    int64_t t0 = esp_timer_get_time();
+    bool ok = spi_flash_lock && xSemaphoreTake(spi_flash_lock, ticks) == pdTRUE;
+    TRACE_END(s_wait_spans[site]);
+    if (!ok) {
+        metrics_count(METRIC_LOCK_TIMEOUTS, 1);
+        return false;
+    }
+    s_lock_taken_us = esp_timer_get_time();
+    hist_add(&s_lock_wait[site], clamp_u32(s_lock_taken_us - t0));
+    TRACE_BEGIN(s_hold_spans[site], 0);
+    return true;
+}
+
+void metrics_lock_give(metric_site_t site) {
+    if (site >= METRIC_SITE_COUNT) {
+        site = METRIC_SITE_METRICS;
+    }
+    hist_add(&s_lock_hold[site], clamp_u32(esp_timer_get_time() - s_lock_taken_us));
+    TRACE_END(s_hold_spans[site]);
+    xSemaphoreGive(spi_flash_lock);
+}
+
+void metrics_register_task(TaskHandle_t task, const char *name, uint32_t stack_size) {
+    bool added = false;
+    portENTER_CRITICAL(&s_mux);
+    /* The task's own entry if it has one, else the first free slot. */
+    int slot = -1;
+    for (int i = 0; i < METRIC_MAX_TASKS; i++) {
+        if (s_tasks[i].task == task) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 && !s_tasks[i].task) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        s_tasks[slot].task = task;
+        strncpy(s_tasks[slot].name, name, sizeof(s_tasks[slot].name) - 1);
+        s_tasks[slot].stack_size = stack_size;
+        added = true;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    if (!added) {
+        ESP_LOGW(TAG, "Task table full (%d): %s has no stack figures", METRIC_MAX_TASKS, name);
+    }
+}
+
+void metrics_unregister_task(TaskHandle_t task) {
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < METRIC_MAX_TASKS; i++) {
+        if (s_tasks[i].task == task) {
+            s_tasks[i].task = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&s_mux);
+}
+
+bool metrics_task_name(TaskHandle_t task, char *buf, size_t len) {
+    bool found = false;
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < METRIC_MAX_TASKS && !found; i++) {
+        if (task && s_tasks[i].task == task) {
+            snprintf(buf, len, "%s", s_tasks[i].name);
+            found = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_mux);
+    return found;
+}
+
+static void hist_write(FILE *f, const char *name, const char *suffix, const metric_histogram_t *h) {
+    fprintf(f, "%s%s count=%u min=%u p50=%u p90=%u p99=%u max=%u mean=%u\n", name, suffix,
+            (unsigned)h->count, (unsigned)h->min, (unsigned)metrics_percentile(h, 50), (unsigned)metrics_percentile(h, 90),
+            (unsigned)metrics_percentile(h, 99), (unsigned)h->max, h->count ? (unsigned)(h->sum / h->count) : 0u);
+}
+
+void metrics_write(FILE *f) {
+    fprintf(f, "uptime_ms %lld\n", (long long)(esp_timer_get_time() / 1000));
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        fprintf(f, "%s %u\n", s_counter_names[i], (unsigned)metrics_get_counter((metric_counter_t)i));
+    }
+    metric_histogram_t h;
+    for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+        metrics_get_hist((metric_hist_t)i, &h);
+        hist_write(f, s_hist_names[i], "", &h);
+    }
+    for (int i = 0; i < METRIC_SITE_COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "lock.%s", s_site_names[i]);
+        hist_copy(&h, &s_lock_wait[i]);
+        hist_write(f, name, ".wait_us", &h);
+        hist_copy(&h, &s_lock_hold[i]);
+        hist_write(f, name, ".hold_us", &h);
+    }
+
+    fprintf(f, "heap.free %u\nheap.min_free %u\nheap.largest %u\n", (unsigned)esp_get_free_heap_size(),
+            (unsigned)esp_get_minimum_free_heap_size(), (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    for (int i = 0; i < METRIC_MAX_TASKS; i++) {
+        metric_task_t t;
+        portENTER_CRITICAL(&s_mux);
+        t = s_tasks[i];
+        portEXIT_CRITICAL(&s_mux);
+        if (t.task) {
+            /* Bytes on ESP-IDF, where StackType_t is a byte. */
+            uint32_t free_min = (uint32_t)uxTaskGetStackHighWaterMark(t.task);
+            fprintf(f, "task.%s stack=%u min_free=%u\n", t.name, (unsigned)t.stack_size, (unsigned)free_min);
+        }
+    }
+}
+
+void metrics_reset(void) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        atomic_store(&s_counters[i], 0);
+    }
+    portENTER_CRITICAL(&s_mux);
+    memset(s_hists, 0, sizeof(s_hists));
+    memset(s_lock_wait, 0, sizeof(s_lock_wait));
+    memset(s_lock_hold, 0, sizeof(s_lock_hold));
+    portEXIT_CRITICAL(&s_mux);
+}
+
+/* Write temp, fsync, then swap in. SPIFFS rename does not replace an existing file. */
+static void snapshot(void) {
+    char tmp[136];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s_path);
+    if (!metrics_lock_take(METRIC_SITE_METRICS, pdMS_TO_TICKS(2000))) {
+        ESP_LOGW(TAG, "Lock timeout, snapshot skipped");
+        return;
+    }
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        metrics_write(f);
+        fflush(f);
+        fsync(fileno(f));
+        fclose(f);
+        remove(s_path);
+        rename(tmp, s_path);
+    } else {
+        ESP_LOGE(TAG, "fopen(%s) failed", tmp);
+    }
+    metrics_lock_give(METRIC_SITE_METRICS);
+}
+
+/* Metrics Task. */
+static void metrics_task(void *arg) {
+    (void)arg;
+    metrics_register_task(xTaskGetCurrentTaskHandle(), "metrics", 3072);
+    while (!atomic_load(&s_stop)) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(s_interval_ms));
+        if (!atomic_load(&s_stop)) {
+            snapshot();
+        }
+    }
+    /* Outside snapshot(): a task deleted while holding spi_flash_lock would never give it back. */
+    metrics_unregister_task(xTaskGetCurrentTaskHandle());
+    atomic_store(&s_running, false);
+    vTaskDelete(NULL);
+}
+
+esp_err_t metrics_start(const char *path, int interval_ms) {
+    if (!path || interval_ms <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_task) {
+        return ESP_OK;
+    }
+    strncpy(s_path, path, sizeof(s_path) - 1);
+    s_interval_ms = interval_ms;
+    atomic_store(&s_stop, false);
+    atomic_store(&s_running, true);
+    if (xTaskCreate(metrics_task, "metrics_task", 3072, NULL, 3, &s_task) != pdPASS) {
+        s_task = NULL;
+        atomic_store(&s_running, false);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void metrics_stop(void) {
+    if (!s_task) {
+        return;
+    }
+    atomic_store(&s_stop, true);
+    xTaskNotifyGive(s_task);
+    /* A snapshot in progress finishes and gives the lock back before the task deletes itself. */
+    while (atomic_load(&s_running)) {
+        vTaskDelay(1);
+    }
+    s_task = NULL;
+}
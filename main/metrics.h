@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/*
+* Runtime Metrics.
+* Fixed sets of counters and histograms, updated from any task without allocation, readable through the
+* functions below and written as text to a small SPIFFS file every interval by metrics_start().
+*/
+typedef enum {
+    METRIC_COMP_PASSES,
+    METRIC_COMP_BYTES_IN,
+    METRIC_COMP_BYTES_OUT,
+    METRIC_COMP_ERRORS,
+    METRIC_INGEST_ROWS,
+    METRIC_INGEST_DROPPED,
+    METRIC_INGEST_BYTES,
+    METRIC_INGEST_BATCHES,
+    METRIC_HEARTBEAT_EVENTS,
+    METRIC_HEARTBEAT_MISSES,  /* Expected write periods that passed without data. */
+    METRIC_RETENTION_RAW_BYTES,      /* Raw bytes dropped once compressed. */
+    METRIC_RETENTION_DROPPED_BYTES,  /* Compressed bytes dropped to stay under the flash quota. */
+    METRIC_FLASH_LOGICAL_BYTES,      /* Bytes written to SPIFFS (see page_write.h). */
+    METRIC_FLASH_PHYSICAL_BYTES,     /* Estimated bytes programmed for them. */
+    METRIC_FLASH_WRITES,
+    METRIC_LOCK_TIMEOUTS,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_COMP_PASS_US,
+    METRIC_COMP_RATIO_X100,        /* Input / output bytes of a pass, times 100. */
+    METRIC_INGEST_BATCH_BYTES,
+    METRIC_INGEST_WRITE_US,        /* One batch: write + fsync. */
+    METRIC_HEARTBEAT_LATENCY_US,   /* Batch on flash -> heartbeat task awake. */
+    METRIC_HIST_COUNT
+} metric_hist_t;
+
+/* spi_flash_lock call sites, each with its own wait and hold histograms. */
+typedef enum {
+    METRIC_SITE_COMPRESS,
+    METRIC_SITE_INGEST,
+    METRIC_SITE_HEARTBEAT,
+    METRIC_SITE_CONTAINER,
+    METRIC_SITE_SEGMENT,
+    METRIC_SITE_TRANSFER,
+    METRIC_SITE_METRICS,
+    METRIC_SITE_TRACE,
+    METRIC_SITE_ROLLUP,
+    METRIC_SITE_RETENTION,
+    METRIC_SITE_COUNT
+} metric_site_t;
+
+/* Log2 buckets: bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeros. */
+#define METRIC_BUCKETS 33
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[METRIC_BUCKETS];
+} metric_histogram_t;
+
+typedef struct {
+    char         name[16];
+    TaskHandle_t task;
+    uint32_t     stack_size;
+} metric_task_t;
+
+/* The firmware's own tasks (compression, ingest, heartbeat, test writer, metrics, pipeline workers) and encoders. */
+#define METRIC_MAX_TASKS 12
+
+void metrics_count(metric_counter_t id, uint32_t n);
+void metrics_observe(metric_hist_t id, uint32_t value);
+
+uint32_t metrics_get_counter(metric_counter_t id);
+void metrics_get_hist(metric_hist_t id, metric_histogram_t *out);
+void metrics_get_lock(metric_site_t site, metric_histogram_t *wait_us, metric_histogram_t *hold_us);
+
+/*
+* Approximate percentile (0-100) of a histogram: the upper bound of the bucket it falls in, capped at max.
+*/
+uint32_t metrics_percentile(const metric_histogram_t *h, int pct);
+
+/*
+* spi_flash_lock with accounting: the wait and the hold are recorded against site.
+*/
+bool metrics_lock_take(metric_site_t site, TickType_t ticks);
+void metrics_lock_give(metric_site_t site);
+
+/*
+* Track a task's stack high-water mark. stack_size is what was passed to xTaskCreate.
+* Tasks register themselves when they start and unregister before they are deleted.
+*/
+void metrics_register_task(TaskHandle_t task, const char *name, uint32_t stack_size);
+void metrics_unregister_task(TaskHandle_t task);
+
+/* Name a task was registered under. False if it isn't registered. */
+bool metrics_task_name(TaskHandle_t task, char *buf, size_t len);
+
+/*
+* Write every metric as text, one line each ("name count=.. min=.. p50=.. p99=.. max=.." for histograms).
+*/
+void metrics_write(FILE *f);
+
+void metrics_reset(void);
+
+/*
+* Snapshot the metrics to path (replaced each time, written via a temp file) every interval_ms.
+*/
+esp_err_t metrics_start(const char *path, int interval_ms);
+
+void metrics_stop(void);
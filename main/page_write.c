@@ -0,0 +1,18 @@
+#include "page_write.h"
+#include "metrics.h"
+
+size_t page_write(FILE *f, const void *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    long pos = ftell(f);
+    size_t w = fwrite(data, 1, len, f);
+    if (w > 0 && pos >= 0) {
+        uint32_t first = (uint32_t)pos / PAGE_WRITE_SIZE;
+        uint32_t last = ((uint32_t)pos + (uint32_t)w - 1) / PAGE_WRITE_SIZE;
+        metrics_count(METRIC_FLASH_LOGICAL_BYTES, (uint32_t)w);
+        metrics_count(METRIC_FLASH_PHYSICAL_BYTES, (last - first + 2) * PAGE_WRITE_SIZE);
+        metrics_count(METRIC_FLASH_WRITES, 1);
+    }
+    return w;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* SPIFFS logical page (CONFIG_SPIFFS_PAGE_SIZE). */
+#define PAGE_WRITE_SIZE 256
+
+/*
+* Page-Aligned Flash Writes.
+* SPIFFS programs a file one logical page at a time, and each write also rewrites the object index page that holds
+* the file size. A write ending mid-page leaves a page the next write touches again, so many small writes program
+* far more flash than they carry. Writers coalesce into whole-page buffers and hand them over on page boundaries
+* (codec_sink_t does, for codec output), and every write to SPIFFS goes through page_write() to be counted:
+*   METRIC_FLASH_LOGICAL_BYTES   bytes asked to be written.
+*   METRIC_FLASH_PHYSICAL_BYTES  estimate of the bytes programmed: each page the write touches, plus the index page.
+*   METRIC_FLASH_WRITES          writes.
+* physical / logical is the write amplification of a workload (metrics_reset() when it starts).
+* Streams written this way should be unbuffered (setvbuf(f, NULL, _IONBF, 0)), so that each call is one VFS write
+* and lands where it was aligned; files opened for appending should be seeked to their end first, for ftell().
+*/
+
+/* fwrite() len bytes at the current position of f, counted. Returns the bytes written. */
+size_t page_write(FILE *f, const void *data, size_t len);
+
+/* Longest prefix of len bytes written at offset pos that ends on a page boundary; 0 if they do not reach one. */
+static inline size_t page_write_aligned(uint32_t pos, size_t len) {
+    uint32_t end = (uint32_t)(pos + len) & ~(uint32_t)(PAGE_WRITE_SIZE - 1);
+    return end > pos ? end - pos : 0;
+}
@@ -0,0 +1,249 @@
+#include "pipeline.h"
+#include "heartbeat.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "pipeline";
+
+/* Deadline of a job that is not scheduled. */
+#define PIPELINE_NEVER INT64_MAX
+
+typedef enum {
+    PIPELINE_JOB_HEARTBEAT,
+    PIPELINE_JOB_COMPRESS,
+    PIPELINE_JOB_COUNT
+} pipeline_job_kind_t;
+
+typedef struct {
+    int64_t due_us;      /* esp_timer time the job should run at. */
+    int     period_ms;   /* Next deadline after a run: completion + period. */
+    bool    running;
+    bool    kicked;      /* Moved to "now" while running: run again right away. */
+} pipeline_job_t;
+
+struct pipeline {
+    compression_stream_t *comp;
+    heartbeat_t           hb;
+    pipeline_job_t        jobs[PIPELINE_JOB_COUNT];
+    bool                  closing;
+};
+
+static pipeline_t *s_pipes[PIPELINE_MAX];
+static TaskHandle_t s_workers[PIPELINE_WORKERS];
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void wake_workers(void) {
+    for (int i = 0; i < PIPELINE_WORKERS; i++) {
+        if (s_workers[i]) {
+            xTaskNotifyGive(s_workers[i]);
+        }
+    }
+}
+
+static void run_job(pipeline_t *p, pipeline_job_kind_t kind) {
+    if (kind == PIPELINE_JOB_HEARTBEAT) {
+        TRACE_BEGIN("pipeline.heartbeat", 0);
+        heartbeat_check(&p->hb);
+        TRACE_END("pipeline.heartbeat");
+    } else {
+        TRACE_BEGIN("pipeline.compress", 0);
+        compression_stream_pass(p->comp);
+        TRACE_END("pipeline.compress");
+    }
+}
+
+/*
+* Worker Task.
+* Earliest deadline first over every job of every pipeline. The table is small (PIPELINE_MAX x 2 jobs),
+* so a scan under the lock is cheaper than keeping a heap in order.
+*/
+static void worker_task(void *arg) {
+    char name[16];
+    snprintf(name, sizeof(name), "pipeline%d", (int)(intptr_t)arg);
+    metrics_register_task(xTaskGetCurrentTaskHandle(), name, PIPELINE_WORKER_STACK);
+    for (;;) {
+        pipeline_t *pick = NULL;
+        int kind = 0;
+        int64_t next = PIPELINE_NEVER;
+        int64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&s_mux);
+        for (int i = 0; i < PIPELINE_MAX; i++) {
+            pipeline_t *p = s_pipes[i];
+            if (!p || p->closing) {
+                continue;
+            }
+            for (int k = 0; k < PIPELINE_JOB_COUNT; k++) {
+                if (!p->jobs[k].running && p->jobs[k].due_us < next) {
+                    next = p->jobs[k].due_us;
+                    pick = p;
+                    kind = k;
+                }
+            }
+        }
+        if (pick && next <= now) {
+            pick->jobs[kind].running = true;
+        } else {
+            pick = NULL;
+        }
+        portEXIT_CRITICAL(&s_mux);
+
+        if (!pick) {
+            TickType_t wait = portMAX_DELAY;
+            if (next != PIPELINE_NEVER) {
+                int64_t ms = (next - now + 999) / 1000;
+                wait = pdMS_TO_TICKS(ms < 60000 ? ms : 60000);
+                wait = wait ? wait : 1;
+            }
+            ulTaskNotifyTake(pdTRUE, wait);
+            continue;
+        }
+
+        run_job(pick, (pipeline_job_kind_t)kind);
+
+        portENTER_CRITICAL(&s_mux);
+        pipeline_job_t *job = &pick->jobs[kind];
+        job->running = false;
+        job->due_us = job->kicked ? esp_timer_get_time() : esp_timer_get_time() + (int64_t)job->period_ms * 1000;
+        job->kicked = false;
+        portEXIT_CRITICAL(&s_mux);
+    }
+}
+
+static esp_err_t start_workers(void) {
+    for (int i = 0; i < PIPELINE_WORKERS; i++) {
+        if (s_workers[i]) {
+            continue;
+        }
+        if (xTaskCreate(worker_task, "pipeline_worker", PIPELINE_WORKER_STACK, (void *)(intptr_t)i, 4, &s_workers[i]) != pdPASS) {
+            s_workers[i] = NULL;
+            ESP_LOGE(TAG, "Could not start worker %d", i);
+            return i > 0 ? ESP_OK : ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t pipeline_create(const pipeline_config_t *cfg, pipeline_t **out) {
+    if (!cfg || !cfg->input_csv || !out) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool compress = cfg->output_path && cfg->compress_interval_ms > 0;
+    bool heartbeat = cfg->heartbeat_pin != GPIO_NUM_NC && cfg->heartbeat_period_ms > 0;
+    pipeline_t *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int k = 0; k < PIPELINE_JOB_COUNT; k++) {
+        p->jobs[k].due_us = PIPELINE_NEVER;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (compress) {
+        err = compression_stream_create(cfg->input_csv, cfg->output_path, cfg->algo, &p->comp);
+        p->jobs[PIPELINE_JOB_COMPRESS].period_ms = cfg->compress_interval_ms;
+        p->jobs[PIPELINE_JOB_COMPRESS].due_us = esp_timer_get_time() + (int64_t)cfg->compress_interval_ms * 1000;
+    }
+    if (err == ESP_OK && heartbeat) {
+        err = heartbeat_init(&p->hb, cfg->input_csv, cfg->heartbeat_pin, cfg->heartbeat_period_ms);
+        p->jobs[PIPELINE_JOB_HEARTBEAT].period_ms = cfg->heartbeat_period_ms;
+        p->jobs[PIPELINE_JOB_HEARTBEAT].due_us = esp_timer_get_time();  /* First run counts the existing rows. */
+    }
+    if (err == ESP_OK) {
+        err = start_workers();
+    }
+
+    int slot = -1;
+    if (err == ESP_OK) {
+        portENTER_CRITICAL(&s_mux);
+        for (int i = 0; i < PIPELINE_MAX && slot < 0; i++) {
+            if (!s_pipes[i]) {
+                s_pipes[i] = p;
+                slot = i;
+            }
+        }
+        portEXIT_CRITICAL(&s_mux);
+        if (slot < 0) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err != ESP_OK) {
+        heartbeat_deinit(&p->hb);
+        compression_stream_destroy(p->comp);
+        free(p);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Pipeline %d: %s (compress %s every %d ms, heartbeat pin %d every %d ms)", slot, cfg->input_csv,
+             compress ? cfg->output_path : "off", cfg->compress_interval_ms, heartbeat ? (int)cfg->heartbeat_pin : -1,
+             cfg->heartbeat_period_ms);
+    *out = p;
+    wake_workers();
+    return ESP_OK;
+}
+
+void pipeline_rows_written(pipeline_t *p, uint32_t rows) {
+    if (!p || p->hb.period_ms <= 0) {
+        return;
+    }
+    heartbeat_report(&p->hb, rows);
+    portENTER_CRITICAL(&s_mux);
+    pipeline_job_t *job = &p->jobs[PIPELINE_JOB_HEARTBEAT];
+    if (job->running) {
+        job->kicked = true;
+    } else {
+        job->due_us = 0;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    wake_workers();
+}
+
+void pipeline_get_stats(const pipeline_t *p, compression_stats_t *out) {
+    if (p && out) {
+        if (p->comp) {
+            compression_stream_get_stats(p->comp, out);
+        } else {
+            memset(out, 0, sizeof(*out));
+        }
+    }
+}
+
+void pipeline_destroy(pipeline_t *p) {
+    if (!p) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    p->closing = true;
+    portEXIT_CRITICAL(&s_mux);
+    for (;;) {
+        bool busy = false;
+        portENTER_CRITICAL(&s_mux);
+        for (int k = 0; k < PIPELINE_JOB_COUNT; k++) {
+            busy = busy || p->jobs[k].running;
+        }
+        if (!busy) {
+            for (int i = 0; i < PIPELINE_MAX; i++) {
+                if (s_pipes[i] == p) {
+                    s_pipes[i] = NULL;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&s_mux);
+        if (!busy) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    heartbeat_deinit(&p->hb);
+    compression_stream_destroy(p->comp);
+    free(p);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "compression.h"
+
+/*
+* Sensor Pipelines.
+* One pipeline per sensor CSV: periodic incremental compression with its own codec and interval, and a heartbeat
+* pin with its own write period. All pipelines share PIPELINE_WORKERS worker tasks, started with the first
+* pipeline. Each pipeline contributes two jobs (compress, heartbeat) with a deadline; an idle worker runs the job
+* whose deadline is earliest and sleeps until the next one is due or a writer reports rows.
+* With two workers a heartbeat never waits behind one long compression pass.
+*/
+#define PIPELINE_MAX           8
+#define PIPELINE_WORKERS       2
+#define PIPELINE_WORKER_STACK  4096
+
+typedef struct {
+    const char *input_csv;            /* CSV the sensor's writer appends to. */
+    const char *output_path;          /* Compressed container; NULL for no compression. */
+    const char *algo;                 /* NULL: the compression_set_algorithm() default. */
+    int         compress_interval_ms;
+    gpio_num_t  heartbeat_pin;        /* GPIO_NUM_NC for no heartbeat. */
+    int         heartbeat_period_ms;  /* Expected write frequency. */
+} pipeline_config_t;
+
+typedef struct pipeline pipeline_t;
+
+/*
+* Create a pipeline and schedule its jobs. The strings in cfg are copied.
+* ESP_ERR_NO_MEM when PIPELINE_MAX pipelines exist.
+*/
+esp_err_t pipeline_create(const pipeline_config_t *cfg, pipeline_t **out);
+
+/*
+* The pipeline's writer put rows on flash: pulse now instead of at the next file check. Any task.
+*/
+void pipeline_rows_written(pipeline_t *p, uint32_t rows);
+
+/*
+* Statistics of the pipeline's most recent compression pass.
+*/
+void pipeline_get_stats(const pipeline_t *p, compression_stats_t *out);
+
+/*
+* Unschedule the pipeline, wait for a job of it that is running, and free it. Its files stay.
+*/
+void pipeline_destroy(pipeline_t *p);
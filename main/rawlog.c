@@ -0,0 +1,303 @@
+#include "rawlog.h"
+#include "trace.h"
+
+#include "esp_log.h"
+
+#include <stddef.h>
+#include <string.h>
+
+static const char *TAG = "rawlog";
+
+/* Sector Header Identifier. */
+#define RAWLOG_MAGIC 0x474F4C52u /* "RLOG" */
+
+/* Marks an unwritten record slot (erased flash reads as 0xFF). */
+#define RAWLOG_ERASED_LEN 0xFFFFu
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t slot_size;
+    uint32_t checksum;
+} rawlog_sector_t;
+
+typedef struct {
+    uint16_t len;
+    uint16_t check;
+} rawlog_record_t;
+
+/* FNV-1a. */
+static uint32_t fnv1a(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint16_t record_check(const void *data, size_t len) {
+    uint32_t h = fnv1a(data, len);
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+/*
+* Sectors are filled in sequence order, so sequence s always lives in physical sector s % sectors.
+* A log recovered from flash keeps that mapping because its sequence numbers were assigned the same way.
+*/
+static uint32_t sector_of(const rawlog_t *log, uint32_t seq) {
+    return seq % log->sectors;
+}
+
+static size_t slot_offset(const rawlog_t *log, uint32_t sector, uint32_t slot) {
+    return (size_t)sector * log->sector_size + (size_t)(slot + 1) * log->slot_size;
+}
+
+static bool sector_header(const rawlog_t *log, uint32_t sector, rawlog_sector_t *h) {
+    memcpy(h, log->map + (size_t)sector * log->sector_size, sizeof(*h));
+    return h->magic == RAWLOG_MAGIC && h->checksum == fnv1a(h, offsetof(rawlog_sector_t, checksum));
+}
+
+static const rawlog_record_t *record_at(const rawlog_t *log, uint32_t sector, uint32_t slot) {
+    return (const rawlog_record_t *)(log->map + slot_offset(log, sector, slot));
+}
+
+/* Erase the sector for seq and write its header. Readers stop seeing the records it held first. */
+static esp_err_t sector_prepare(rawlog_t *log, uint32_t seq) {
+    uint32_t sector = sector_of(log, seq);
+    if (seq >= log->sectors) {
+        uint32_t oldest = (seq - log->sectors + 1) * log->slots;
+        if (rawlog_first(log) < oldest) {
+            atomic_store_explicit(&log->first, oldest, memory_order_release);
+        }
+    }
+    TRACE_BEGIN("rawlog.erase", sector);
+    esp_err_t err = esp_partition_erase_range(log->part, (size_t)sector * log->sector_size, log->sector_size);
+    TRACE_END("rawlog.erase");
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Erase of sector %u failed: %s", (unsigned)sector, esp_err_to_name(err));
+        return err;
+    }
+    rawlog_sector_t h = { .magic = RAWLOG_MAGIC, .seq = seq, .slot_size = log->slot_size };
+    h.checksum = fnv1a(&h, offsetof(rawlog_sector_t, checksum));
+    err = esp_partition_write(log->part, (size_t)sector * log->sector_size, &h, sizeof(h));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Header write to sector %u failed: %s", (unsigned)sector, esp_err_to_name(err));
+        return err;
+    }
+    log->head_sector = sector;
+    return ESP_OK;
+}
+
+/*
+* First unused slot of a sector. Slots fill in order, and a failed append zeroes its header instead of leaving it
+* erased, so the used ones are a prefix.
+*/
+static uint32_t find_free_slot(const rawlog_t *log, uint32_t sector) {
+    uint32_t lo = 0;
+    uint32_t hi = log->slots;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (record_at(log, sector, mid)->len == RAWLOG_ERASED_LEN) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (lo < log->slots) {
+        /* A reset between the payload and its header leaves programmed bytes behind: skip that slot. */
+        const uint8_t *p = (const uint8_t *)record_at(log, sector, lo);
+        for (uint32_t i = RAWLOG_RECORD_HDR; i < log->slot_size; i++) {
+            if (p[i] != 0xFF) {
+                return lo + 1;
+            }
+        }
+    }
+    return lo;
+}
+
+static void set_geometry(rawlog_t *log, uint32_t slot_size) {
+    log->slot_size = slot_size;
+    log->slots = log->sector_size / slot_size - 1;
+}
+
+esp_err_t rawlog_format(rawlog_t *log) {
+    if (!log || !log->part) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = esp_partition_erase_range(log->part, 0, (size_t)log->sectors * log->sector_size);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Erase of %s failed: %s", log->part->label, esp_err_to_name(err));
+        return err;
+    }
+    atomic_store(&log->first, 0);
+    atomic_store(&log->end, 0);
+    return sector_prepare(log, 0);
+}
+
+/* Rebuild first/end from the sector headers. False if the partition holds no log. */
+static bool recover(rawlog_t *log, uint32_t want_slot, esp_err_t *err) {
+    bool found = false;
+    rawlog_sector_t head = { 0 };
+    uint32_t head_sector = 0;
+    for (uint32_t s = 0; s < log->sectors; s++) {
+        rawlog_sector_t h;
+        if (sector_header(log, s, &h) && sector_of(log, h.seq) == s && (!found || h.seq > head.seq)) {
+            head = h;
+            head_sector = s;
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    if (want_slot && want_slot != head.slot_size) {
+        ESP_LOGE(TAG, "%s holds %u byte slots, not %u", log->part->label, (unsigned)head.slot_size, (unsigned)want_slot);
+        *err = ESP_ERR_INVALID_SIZE;
+        return true;
+    }
+    set_geometry(log, head.slot_size);
+
+    /* Walk back from the head while each older sector still carries the sequence number it should. */
+    uint32_t first_seq = head.seq;
+    while (first_seq > 0 && head.seq - (first_seq - 1) < log->sectors) {
+        rawlog_sector_t h;
+        if (!sector_header(log, sector_of(log, first_seq - 1), &h) || h.seq != first_seq - 1 || h.slot_size != head.slot_size) {
+            break;
+        }
+        first_seq--;
+    }
+
+    uint32_t slot = find_free_slot(log, head_sector);
+    log->head_sector = head_sector;
+    atomic_store(&log->first, first_seq * log->slots);
+    atomic_store(&log->end, head.seq * log->slots + slot);
+    *err = slot == log->slots ? sector_prepare(log, head.seq + 1) : ESP_OK;
+    return true;
+}
+
+esp_err_t rawlog_open(rawlog_t *log, const char *label, uint32_t slot_size) {
+    if (!log) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(log, 0, sizeof(*log));
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                           label ? label : RAWLOG_DEFAULT_LABEL);
+    if (!part) {
+        ESP_LOGE(TAG, "No data partition \"%s\"", label ? label : RAWLOG_DEFAULT_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint32_t sector_size = part->erase_size ? part->erase_size : 4096;
+    if (slot_size && (slot_size < 64 || slot_size > sector_size / 2 || (slot_size & (slot_size - 1)))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (part->size / sector_size < 2) {
+        ESP_LOGE(TAG, "%s is too small for a log", part->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const void *map = NULL;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &map, &log->map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "mmap of %s failed: %s", part->label, esp_err_to_name(err));
+        return err;
+    }
+    log->part = part;
+    log->map = (const uint8_t *)map;
+    log->sector_size = sector_size;
+    log->sectors = part->size / sector_size;
+
+    if (!recover(log, slot_size, &err)) {
+        ESP_LOGI(TAG, "Formatting %s", part->label);
+        set_geometry(log, slot_size ? slot_size : RAWLOG_DEFAULT_SLOT);
+        err = rawlog_format(log);
+    }
+    if (err != ESP_OK) {
+        rawlog_close(log);
+        return err;
+    }
+    ESP_LOGI(TAG, "%s: %u sectors of %u x %u byte slots, records [%u, %u)", part->label, (unsigned)log->sectors,
+             (unsigned)log->slots, (unsigned)log->slot_size, (unsigned)rawlog_first(log), (unsigned)rawlog_end(log));
+    return ESP_OK;
+}
+
+void rawlog_close(rawlog_t *log) {
+    if (log && log->map) {
+        esp_partition_munmap(log->map_handle);
+        log->map = NULL;
+        log->part = NULL;
+    }
+}
+
+esp_err_t rawlog_append(rawlog_t *log, const void *data, size_t len, uint32_t *id) {
+    if (!log || !log->map) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!data || len == 0 || len > rawlog_max_record(log)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t end = rawlog_end(log);
+    uint32_t slot = end % log->slots;
+    if (slot == 0) {
+        /* The previous append may have failed to prepare this sector; never program over the full one before it. */
+        uint32_t seq = end / log->slots;
+        rawlog_sector_t h;
+        if (log->head_sector != sector_of(log, seq) || !sector_header(log, log->head_sector, &h) || h.seq != seq) {
+            esp_err_t err = sector_prepare(log, seq);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    size_t off = slot_offset(log, log->head_sector, slot);
+
+    TRACE_BEGIN("rawlog.append", len);
+    /* Payload first, header last: a record is only visible once all of it is on flash. */
+    esp_err_t err = esp_partition_write(log->part, off + RAWLOG_RECORD_HDR, data, len);
+    if (err == ESP_OK) {
+        rawlog_record_t r = { .len = (uint16_t)len, .check = record_check(data, len) };
+        err = esp_partition_write(log->part, off, &r, sizeof(r));
+    }
+    TRACE_END("rawlog.append");
+    if (err != ESP_OK) {
+        /*
+        * The slot may be half programmed with its header still erased. Zero the header (bits only clear, so this
+        * lands over anything) so it reads back as torn and find_free_slot() never takes it for the free prefix end.
+        */
+        ESP_LOGE(TAG, "Write of record %u failed: %s", (unsigned)end, esp_err_to_name(err));
+        rawlog_record_t dead = { 0 };
+        if (esp_partition_write(log->part, off, &dead, sizeof(dead)) != ESP_OK) {
+            ESP_LOGE(TAG, "Record %u could not be marked torn", (unsigned)end);
+        }
+    }
+    atomic_store_explicit(&log->end, end + 1, memory_order_release);
+    if (slot + 1 == log->slots) {
+        esp_err_t perr = sector_prepare(log, (end + 1) / log->slots);
+        if (err == ESP_OK) {
+            err = perr;
+        }
+    }
+    if (err == ESP_OK && id) {
+        *id = end;
+    }
+    return err;
+}
+
+esp_err_t rawlog_read(const rawlog_t *log, uint32_t id, const void **data, size_t *len) {
+    if (!log || !log->map || !data || !len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (id < rawlog_first(log) || id >= rawlog_end(log)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const rawlog_record_t *r = record_at(log, sector_of(log, id / log->slots), id % log->slots);
+    rawlog_record_t h;
+    memcpy(&h, r, sizeof(h));
+    const uint8_t *payload = (const uint8_t *)r + RAWLOG_RECORD_HDR;
+    if (h.len == 0 || h.len > rawlog_max_record(log) || h.check != record_check(payload, h.len)) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    *data = payload;
+    *len = h.len;
+    return ESP_OK;
+}
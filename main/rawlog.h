@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+
+/*
+* Raw Partition Log.
+* An append-only record log written straight to a data partition with esp_partition_write, bypassing SPIFFS.
+* Each erase sector holds a header in its first slot followed by fixed-size record slots:
+*   slot 0       sector header: magic, sector sequence number, slot size
+*   slot 1..n    record: 2-byte length, 2-byte check, payload
+* Sectors are used in a ring; when the log is full the oldest sector is erased. Record ids count up forever,
+* so id -> flash address is arithmetic and a read is one pointer into the memory-mapped partition.
+* The write head is recovered on open from the sector headers and a binary search of the newest sector.
+* One task may append; any task may read.
+*/
+#define RAWLOG_DEFAULT_LABEL "datalog"
+
+/* Flash pages are 256 bytes: the default slot is written with one page program. */
+#define RAWLOG_DEFAULT_SLOT 256
+
+/* Bytes of each slot taken by the record header. */
+#define RAWLOG_RECORD_HDR 4
+
+typedef struct {
+    const esp_partition_t *part;
+    const uint8_t *map;              /* Whole partition, read-only (mapped through the flash cache). */
+    esp_partition_mmap_handle_t map_handle;
+    uint32_t sector_size;
+    uint32_t sectors;
+    uint32_t slot_size;
+    uint32_t slots;                  /* Record slots per sector. */
+    uint32_t head_sector;            /* Physical sector being filled. */
+    _Atomic uint32_t first;          /* Oldest record id still on flash. */
+    _Atomic uint32_t end;            /* Id the next append gets. */
+} rawlog_t;
+
+/*
+* Map the partition with this label (NULL: RAWLOG_DEFAULT_LABEL) and find the write head, formatting it if it
+* holds no log. slot_size is a power of two from 64 to half a sector, or 0 to keep the size on flash
+* (RAWLOG_DEFAULT_SLOT for a new log). ESP_ERR_INVALID_SIZE if the flash holds a log with another slot size.
+*/
+esp_err_t rawlog_open(rawlog_t *log, const char *label, uint32_t slot_size);
+
+void rawlog_close(rawlog_t *log);
+
+/* Largest payload of one record. */
+static inline size_t rawlog_max_record(const rawlog_t *log) {
+    return log->slot_size - RAWLOG_RECORD_HDR;
+}
+
+/*
+* Append one record of 1..rawlog_max_record() bytes. id (optional) receives its id.
+*/
+esp_err_t rawlog_append(rawlog_t *log, const void *data, size_t len, uint32_t *id);
+
+/*
+* Zero-copy read: *data points into the mapped partition. It stays valid until the writer wraps around onto
+* that sector, so copy out or check rawlog_first() afterwards when reading old records.
+* ESP_ERR_NOT_FOUND outside [rawlog_first(), rawlog_end()), ESP_ERR_INVALID_CRC for a record torn by a reset or by
+* a failed append.
+*/
+esp_err_t rawlog_read(const rawlog_t *log, uint32_t id, const void **data, size_t *len);
+
+static inline uint32_t rawlog_first(const rawlog_t *log) {
+    return atomic_load_explicit(&((rawlog_t *)log)->first, memory_order_acquire);
+}
+
+static inline uint32_t rawlog_end(const rawlog_t *log) {
+    return atomic_load_explicit(&((rawlog_t *)log)->end, memory_order_acquire);
+}
+
+/*
+* Erase the whole partition and start an empty log with the same slot size.
+*/
+esp_err_t rawlog_format(rawlog_t *log);
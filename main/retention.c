@@ -0,0 +1,159 @@
+#include "retention.h"
+#include "compression.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_spiffs.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *TAG = "retention";
+
+#define RETENTION_LOCK_TICKS pdMS_TO_TICKS(5000)
+
+/* Drops per run before giving up on getting under low_pct (each one frees at least a frame or a segment). */
+#define RETENTION_MAX_DROPS 16
+
+static retention_config_t s_cfg;
+static retention_stats_t s_stats;
+
+static bool usage(size_t *total, size_t *used) {
+    esp_err_t err = esp_spiffs_info(s_cfg.partition_label, total, used);
+    if (err != ESP_OK || *total == 0) {
+        ESP_LOGW(TAG, "esp_spiffs_info failed: %s", esp_err_to_name(err));
+        return false;
+    }
+    s_stats.total = *total;
+    s_stats.used = *used;
+    return true;
+}
+
+/* Erase the pages just freed now, while no writer is waiting on them. */
+static void collect(size_t bytes) {
+    if (bytes == 0 || !metrics_lock_take(METRIC_SITE_RETENTION, RETENTION_LOCK_TICKS)) {
+        return;
+    }
+    TRACE_BEGIN("retention.gc", bytes);
+    esp_spiffs_gc(s_cfg.partition_label, bytes);
+    TRACE_END("retention.gc");
+    metrics_lock_give(METRIC_SITE_RETENTION);
+}
+
+/* Drop raw rows that are compressed already. Returns the bytes freed. */
+static uint32_t drop_raw(compression_stream_t *cs, uint32_t min_bytes) {
+    uint32_t freed = 0;
+    esp_err_t err;
+    if (s_cfg.store) {
+        if (!metrics_lock_take(METRIC_SITE_RETENTION, RETENTION_LOCK_TICKS)) {
+            return 0;
+        }
+        err = segment_drop_raw(s_cfg.store, &freed);
+        metrics_lock_give(METRIC_SITE_RETENTION);
+    } else {
+        err = compression_stream_reclaim_input(cs, min_bytes, ingest_release_file, &freed);
+    }
+    s_stats.errors += err != ESP_OK;
+    s_stats.raw_bytes += freed;
+    metrics_count(METRIC_RETENTION_RAW_BYTES, freed);
+    return freed;
+}
+
+/* Drop the oldest compressed data, about need bytes of it. Returns the bytes freed, 0 when nothing is left. */
+static uint32_t drop_compressed(compression_stream_t *cs, size_t need) {
+    uint32_t freed = 0;
+    esp_err_t err;
+    if (s_cfg.store) {
+        if (!metrics_lock_take(METRIC_SITE_RETENTION, RETENTION_LOCK_TICKS)) {
+            return 0;
+        }
+        segment_store_t *s = s_cfg.store;
+        err = ESP_ERR_NOT_FOUND;
+        /* Only compressed segments: the ones after them still have to be compressed. */
+        if (s->first < s->compressed) {
+            char path[112];
+            struct stat st;
+            segment_compressed_path(s, s->first, path, sizeof(path));
+            freed = stat(path, &st) == 0 ? (uint32_t)st.st_size : 0;
+            segment_path(s, s->first, path, sizeof(path));
+            freed += stat(path, &st) == 0 ? (uint32_t)st.st_size : 0;
+            err = segment_drop_oldest(s);
+        }
+        metrics_lock_give(METRIC_SITE_RETENTION);
+    } else {
+        err = compression_stream_drop_frames(cs, (uint32_t)need, &freed);
+    }
+    s_stats.errors += err != ESP_OK && err != ESP_ERR_NOT_FOUND;
+    s_stats.dropped_bytes += freed;
+    metrics_count(METRIC_RETENTION_DROPPED_BYTES, freed);
+    return freed;
+}
+
+static void retention_pass(compression_stream_t *cs, esp_err_t err) {
+    if (err != ESP_OK) {
+        return;   /* The checkpoint may not describe the files: wait for a clean pass. */
+    }
+    s_stats.runs++;
+    TRACE_BEGIN("retention.run", 0);
+    size_t freed = 0;
+    if (!s_cfg.keep_raw) {
+        freed += drop_raw(cs, s_cfg.raw_min_bytes);
+    }
+    size_t total;
+    size_t used;
+    if (usage(&total, &used) && (uint64_t)used * 100 > (uint64_t)total * s_cfg.high_pct) {
+        size_t target = (size_t)((uint64_t)total * s_cfg.low_pct / 100);
+        ESP_LOGW(TAG, "SPIFFS %u of %u bytes used (over %u%%): dropping down to %u%%", (unsigned)used,
+                 (unsigned)total, (unsigned)s_cfg.high_pct, (unsigned)s_cfg.low_pct);
+        if (s_cfg.keep_raw) {
+            freed += drop_raw(cs, 1);
+            usage(&total, &used);
+        }
+        /* SPIFFS counts deleted pages as free at once, so each drop shows in the next reading. */
+        for (int i = 0; i < RETENTION_MAX_DROPS && used > target; i++) {
+            uint32_t n = drop_compressed(cs, used - target);
+            freed += n;
+            if (n == 0 || !usage(&total, &used)) {
+                break;
+            }
+        }
+        if ((uint64_t)used * 100 > (uint64_t)total * s_cfg.high_pct) {
+            ESP_LOGW(TAG, "SPIFFS still %u%% used: nothing compressed is left to drop",
+                     (unsigned)((uint64_t)used * 100 / total));
+        }
+    }
+    collect(freed);
+    TRACE_END("retention.run");
+}
+
+esp_err_t retention_start(const retention_config_t *cfg) {
+    if (!cfg) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    retention_config_t c = *cfg;
+    c.high_pct = c.high_pct ? c.high_pct : RETENTION_DEFAULT_HIGH_PCT;
+    c.low_pct = c.low_pct ? c.low_pct : RETENTION_DEFAULT_LOW_PCT;
+    c.raw_min_bytes = c.raw_min_bytes ? c.raw_min_bytes : RETENTION_RAW_MIN_BYTES;
+    if (c.high_pct > 100 || c.low_pct >= c.high_pct) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    compression_set_pass_cb(NULL);
+    s_cfg = c;
+    compression_set_pass_cb(retention_pass);
+    ESP_LOGI(TAG, "Retention: %s raw data once compressed, SPIFFS quota %u%% -> %u%%", c.keep_raw ? "keeping" : "dropping",
+             (unsigned)c.high_pct, (unsigned)c.low_pct);
+    return ESP_OK;
+}
+
+void retention_stop(void) {
+    compression_set_pass_cb(NULL);
+}
+
+void retention_get_stats(retention_stats_t *out) {
+    if (out) {
+        *out = s_stats;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "segment.h"
+
+/*
+* Flash Retention.
+* Runs in the compression task after every successful pass (see compression_set_pass_cb()):
+*   1. Raw rows the checkpoint has durably compressed are dropped: the compressed front of the input file is cut
+*      off (compression_stream_reclaim_input()), or in segment mode the raw files of compressed segments go.
+*   2. While SPIFFS use (esp_spiffs_info()) is above high_pct of the partition, the oldest compressed data is
+*      dropped until it is back under low_pct: the oldest frames of the output, or the oldest compressed segments.
+* The space freed is garbage collected right away, in this task, instead of in the middle of an ingest write.
+* Rows that are not compressed yet are never dropped; if they alone exceed the quota, each run logs a warning.
+*/
+#define RETENTION_DEFAULT_HIGH_PCT 80
+#define RETENTION_DEFAULT_LOW_PCT  60
+
+/* Compressed input bytes worth rewriting the input file for: its uncompressed tail is copied each time. */
+#define RETENTION_RAW_MIN_BYTES    4096
+
+typedef struct {
+    uint8_t          high_pct;         /* 0: RETENTION_DEFAULT_HIGH_PCT. */
+    uint8_t          low_pct;          /* 0: RETENTION_DEFAULT_LOW_PCT. */
+    uint32_t         raw_min_bytes;    /* 0: RETENTION_RAW_MIN_BYTES. */
+    bool             keep_raw;         /* Drop raw rows only to get under high_pct, not as soon as they are compressed. */
+    segment_store_t *store;            /* Segment mode: the store compression_start_segments() runs on. */
+    const char      *partition_label;  /* SPIFFS partition, NULL for the default one. */
+} retention_config_t;
+
+typedef struct {
+    uint32_t runs;
+    uint32_t raw_bytes;       /* Raw bytes dropped once compressed. */
+    uint32_t dropped_bytes;   /* Compressed bytes dropped for the quota. */
+    uint32_t errors;
+    size_t   total;           /* esp_spiffs_info() after the last run. */
+    size_t   used;
+} retention_stats_t;
+
+/*
+* Enable retention with cfg (copied) for the compression task's stream. May be called before or after
+* compression_start() / compression_start_segments(); calling it again replaces the configuration.
+* ESP_ERR_INVALID_ARG unless low_pct < high_pct <= 100.
+*/
+esp_err_t retention_start(const retention_config_t *cfg);
+
+void retention_stop(void);
+
+void retention_get_stats(retention_stats_t *out);
@@ -0,0 +1,226 @@
+#include "rollup.h"
+#include "ingest.h"
+#include "csv_field.h"
+#include "codec.h"
+#include "page_write.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *TAG = "rollup";
+
+#define ROLLUP_LOCK_TICKS pdMS_TO_TICKS(2000)
+
+/* Aggregates of one column, in fixed point with `decimals` fractional digits. */
+typedef struct {
+    int64_t  min;
+    int64_t  max;
+    int64_t  sum;
+    int64_t  first;
+    int64_t  last;
+    uint32_t count;
+    uint8_t  decimals;
+} rollup_col_t;
+
+typedef struct {
+    char         path[128];
+    int64_t      window;     /* Width in timestamp units (ms). */
+    int64_t      start;      /* Start of the open window. */
+    uint32_t     rows;       /* Rows in the open window; 0: no window open. */
+    size_t       cols;       /* Widest row of the open window, up to ROLLUP_MAX_COLS. */
+    rollup_col_t col[ROLLUP_MAX_COLS];
+    char         pending[ROLLUP_PENDING_BYTES];
+    size_t       pending_len;
+} rollup_t;
+
+static rollup_t *s_rollups[ROLLUP_MAX];
+static _Atomic int s_count = 0;
+
+/* Rescale a column to more decimals; existing aggregates are multiplied up. False (column unchanged) on overflow. */
+static bool col_widen(rollup_col_t *c, int decimals) {
+    if (c->count > 0) {
+        int64_t k = codec_pow10[decimals - c->decimals];
+        int64_t v[5];
+        if (__builtin_mul_overflow(c->min, k, &v[0]) || __builtin_mul_overflow(c->max, k, &v[1])
+            || __builtin_mul_overflow(c->sum, k, &v[2]) || __builtin_mul_overflow(c->first, k, &v[3])
+            || __builtin_mul_overflow(c->last, k, &v[4])) {
+            return false;
+        }
+        c->min = v[0];
+        c->max = v[1];
+        c->sum = v[2];
+        c->first = v[3];
+        c->last = v[4];
+    }
+    c->decimals = (uint8_t)decimals;
+    return true;
+}
+
+/* Values that do not fit an int64 at the column's decimals, or would overflow its sum, are left out. */
+static void col_add(rollup_col_t *c, const csv_field_t *f) {
+    if (f->decimals > c->decimals && !col_widen(c, f->decimals)) {
+        return;
+    }
+    int64_t v;
+    int64_t sum;
+    if (__builtin_mul_overflow(f->mant, codec_pow10[c->decimals - f->decimals], &v)
+        || __builtin_add_overflow(c->count > 0 ? c->sum : 0, v, &sum)) {
+        return;
+    }
+    if (c->count == 0) {
+        c->min = c->max = c->first = v;
+    } else if (v < c->min) {
+        c->min = v;
+    } else if (v > c->max) {
+        c->max = v;
+    }
+    c->sum = sum;
+    c->last = v;
+    c->count++;
+}
+
+/* Append [s, s + len) to path under spi_flash_lock. */
+static esp_err_t append_file(const char *path, const char *s, size_t len) {
+    if (!metrics_lock_take(METRIC_SITE_ROLLUP, ROLLUP_LOCK_TICKS)) {
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t err = ESP_FAIL;
+    FILE *f = fopen(path, "a");
+    if (f) {
+        setvbuf(f, NULL, _IONBF, 0);
+        if (fseek(f, 0, SEEK_END) == 0 && page_write(f, s, len) == len && fflush(f) == 0 && fsync(fileno(f)) == 0) {
+            err = ESP_OK;
+        }
+        fclose(f);
+    }
+    metrics_lock_give(METRIC_SITE_ROLLUP);
+    return err;
+}
+
+/*
+* Longest window line: timestamp, rows and '\n' (32), then per column the count (11) and five values of at most
+* 21 characters after their ','. The last value still gets a whole CODEC_FIXED_MAX buffer.
+*/
+#define ROLLUP_LINE_MAX (32 + ROLLUP_MAX_COLS * (11 + 5 * 22) + CODEC_FIXED_MAX)
+_Static_assert(ROLLUP_PENDING_BYTES >= 2 * ROLLUP_LINE_MAX, "the pending buffer must hold more than one window line");
+
+/* Write the lines waiting in r. On failure they are dropped (logged): rows are never held back for a summary. */
+static esp_err_t write_pending(rollup_t *r) {
+    if (r->pending_len == 0) {
+        return ESP_OK;
+    }
+    TRACE_BEGIN("rollup.write", r->pending_len);
+    esp_err_t err = append_file(r->path, r->pending, r->pending_len);
+    TRACE_END("rollup.write");
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: %u bytes of windows lost (%s)", r->path, (unsigned)r->pending_len, esp_err_to_name(err));
+    }
+    r->pending_len = 0;
+    return err;
+}
+
+/* Queue the open window's line and reset the window. */
+static void close_window(rollup_t *r) {
+    if (sizeof(r->pending) - r->pending_len < ROLLUP_LINE_MAX) {
+        write_pending(r);
+    }
+    char *line = r->pending + r->pending_len;
+    size_t cap = sizeof(r->pending) - r->pending_len;
+    int n = snprintf(line, cap, "%lld,%u", (long long)r->start, (unsigned)r->rows);
+    for (size_t i = 0; i < r->cols; i++) {
+        const rollup_col_t *c = &r->col[i];
+        n += snprintf(line + n, cap - (size_t)n, ",%u", (unsigned)c->count);
+        const int64_t v[5] = { c->min, c->max, c->sum, c->first, c->last };
+        for (int k = 0; k < 5; k++) {
+            line[n++] = ',';
+            if (c->count > 0) {
+                n += (int)codec_format_fixed(line + n, v[k], c->decimals);
+            }
+        }
+    }
+    line[n++] = '\n';
+    r->pending_len += (size_t)n;
+    r->rows = 0;
+    r->cols = 0;
+    memset(r->col, 0, sizeof(r->col));
+}
+
+void rollup_row(const char *row, size_t len) {
+    int count = atomic_load(&s_count);
+    if (!row) {
+        for (int i = 0; i < count; i++) {
+            write_pending(s_rollups[i]);
+        }
+        return;
+    }
+    csv_field_t f[ROLLUP_MAX_COLS + 1];
+    size_t fields = csv_parse_row(row, len, f, ROLLUP_MAX_COLS + 1);
+    if (fields == 0 || f[0].status != CSV_FIELD_OK) {
+        return;   /* Header or text row: no timestamp to place it by. */
+    }
+    int64_t ts = f[0].mant / codec_pow10[f[0].decimals];
+    size_t cols = fields - 1 < ROLLUP_MAX_COLS ? fields - 1 : ROLLUP_MAX_COLS;
+    for (int i = 0; i < count; i++) {
+        rollup_t *r = s_rollups[i];
+        int64_t start = ts - ((ts % r->window) + r->window) % r->window;
+        if (r->rows > 0 && start != r->start) {
+            close_window(r);
+        }
+        r->start = start;
+        r->rows++;
+        if (cols > r->cols) {
+            r->cols = cols;
+        }
+        for (size_t c = 0; c < cols; c++) {
+            if (f[c + 1].status == CSV_FIELD_OK) {
+                col_add(&r->col[c], &f[c + 1]);
+            }
+        }
+    }
+}
+
+esp_err_t rollup_add(const char *path, uint32_t window_ms) {
+    if (!path || window_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int count = atomic_load(&s_count);
+    if (count == ROLLUP_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    rollup_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return ESP_ERR_NO_MEM;
+    }
+    strncpy(r->path, path, sizeof(r->path) - 1);
+    r->window = window_ms;
+    s_rollups[count] = r;
+    /* Published after it is set up: the flusher only looks at the first s_count entries. */
+    atomic_store(&s_count, count + 1);
+    ingest_set_row_cb(rollup_row);
+    ESP_LOGI(TAG, "Rollup -> %s, %u ms windows", r->path, (unsigned)window_ms);
+    return ESP_OK;
+}
+
+esp_err_t rollup_flush(void) {
+    int count = atomic_load(&s_count);
+    for (int i = 0; i < count; i++) {
+        if (s_rollups[i]->rows > 0) {
+            close_window(s_rollups[i]);
+        }
+    }
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < count; i++) {
+        esp_err_t e = write_pending(s_rollups[i]);
+        err = err == ESP_OK ? e : err;
+    }
+    return err;
+}
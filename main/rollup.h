@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+* Windowed Rollups.
+* Per-column aggregates over tumbling windows of the row timestamp (first field), updated as the ingest flusher
+* puts each row on flash, so summaries never need the raw or compressed data again.
+* Each rollup appends one CSV line per closed window to its own file:
+*   window_start,rows,<count,min,max,sum,first,last> for every column after the timestamp
+* Values keep the column's decimals (the finest seen in the window); mean is sum / count. A value that would overflow
+* them (an int64 at those decimals, sum included) is left out of count and the aggregates. A column without a number
+* in the window has count 0 and empty fields. Windows without rows are not written.
+* The open window lives in RAM until a row of a later window closes it or ingest_stop() calls rollup_flush(); a reset
+* loses it. A window cut by a stop and continued after ingest restarts shows up as two lines with the same start,
+* which merge like any two windows (min of mins, sums and counts add, first of the earlier, last of the later).
+*/
+#define ROLLUP_MAX       4
+#define ROLLUP_MAX_COLS  16
+
+/* Closed-window lines waiting for the end of the ingest batch, per rollup: two of the widest lines at least. */
+#define ROLLUP_PENDING_BYTES 4096
+
+/*
+* Add a rollup of window_ms wide windows written to path. Registers the row callback of ingest (see ingest.h),
+* so this may be called before or after ingest is started. ESP_ERR_NO_MEM once ROLLUP_MAX exist.
+*/
+esp_err_t rollup_add(const char *path, uint32_t window_ms);
+
+/*
+* Feed one row (without its '\n'); NULL ends a batch and writes the closed windows out.
+* This is the ingest row callback; call it directly only when rows come from elsewhere and ingest is not running.
+*/
+void rollup_row(const char *row, size_t len);
+
+/*
+* Write every open window as it stands and start them afresh. Only while ingest is stopped; ingest_stop() calls it.
+*/
+esp_err_t rollup_flush(void);
@@ -1,6 +1,14 @@
 #include "spiffs.h"
 #include "heartbeat.h"
+#include "pipeline.h"
 #include "compression.h"
+#include "ingest.h"
+#include "rollup.h"
+#include "retention.h"
+#include "segment.h"
+#include "rawlog.h"
+#include "metrics.h"
+#include "trace.h"
 #include "global.h"
 
 #include "esp_log.h"
@@ -21,6 +29,18 @@ SemaphoreHandle_t spi_flash_lock = NULL;
 /* File path for compressed file in SPIFFS*/
 #define SPIFFS_COMPRESSED_FILE  "/spiffs/compressed_output.csv"
 
+/* Segment base in SPIFFS: segments are "/spiffs/sensor_data.NNNNNN.csv" (see segment.h). */
+#define SPIFFS_SEGMENT_BASE "/spiffs/sensor_data"
+
+/* Metrics snapshot in SPIFFS, rewritten every interval (see metrics.h). */
+#define SPIFFS_METRICS_FILE "/spiffs/metrics.txt"
+
+/* Chrome Trace Event JSON, open in ui.perfetto.dev (see trace.h). */
+#define SPIFFS_TRACE_FILE "/spiffs/trace.json"
+
+/* Rollup files in SPIFFS, one per window width: "/spiffs/rollup_60000.csv" (see rollup.h). */
+#define SPIFFS_ROLLUP_FMT "/spiffs/rollup_%d.csv"
+
 /* Testing: Name of file to move from SD to SPI Flash emulating background work. */
 #define SD_INPUT_FILE  "/sd/Lucas_Sample_Data.csv"
 
@@ -34,6 +54,14 @@ static bool file_exists(const char *path) {
 static int  g_comp_interval_ms = 30000;
 static char g_comp_algo[16]    = "rle";
 
+/* Segmented storage, enabled by sdcloud.use_segments(bytes). */
+static segment_store_t g_store;
+static bool g_segments = false;
+
+/* Raw partition log, enabled by sdcloud.use_rawlog(slot_bytes). */
+static rawlog_t g_rawlog;
+static bool g_use_rawlog = false;
+
 static void parse_config_commands(const char *path,
                                   const char *spiffs_data_file,
                                   const char *spiffs_compressed_file,
@@ -50,7 +78,7 @@ static void parse_config_commands(const char *path,
     while (fgets(line, sizeof(line), f)) {
         
         /* Cut down newline*/
-        size_t n = strlen(s);
+        size_t n = strlen(line);
         while (n && (line[n-1] == '\n' || line[n-1] == '\r')){ 
             line[--n] = '\0'; 
         }
@@ -83,7 +111,7 @@ static void parse_config_commands(const char *path,
             continue;
         }
 
-        /* Developer Command: sdcloud.set_compression_algorithm(rle OR delta) */
+        /* Developer Command: sdcloud.set_compression_algorithm(rle OR delta OR gorilla OR lz OR dict) */
         if (strncmp(line, "sdcloud.set_compression_algorithm", 33) == 0) {
             char algo[16] = {0};
             if (sscanf(line, "sdcloud.set_compression_algorithm(%15[^)])", algo) == 1) {
@@ -98,18 +126,159 @@ static void parse_config_commands(const char *path,
         /* Developer Command: sdcloud.set_compression_frequency(30000)*/
         if (strncmp(line, "sdcloud.set_compression_frequency(", 32) == 0) {
             int ms = 0;
-            if (sscanf(line, "sdcloud.set_compression_frequency((%d)", &ms) == 1 && ms > 0) {
+            if (sscanf(line, "sdcloud.set_compression_frequency(%d)", &ms) == 1 && ms > 0) {
                 g_comp_interval_ms = ms;
-                ESP_LOGI("CONFIG", "compression frequency( -> %d ms", g_comp_interval_ms);
-                compression_set_frequency_ms(g_comp_interval_ms);
+                ESP_LOGI("CONFIG", "compression frequency -> %d ms", g_comp_interval_ms);
+                compression_set_interval(g_comp_interval_ms);
             }   
             continue;
         }
 
+        /* Developer Command: sdcloud.set_column_decimals(1, 2) -> delta keeps column 1 at 2 decimals. */
+        if (strncmp(line, "sdcloud.set_column_decimals(", 28) == 0) {
+            int col = 0, dec = 0;
+            if (sscanf(line, "sdcloud.set_column_decimals(%d,%d)", &col, &dec) == 2) {
+                ESP_LOGI("CONFIG", "column %d decimals -> %d", col, dec);
+                compression_set_column_decimals(col, dec);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.set_frame_rows(512) -> rows per independently decodable output frame. */
+        if (strncmp(line, "sdcloud.set_frame_rows(", 23) == 0) {
+            int rows = 0;
+            if (sscanf(line, "sdcloud.set_frame_rows(%d)", &rows) == 1 && rows > 0) {
+                ESP_LOGI("CONFIG", "frame rows -> %d", rows);
+                compression_set_frame_rows((uint32_t)rows);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.set_compression_workers(2) -> encode full frames on 2 pinned tasks; 1 = in the compression task. */
+        if (strncmp(line, "sdcloud.set_compression_workers(", 32) == 0) {
+            int workers = 0;
+            if (sscanf(line, "sdcloud.set_compression_workers(%d)", &workers) == 1 && workers > 0) {
+                ESP_LOGI("CONFIG", "compression workers -> %d", workers);
+                compression_set_workers(workers);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.use_segments(65536) -> append to sealed, fixed-size segments. Put it before run_compression. */
+        if (strncmp(line, "sdcloud.use_segments(", 21) == 0) {
+            int bytes = 0;
+            if (g_segments || g_use_rawlog) {
+                /* Ingest keeps the destination it started with, and its store must not be opened again under it. */
+                ESP_LOGW("CONFIG", "ingest destination already set, ignoring: %s", line);
+            } else if (sscanf(line, "sdcloud.use_segments(%d)", &bytes) == 1 && bytes > 0
+                && segment_store_open(&g_store, SPIFFS_SEGMENT_BASE, (uint32_t)bytes) == ESP_OK
+                && ingest_start_segments(&g_store, 0, 0) == ESP_OK) {
+                ESP_LOGI("CONFIG", "segmented storage -> %s.NNNNNN.csv, %d bytes each", SPIFFS_SEGMENT_BASE, bytes);
+                g_segments = true;
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.use_rawlog(256) -> append to the "datalog" partition in 256 byte records, bypassing SPIFFS. */
+        if (strncmp(line, "sdcloud.use_rawlog(", 19) == 0) {
+            int slot = 0;
+            if (g_segments || g_use_rawlog) {
+                ESP_LOGW("CONFIG", "ingest destination already set, ignoring: %s", line);
+            } else if (sscanf(line, "sdcloud.use_rawlog(%d)", &slot) == 1 && slot >= 0
+                && rawlog_open(&g_rawlog, RAWLOG_DEFAULT_LABEL, (uint32_t)slot) == ESP_OK
+                && ingest_start_rawlog(&g_rawlog, 0, 0) == ESP_OK) {
+                ESP_LOGI("CONFIG", "raw log -> partition %s, %u byte records", RAWLOG_DEFAULT_LABEL, (unsigned)g_rawlog.slot_size);
+                g_use_rawlog = true;
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.add_rollup(60000) -> per-column min/max/sum/count/first/last of every 60 s window. */
+        if (strncmp(line, "sdcloud.add_rollup(", 19) == 0) {
+            int ms = 0;
+            char path[48];
+            if (sscanf(line, "sdcloud.add_rollup(%d)", &ms) == 1 && ms > 0) {
+                snprintf(path, sizeof(path), SPIFFS_ROLLUP_FMT, ms);
+                ESP_LOGI("CONFIG", "rollup -> %s", path);
+                (void)rollup_add(path, (uint32_t)ms);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.run_retention(80,60) -> drop raw rows once compressed; above 80% SPIFFS use, drop the oldest compressed data down to 60%. Put it after use_segments. */
+        if (strncmp(line, "sdcloud.run_retention(", 22) == 0) {
+            int high = 0;
+            int low = 0;
+            if (sscanf(line, "sdcloud.run_retention(%d,%d)", &high, &low) == 2 && low > 0 && low < high && high <= 100) {
+                retention_config_t cfg = {
+                    .high_pct = (uint8_t)high,
+                    .low_pct = (uint8_t)low,
+                    .store = g_segments ? &g_store : NULL,
+                };
+                ESP_LOGI("CONFIG", "retention -> quota %d%%, down to %d%%", high, low);
+                (void)retention_start(&cfg);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.run_metrics(60000) -> snapshot counters, histograms and stack use every 60 s. */
+        if (strncmp(line, "sdcloud.run_metrics(", 20) == 0) {
+            int ms = 0;
+            if (sscanf(line, "sdcloud.run_metrics(%d)", &ms) == 1 && ms > 0) {
+                ESP_LOGI("CONFIG", "metrics -> %s every %d ms", SPIFFS_METRICS_FILE, ms);
+                (void)metrics_start(SPIFFS_METRICS_FILE, ms);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.run_trace(4096, 60000) -> trace 4096 events, dump them after 60 s. */
+        if (strncmp(line, "sdcloud.run_trace(", 18) == 0) {
+            int events = 0;
+            int ms = 0;
+            if (sscanf(line, "sdcloud.run_trace(%d,%d)", &events, &ms) == 2 && events > 0 && ms >= 0
+                && trace_start((size_t)events) == ESP_OK) {
+                ESP_LOGI("CONFIG", "tracing %d events -> %s in %d ms", events, SPIFFS_TRACE_FILE, ms);
+                (void)trace_dump_after(SPIFFS_TRACE_FILE, ms);
+            }
+            continue;
+        }
+
+        /* Developer Command: sdcloud.add_pipeline(/spiffs/b.csv,/spiffs/b.z,delta,30000,4,1000) -> another sensor CSV with its own codec, interval and heartbeat pin. */
+        if (strncmp(line, "sdcloud.add_pipeline(", 21) == 0) {
+            char in[96];
+            char out[96];
+            char algo[16];
+            int interval = 0;
+            int pin = -1;
+            int period = 0;
+            pipeline_t *p = NULL;
+            if (sscanf(line, "sdcloud.add_pipeline(%95[^,],%95[^,],%15[^,],%d,%d,%d)", in, out, algo, &interval, &pin, &period) == 6) {
+                pipeline_config_t cfg = {
+                    .input_csv = in,
+                    .output_path = out,
+                    .algo = algo,
+                    .compress_interval_ms = interval,
+                    .heartbeat_pin = pin >= 0 ? (gpio_num_t)pin : GPIO_NUM_NC,
+                    .heartbeat_period_ms = period,
+                };
+                if (pipeline_create(&cfg, &p) == ESP_OK) {
+                    ESP_LOGI("CONFIG", "pipeline %s -> %s (%s)", in, out, algo);
+                }
+            }
+            continue;
+        }
+
         /* Developer Command: sdcloud.run_compression */
         if (strcmp(line, "sdcloud.run_compression") == 0) {
             ESP_LOGI("CONFIG", "starting compression (%s, %d ms)", g_comp_algo, g_comp_interval_ms);
-            (void)compression_start(spiffs_data_file, spiffs_compressed_file, g_comp_interval_ms, g_comp_algo);
+            if (g_use_rawlog) {
+                ESP_LOGW("CONFIG", "compression reads SPIFFS; rows in the raw log are not compressed");
+            }
+            if (g_segments) {
+                (void)compression_start_segments(&g_store, g_comp_interval_ms, g_comp_algo);
+            } else {
+                (void)compression_start(spiffs_data_file, spiffs_compressed_file, g_comp_interval_ms, g_comp_algo);
+            }
             continue;
         }
 
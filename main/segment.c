@@ -0,0 +1,257 @@
+#include "segment.h"
+#include "page_write.h"
+#include "metrics.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include <dirent.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char *TAG = "segment";
+
+/* Manifest Format Identifiers. */
+#define MANIFEST_MAGIC   0x4D475353u /* "SSGM" */
+#define MANIFEST_VERSION 1u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment_bytes;
+    uint32_t first;
+    uint32_t compressed;
+    uint32_t active;
+    uint32_t checksum;
+} segment_manifest_t;
+
+/* FNV-1a over everything but the trailing checksum. */
+static uint32_t manifest_checksum(const segment_manifest_t *m) {
+    const uint8_t *p = (const uint8_t *)m;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(segment_manifest_t, checksum); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void manifest_paths(const segment_store_t *s, char *path, char *tmp, size_t len) {
+    snprintf(path, len, "%s.manifest", s->base);
+    snprintf(tmp, len, "%s.manifest.tmp", s->base);
+}
+
+static bool manifest_read(const char *path, segment_manifest_t *m) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    size_t rd = fread(m, 1, sizeof(*m), f);
+    fclose(f);
+    return rd == sizeof(*m) && m->magic == MANIFEST_MAGIC && m->version == MANIFEST_VERSION
+        && m->checksum == manifest_checksum(m)
+        && m->first <= m->compressed && m->compressed <= m->active;
+}
+
+/* Write temp, fsync, then swap in. SPIFFS rename does not replace an existing file. */
+static esp_err_t manifest_save(const segment_store_t *s) {
+    segment_manifest_t m = {
+        .magic = MANIFEST_MAGIC,
+        .version = MANIFEST_VERSION,
+        .segment_bytes = s->segment_bytes,
+        .first = s->first,
+        .compressed = s->compressed,
+        .active = s->active,
+    };
+    m.checksum = manifest_checksum(&m);
+    char path[112];
+    char tmp[112];
+    manifest_paths(s, path, tmp, sizeof(path));
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        ESP_LOGE(TAG, "Manifest: fopen(%s) failed", tmp);
+        return ESP_FAIL;
+    }
+    size_t wr = page_write(f, &m, sizeof(m));
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    if (wr != sizeof(m)) {
+        ESP_LOGE(TAG, "Manifest: short write");
+        return ESP_FAIL;
+    }
+    remove(path);
+    if (rename(tmp, path) != 0) {
+        ESP_LOGE(TAG, "Manifest: rename failed");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/*
+* No manifest: find the lowest and highest segment numbers on disk. The highest raw one stays active (it may be
+* partly written) and nothing with a raw file is assumed compressed; the compressor's per-segment checkpoints make
+* redoing one cheap. Segments left with only a container had their raw file dropped after compression.
+*/
+static void store_scan(segment_store_t *s) {
+    const char *slash = strrchr(s->base, '/');
+    const char *name = slash ? slash + 1 : s->base;
+    char dir[96];
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == s->base) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, s->base, (size_t)(slash - s->base));
+        dir[slash - s->base] = '\0';
+    }
+    size_t name_len = strlen(name);
+
+    bool found = false;
+    bool raw = false;
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    uint32_t raw_lo = 0;
+    uint32_t raw_hi = 0;
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            unsigned n;
+            char ext[8];
+            if (strncmp(e->d_name, name, name_len) != 0 || e->d_name[name_len] != '.'
+                || sscanf(e->d_name + name_len + 1, "%6u.%7s", &n, ext) != 2
+                || (strcmp(ext, "csv") != 0 && strcmp(ext, "z") != 0)) {
+                continue;
+            }
+            lo = (!found || n < lo) ? n : lo;
+            hi = (!found || n > hi) ? n : hi;
+            found = true;
+            if (ext[0] == 'c') {
+                raw_lo = (!raw || n < raw_lo) ? n : raw_lo;
+                raw_hi = (!raw || n > raw_hi) ? n : raw_hi;
+                raw = true;
+            }
+        }
+        closedir(d);
+    }
+    s->first = lo;
+    s->compressed = raw ? raw_lo : (found ? hi + 1 : lo);
+    s->active = raw ? raw_hi : s->compressed;
+    if (found) {
+        ESP_LOGW(TAG, "No manifest for %s: rebuilt from segments %u..%u", s->base, (unsigned)lo, (unsigned)hi);
+    }
+}
+
+esp_err_t segment_store_open(segment_store_t *s, const char *base, uint32_t segment_bytes) {
+    if (!s || !base || strlen(base) >= sizeof(s->base)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(s, 0, sizeof(*s));
+    strncpy(s->base, base, sizeof(s->base) - 1);
+
+    if (!metrics_lock_take(METRIC_SITE_SEGMENT, pdMS_TO_TICKS(5000))) {
+        return ESP_ERR_TIMEOUT;
+    }
+    char path[112];
+    char tmp[112];
+    manifest_paths(s, path, tmp, sizeof(path));
+    segment_manifest_t m;
+    /* A leftover temp file means a crash hit between remove and rename. */
+    if (manifest_read(path, &m) || manifest_read(tmp, &m)) {
+        s->segment_bytes = m.segment_bytes;
+        s->first = m.first;
+        s->compressed = m.compressed;
+        s->active = m.active;
+    } else {
+        store_scan(s);
+    }
+    if (segment_bytes) {
+        s->segment_bytes = segment_bytes;
+    } else if (!s->segment_bytes) {
+        s->segment_bytes = SEGMENT_DEFAULT_BYTES;
+    }
+    esp_err_t err = manifest_save(s);
+    metrics_lock_give(METRIC_SITE_SEGMENT);
+    s->raw_first = s->first;
+
+    ESP_LOGI(TAG, "%s: segments %u..%u, compressed up to %u, %u bytes each",
+             s->base, (unsigned)s->first, (unsigned)s->active, (unsigned)s->compressed, (unsigned)s->segment_bytes);
+    return err;
+}
+
+void segment_path(const segment_store_t *s, uint32_t n, char *buf, size_t len) {
+    snprintf(buf, len, "%s.%06u.csv", s->base, (unsigned)n);
+}
+
+void segment_compressed_path(const segment_store_t *s, uint32_t n, char *buf, size_t len) {
+    snprintf(buf, len, "%s.%06u.z", s->base, (unsigned)n);
+}
+
+esp_err_t segment_seal(segment_store_t *s) {
+    s->active++;
+    esp_err_t err = manifest_save(s);
+    ESP_LOGI(TAG, "%s: sealed segment %u", s->base, (unsigned)(s->active - 1));
+    return err;
+}
+
+esp_err_t segment_mark_compressed(segment_store_t *s, uint32_t n) {
+    if (n != s->compressed || n >= s->active) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s->compressed = n + 1;
+    return manifest_save(s);
+}
+
+esp_err_t segment_drop_oldest(segment_store_t *s) {
+    if (s->first >= s->active) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint32_t n = s->first;
+    s->first = n + 1;
+    if (s->compressed < s->first) {
+        s->compressed = s->first;
+    }
+    if (s->raw_first < s->first) {
+        s->raw_first = s->first;
+    }
+    /* Manifest first: a crash after it leaves orphan files, never a manifest pointing at missing data. */
+    esp_err_t err = manifest_save(s);
+
+    char path[112];
+    char aux[120];
+    segment_path(s, n, path, sizeof(path));
+    remove(path);
+    segment_compressed_path(s, n, path, sizeof(path));
+    remove(path);
+    snprintf(aux, sizeof(aux), "%s.idx", path);
+    remove(aux);
+    snprintf(aux, sizeof(aux), "%s.ckpt", path);
+    remove(aux);
+    ESP_LOGI(TAG, "%s: dropped segment %u", s->base, (unsigned)n);
+    return err;
+}
+
+esp_err_t segment_drop_raw(segment_store_t *s, uint32_t *freed) {
+    uint32_t bytes = 0;
+    if (s->raw_first < s->first) {
+        s->raw_first = s->first;
+    }
+    for (; s->raw_first < s->compressed; s->raw_first++) {
+        char path[112];
+        struct stat st;
+        segment_path(s, s->raw_first, path, sizeof(path));
+        if (stat(path, &st) == 0 && remove(path) == 0) {
+            bytes += (uint32_t)st.st_size;
+        }
+    }
+    if (freed) {
+        *freed = bytes;
+    }
+    return ESP_OK;
+}
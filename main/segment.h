@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+* Segmented Sensor Storage.
+* The data stream is a series of files "<base>.NNNNNN.csv". Only the active segment is appended to; once it
+* reaches segment_bytes it is sealed (never written again) and the next number becomes active.
+*   [first, compressed)  sealed and compressed to "<base>.NNNNNN.z"; the raw file may be gone (segment_drop_raw())
+*   [compressed, active) sealed, waiting for the compressor
+*   active               receiving appends
+* "<base>.manifest" records these numbers. Dropping the oldest segment is one remove, not a rewrite.
+* Names stay within SPIFFS's 32 characters for bases up to 11 characters after the mount point.
+*/
+#define SEGMENT_DEFAULT_BYTES (64u * 1024)
+
+typedef struct {
+    char     base[96];
+    uint32_t segment_bytes;
+    uint32_t first;
+    uint32_t compressed;
+    uint32_t active;
+    uint32_t raw_first;   /* Lowest compressed segment that may still have its raw file (not persisted). */
+} segment_store_t;
+
+/*
+* Load the manifest for base, or rebuild it from the segment files found next to it.
+* segment_bytes = 0 keeps the size from the manifest (SEGMENT_DEFAULT_BYTES for a new store).
+* Takes spi_flash_lock.
+*/
+esp_err_t segment_store_open(segment_store_t *s, const char *base, uint32_t segment_bytes);
+
+/* "<base>.NNNNNN.csv" for segment n. */
+void segment_path(const segment_store_t *s, uint32_t n, char *buf, size_t len);
+
+/* "<base>.NNNNNN.z", the compressed container for segment n. */
+void segment_compressed_path(const segment_store_t *s, uint32_t n, char *buf, size_t len);
+
+/* The functions below update the manifest and expect the caller to hold spi_flash_lock. */
+
+/*
+* Seal the active segment and make the next one active. The caller must have closed its handle on it.
+*/
+esp_err_t segment_seal(segment_store_t *s);
+
+/*
+* Record that sealed segment n has been compressed. Segments are compressed in order.
+*/
+esp_err_t segment_mark_compressed(segment_store_t *s, uint32_t n);
+
+/*
+* Delete the oldest sealed segment and its compressed container. ESP_ERR_NOT_FOUND if only the active one is left.
+*/
+esp_err_t segment_drop_oldest(segment_store_t *s);
+
+/*
+* Delete the raw files of compressed segments, keeping their containers. freed (optional) receives their size.
+*/
+esp_err_t segment_drop_raw(segment_store_t *s, uint32_t *freed);
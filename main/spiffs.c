@@ -1,4 +1,8 @@
 #include "spiffs.h"
+#include "transfer.h"
+#include "global.h"
+#include "page_write.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -19,6 +23,21 @@
 
 static const char *TAG = "fs_utils";
 
+/* SPIFFS writes of the transfer engine go through spi_flash_lock once it exists. */
+static bool flash_take(void *ctx) {
+    (void)ctx;
+    return !spi_flash_lock || metrics_lock_take(METRIC_SITE_TRANSFER, pdMS_TO_TICKS(5000));
+}
+
+static void flash_give(void *ctx) {
+    (void)ctx;
+    if (spi_flash_lock) {
+        metrics_lock_give(METRIC_SITE_TRANSFER);
+    }
+}
+
+static const io_lock_t s_flash_io = { .take = flash_take, .give = flash_give };
+
 /* SDSPI pins Definitions (VSPI Defaults) */
 #ifndef SDCARD_SPI_HOST
 #define SDCARD_SPI_HOST SPI3_HOST
@@ -181,7 +200,9 @@ esp_err_t spiffs_write_file(const char *path, const void *data, size_t len, bool
         ESP_LOGE(TAG, "fopen(%s) for write failed: error=%d", path, errno);
         return ESP_FAIL;
     }
-    size_t wr = fwrite(data, 1, len, f);
+    /* One write of the whole buffer instead of one per stdio buffer. */
+    setvbuf(f, NULL, _IONBF, 0);
+    size_t wr = page_write(f, data, len);
     fclose(f);
     if (wr != len) {
         ESP_LOGE(TAG, "fwrite short (%zu/%zu)", wr, len);
@@ -343,49 +364,15 @@ esp_err_t sd_to_spiffs_move(const char *sd_base,
         }
     }
 
-    /* Problem with Malloc. Solution: Stream data chunks. */
-    FILE *fin = fopen(sd_in_path, "rb");
-    if (!fin) {
-        ESP_LOGE(TAG, "fopen(%s) failed: error=%d", sd_in_path, errno);
-        return ESP_FAIL;
-    }
-    FILE *fout = fopen(spiffs_out_path, "wb");
-    if (!fout) {
-        ESP_LOGE(TAG, "fopen(%s) for write failed: error=%d", spiffs_out_path, errno);
-        fclose(fin);
-        return ESP_FAIL;
-    }
-
-    uint8_t *buf = (uint8_t *)malloc(4096);
-    if (!buf) {
-        ESP_LOGE(TAG, "malloc buffer failed");
-        fclose(fin);
-        fclose(fout);
-        return ESP_ERR_NO_MEM;
-    }
-
-    size_t total_written = 0;
-    for (;;) {
-        size_t rd = fread(buf, 1, 4096, fin);
-        if (rd == 0){
-            break;
-        }
-        size_t wr = fwrite(buf, 1, rd, fout);
-        if (wr != rd) {
-            ESP_LOGE(TAG, "Short write to %s (wrote %zu of %zu)", spiffs_out_path, wr, rd);
-            free(buf); 
-            fclose(fin); 
-            fclose(fout);
-            return ESP_FAIL;
-        }
-        total_written += wr;
+    /* Pipelined: the SD is read into one buffer while the previous one is written to flash. */
+    transfer_config_t cfg = { .dst_lock = &s_flash_io };
+    transfer_stats_t st = { 0 };
+    ret = transfer_file(sd_in_path, spiffs_out_path, false, &cfg, &st);
+    if (ret != ESP_OK) {
+        return ret;
     }
-
-    free(buf);
-    fclose(fin);
-    fclose(fout);
-    ESP_LOGI(TAG, "Stream-copied %u bytes: %s -> %s",
-             (unsigned)total_written, sd_in_path, spiffs_out_path);
+    ESP_LOGI(TAG, "Copied %u bytes: %s -> %s",
+             (unsigned)st.bytes, sd_in_path, spiffs_out_path);
 
     /* Delete file from SD if so.*/
     if (move) {
@@ -398,3 +385,21 @@ esp_err_t sd_to_spiffs_move(const char *sd_base,
 
     return ESP_OK;
 }
+
+esp_err_t sd_to_spiffs_import_dir(const char *sd_dir, const char *spiffs_dir, size_t buffers, size_t buffer_size)
+{
+    esp_err_t ret = sdcard_init("/sd");
+    if (ret != ESP_OK) return ret;
+
+    transfer_config_t cfg = {
+        .buffers = buffers,
+        .buffer_size = buffer_size,
+        .dst_lock = &s_flash_io,
+    };
+    transfer_stats_t st = { 0 };
+    ret = transfer_dir(sd_dir, spiffs_dir, &cfg, &st);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Import %s -> %s stopped: %s (rerun to resume)", sd_dir, spiffs_dir, esp_err_to_name(ret));
+    }
+    return ret;
+}
@@ -56,3 +56,11 @@ esp_err_t sdcard_list_file_sys(const char *dir_path);
  * mimicking real world data flow (sensing data would be transferred to SPIFFS outside of app layer.)
  */
 esp_err_t sd_to_spiffs_move(const char *sd_base, const char *sd_in_path,const char *spiffs_base, const char *spiffs_out_path, bool overwrite, bool move);
+
+/*
+ * Used for provisioning.
+ * Copies every file of an SD directory into SPIFFS through the pipelined transfer engine (see transfer.h).
+ * Progress is kept in spiffs_dir/import.mf: calling it again after an interruption resumes the import.
+ * buffers / buffer_size of 0 use the engine defaults.
+ */
+esp_err_t sd_to_spiffs_import_dir(const char *sd_dir, const char *spiffs_dir, size_t buffers, size_t buffer_size);
@@ -0,0 +1,187 @@
+#include "trace.h"
+#include "metrics.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *TAG = "trace";
+
+typedef struct {
+    uint32_t     ts_us;   /* Low 32 bits of esp_timer time; unwrapped when dumped. */
+    uint32_t     arg;
+    const char  *name;
+    TaskHandle_t task;
+    char         phase;
+} trace_rec_t;
+
+atomic_bool trace_on;
+
+static trace_rec_t *s_ring = NULL;
+static uint32_t s_mask = 0;
+static atomic_uint s_pos;
+
+void trace_record(const char *name, char phase, uint32_t arg) {
+    /* Any task may record: each event claims its own slot. */
+    uint32_t i = atomic_fetch_add_explicit(&s_pos, 1, memory_order_relaxed) & s_mask;
+    trace_rec_t *r = &s_ring[i];
+    r->ts_us = (uint32_t)esp_timer_get_time();
+    r->arg = arg;
+    r->name = name;
+    r->task = xTaskGetCurrentTaskHandle();
+    r->phase = phase;
+}
+
+esp_err_t trace_start(size_t events) {
+    if (s_ring) {
+        atomic_store(&trace_on, true);
+        return ESP_OK;
+    }
+    size_t n = 64;
+    size_t want = events ? events : TRACE_EVENTS;
+    while (n < want && n < (1u << 20)) {
+        n <<= 1;
+    }
+    s_ring = calloc(n, sizeof(*s_ring));
+    if (!s_ring) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_mask = (uint32_t)n - 1;
+    atomic_store(&s_pos, 0);
+    atomic_store(&trace_on, true);
+    ESP_LOGI(TAG, "Tracing into %u events (%u bytes)", (unsigned)n, (unsigned)(n * sizeof(*s_ring)));
+    return ESP_OK;
+}
+
+void trace_stop(void) {
+    atomic_store(&trace_on, false);
+}
+
+/* Tasks with a track of their own in a dump; any further ones share track TRACE_DUMP_TIDS + 1. */
+#define TRACE_DUMP_TIDS 32
+
+/*
+* Track number of a task in the dump, registering its name on first sight. *count goes one past TRACE_DUMP_TIDS
+* once the shared overflow track has been named.
+*/
+static int task_tid(FILE *f, TaskHandle_t *seen, int *count, TaskHandle_t task) {
+    for (int i = 0; i < *count && i < TRACE_DUMP_TIDS; i++) {
+        if (seen[i] == task) {
+            return i + 1;
+        }
+    }
+    int tid = *count + 1;
+    if (*count >= TRACE_DUMP_TIDS) {
+        tid = TRACE_DUMP_TIDS + 1;
+        if (*count == TRACE_DUMP_TIDS) {
+            (*count)++;
+            fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"other tasks\"}},\n", tid);
+        }
+        return tid;
+    }
+    seen[(*count)++] = task;
+    char name[24];
+    if (!metrics_task_name(task, name, sizeof(name))) {
+        if (task == xTaskGetCurrentTaskHandle()) {
+            strncpy(name, pcTaskGetName(NULL), sizeof(name) - 1);
+            name[sizeof(name) - 1] = '\0';
+        } else {
+            snprintf(name, sizeof(name), "task-%d", tid);
+        }
+    }
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", tid, name);
+    return tid;
+}
+
+esp_err_t trace_dump(const char *path) {
+    if (!path) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_ring) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bool was_on = atomic_exchange(&trace_on, false);
+    if (!metrics_lock_take(METRIC_SITE_TRACE, pdMS_TO_TICKS(5000))) {
+        atomic_store(&trace_on, was_on);
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_err_t err = ESP_OK;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        ESP_LOGE(TAG, "fopen(%s) failed", path);
+        err = ESP_FAIL;
+    } else {
+        uint32_t end = atomic_load(&s_pos);
+        uint32_t size = s_mask + 1;
+        uint32_t start = end > size ? end - size : 0;
+        TaskHandle_t seen[TRACE_DUMP_TIDS];
+        int count = 0;
+        int64_t now = esp_timer_get_time();
+        int64_t prev = 0;
+        bool first = true;
+
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+        for (uint32_t i = start; i != end; i++) {
+            const trace_rec_t *r = &s_ring[i & s_mask];
+            if (!r->name) {
+                continue;
+            }
+            /* Events are nearly in order, so a signed 32-bit step from the previous one unwraps the clock. */
+            int64_t ts = first ? now - (int32_t)((uint32_t)now - r->ts_us) : prev + (int32_t)(r->ts_us - (uint32_t)prev);
+            first = false;
+            prev = ts;
+            int tid = task_tid(f, seen, &count, r->task);
+            fprintf(f, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d", r->name, r->phase, (long long)ts, tid);
+            if (r->phase == 'B' && r->arg) {
+                fprintf(f, ",\"args\":{\"n\":%u}", (unsigned)r->arg);
+            }
+            fputs("},\n", f);
+        }
+        /* Closing metadata event: keeps the list free of a trailing comma. */
+        fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"sdcloud\"}}\n]}\n", f);
+        if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+            err = ESP_FAIL;
+        }
+        fclose(f);
+        ESP_LOGI(TAG, "Dumped %u events to %s", (unsigned)(end - start), path);
+    }
+    metrics_lock_give(METRIC_SITE_TRACE);
+    atomic_store(&trace_on, was_on);
+    return err;
+}
+
+typedef struct {
+    char path[128];
+    int  delay_ms;
+} dump_args_t;
+
+static void dump_task(void *arg) {
+    dump_args_t a = *(dump_args_t *)arg;
+    free(arg);
+    vTaskDelay(pdMS_TO_TICKS(a.delay_ms));
+    trace_dump(a.path);
+    vTaskDelete(NULL);
+}
+
+esp_err_t trace_dump_after(const char *path, int delay_ms) {
+    if (!path || delay_ms < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    dump_args_t *args = calloc(1, sizeof(*args));
+    if (!args) {
+        return ESP_ERR_NO_MEM;
+    }
+    strncpy(args->path, path, sizeof(args->path) - 1);
+    args->delay_ms = delay_ms;
+    if (xTaskCreate(dump_task, "trace_dump", 3072, args, 3, NULL) != pdPASS) {
+        free(args);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+* Event Tracing.
+* Hot paths record begin/end events into a fixed RAM ring; trace_dump() writes it as Chrome Trace Event JSON,
+* which Perfetto (ui.perfetto.dev) and chrome://tracing open directly. One track per task shows who held
+* spi_flash_lock while someone else waited.
+* While tracing is off an event costs one load and a branch. Build with SDCLOUD_TRACE=0 to remove the calls.
+* name must be a string literal (only the pointer is stored).
+*/
+#ifndef SDCLOUD_TRACE
+#define SDCLOUD_TRACE 1
+#endif
+
+/* Default ring size in events (16 bytes each on the ESP32). */
+#define TRACE_EVENTS 2048
+
+extern atomic_bool trace_on;
+
+void trace_record(const char *name, char phase, uint32_t arg);
+
+#if SDCLOUD_TRACE
+static inline void trace_event(const char *name, char phase, uint32_t arg) {
+    if (atomic_load_explicit(&trace_on, memory_order_relaxed)) {
+        trace_record(name, phase, arg);
+    }
+}
+#else
+static inline void trace_event(const char *name, char phase, uint32_t arg) {
+    (void)name;
+    (void)phase;
+    (void)arg;
+}
+#endif
+
+/* Begin / end a span on the calling task. arg is shown in the span's details (bytes, rows, ...). */
+#define TRACE_BEGIN(name, arg) trace_event((name), 'B', (uint32_t)(arg))
+#define TRACE_END(name)        trace_event((name), 'E', 0)
+
+/*
+* Allocate a ring of events entries (0: TRACE_EVENTS, rounded up to a power of two) and start recording.
+* When the ring is full the oldest events are overwritten.
+*/
+esp_err_t trace_start(size_t events);
+
+void trace_stop(void);
+
+/*
+* Write the ring to path as Chrome Trace Event JSON. Recording pauses while it runs. Takes spi_flash_lock.
+*/
+esp_err_t trace_dump(const char *path);
+
+/*
+* Dump to path once, delay_ms from now, from a short-lived task.
+*/
+esp_err_t trace_dump_after(const char *path, int delay_ms);
@@ -0,0 +1,304 @@
+#include "transfer.h"
+#include "page_write.h"
+#include "trace.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char *TAG = "transfer";
+
+/* A buffer on its way between the tasks. len 0 ends the stream, len < 0 reports a read error. */
+typedef struct {
+    uint8_t *data;
+    int32_t  len;
+} transfer_buf_t;
+
+typedef struct {
+    FILE          *in;
+    size_t         size;
+    QueueHandle_t  free_q;
+    QueueHandle_t  full_q;
+    SemaphoreHandle_t done;   /* Given by the reader once it no longer touches ctx or the queues. */
+    volatile bool  abort;
+} transfer_ctx_t;
+
+/* Reader Task: fill free buffers until EOF, a read error or an abort, then send the end marker. */
+static void reader_task(void *arg) {
+    transfer_ctx_t *ctx = (transfer_ctx_t *)arg;
+    SemaphoreHandle_t done = ctx->done;
+    transfer_buf_t b;
+    for (;;) {
+        xQueueReceive(ctx->free_q, &b, portMAX_DELAY);
+        if (ctx->abort) {
+            b.len = 0;
+        } else {
+            TRACE_BEGIN("sd.read", ctx->size);
+            size_t rd = fread(b.data, 1, ctx->size, ctx->in);
+            TRACE_END("sd.read");
+            b.len = rd > 0 ? (int32_t)rd : (ferror(ctx->in) ? -1 : 0);
+        }
+        xQueueSend(ctx->full_q, &b, portMAX_DELAY);
+        if (b.len <= 0) {
+            break;
+        }
+    }
+    /* ctx belongs to the caller, who may free it as soon as done is given. */
+    xSemaphoreGive(done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t transfer_file(const char *src, const char *dst, bool resume, const transfer_config_t *cfg, transfer_stats_t *stats) {
+    if (!src || !dst) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t count = (cfg && cfg->buffers >= 2) ? cfg->buffers : TRANSFER_BUFFERS;
+    size_t size = (cfg && cfg->buffer_size) ? cfg->buffer_size : TRANSFER_BUFFER_SIZE;
+    const io_lock_t *lock = cfg ? cfg->dst_lock : NULL;
+    int64_t t0 = esp_timer_get_time();
+
+    struct stat src_st;
+    if (stat(src, &src_st) != 0) {
+        ESP_LOGE(TAG, "stat(%s) failed: error=%d", src, errno);
+        return ESP_FAIL;
+    }
+    long start = 0;
+    struct stat dst_st;
+    if (resume && stat(dst, &dst_st) == 0 && dst_st.st_size <= src_st.st_size) {
+        start = (long)dst_st.st_size;
+    }
+    if (start > 0 && start == (long)src_st.st_size) {
+        ESP_LOGI(TAG, "%s already complete (%ld bytes)", dst, start);
+        return ESP_OK;
+    }
+
+    transfer_ctx_t ctx = { .size = size };
+    uint8_t *mem = malloc(count * size);
+    ctx.free_q = xQueueCreate(count, sizeof(transfer_buf_t));
+    ctx.full_q = xQueueCreate(count, sizeof(transfer_buf_t));
+    ctx.done = xSemaphoreCreateBinary();
+    ctx.in = fopen(src, "rb");
+    FILE *out = NULL;
+    esp_err_t err = ESP_OK;
+    if (!mem || !ctx.free_q || !ctx.full_q || !ctx.done) {
+        err = ESP_ERR_NO_MEM;
+    } else if (!ctx.in || (start > 0 && fseek(ctx.in, start, SEEK_SET) != 0)) {
+        ESP_LOGE(TAG, "fopen(%s) failed: error=%d", src, errno);
+        err = ESP_FAIL;
+    } else if (!lock || lock->take(lock->ctx)) {
+        out = fopen(dst, start > 0 ? "ab" : "wb");
+        if (out) {
+            /* Buffers go to flash as page_write() counts them; appends start from the real end. */
+            setvbuf(out, NULL, _IONBF, 0);
+            fseek(out, 0, SEEK_END);
+        }
+        if (lock) {
+            lock->give(lock->ctx);
+        }
+        if (!out) {
+            ESP_LOGE(TAG, "fopen(%s) for write failed: error=%d", dst, errno);
+            err = ESP_FAIL;
+        }
+    } else {
+        err = ESP_ERR_TIMEOUT;
+    }
+    if (err == ESP_OK) {
+        for (size_t i = 0; i < count; i++) {
+            transfer_buf_t b = { .data = mem + i * size };
+            xQueueSend(ctx.free_q, &b, 0);
+        }
+        if (xTaskCreate(reader_task, "transfer_reader", 3072, &ctx, 5, NULL) != pdPASS) {
+            err = ESP_FAIL;
+        }
+    }
+
+    uint64_t copied = 0;
+    if (err == ESP_OK) {
+        /* Writer: runs in the calling task until the reader's end marker arrives. */
+        for (;;) {
+            transfer_buf_t b;
+            int64_t w0 = esp_timer_get_time();
+            xQueueReceive(ctx.full_q, &b, portMAX_DELAY);
+            int64_t w1 = esp_timer_get_time();
+            if (b.len <= 0) {
+                if (b.len < 0 && err == ESP_OK) {
+                    ESP_LOGE(TAG, "Read error on %s", src);
+                    err = ESP_FAIL;
+                }
+                break;
+            }
+            if (err == ESP_OK) {
+                size_t wr = 0;
+                if (!lock || lock->take(lock->ctx)) {
+                    TRACE_BEGIN("transfer.write", b.len);
+                    wr = page_write(out, b.data, (size_t)b.len);
+                    TRACE_END("transfer.write");
+                    if (lock) {
+                        lock->give(lock->ctx);
+                    }
+                }
+                if (wr != (size_t)b.len) {
+                    ESP_LOGE(TAG, "Short write to %s (wrote %zu of %d)", dst, wr, (int)b.len);
+                    err = ESP_FAIL;
+                    ctx.abort = true;
+                }
+                copied += wr;
+            }
+            if (stats) {
+                stats->read_wait_us += w1 - w0;
+                stats->write_us += esp_timer_get_time() - w1;
+            }
+            xQueueSend(ctx.free_q, &b, portMAX_DELAY);
+        }
+        xSemaphoreTake(ctx.done, portMAX_DELAY);
+    }
+
+    if (out) {
+        if (!lock || lock->take(lock->ctx)) {
+            fflush(out);
+            fsync(fileno(out));
+            fclose(out);
+            if (lock) {
+                lock->give(lock->ctx);
+            }
+        } else {
+            fclose(out);
+        }
+    }
+    if (ctx.in) {
+        fclose(ctx.in);
+    }
+    if (ctx.free_q) {
+        vQueueDelete(ctx.free_q);
+    }
+    if (ctx.full_q) {
+        vQueueDelete(ctx.full_q);
+    }
+    if (ctx.done) {
+        vSemaphoreDelete(ctx.done);
+    }
+    free(mem);
+
+    int64_t us = esp_timer_get_time() - t0;
+    if (stats) {
+        stats->bytes += copied;
+        stats->files += err == ESP_OK;
+        stats->us += us;
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "%s -> %s: %llu bytes%s in %lld ms (%.1f KB/s)", src, dst, (unsigned long long)copied,
+                 start > 0 ? " (resumed)" : "", (long long)(us / 1000), us > 0 ? copied * 1e6 / 1024.0 / (double)us : 0.0);
+    }
+    return err;
+}
+
+/* Size recorded for name in the manifest, or -1. The last entry wins. */
+static long manifest_lookup(const char *manifest, const char *name) {
+    FILE *f = fopen(manifest, "r");
+    if (!f) {
+        return -1;
+    }
+    long found = -1;
+    char line[160];
+    while (fgets(line, sizeof(line), f)) {
+        long size;
+        int off = 0;
+        if (sscanf(line, "%ld %n", &size, &off) != 1 || off == 0) {
+            continue;
+        }
+        char *entry = line + off;
+        entry[strcspn(entry, "\r\n")] = '\0';
+        if (strcmp(entry, name) == 0) {
+            found = size;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+esp_err_t transfer_dir(const char *src_dir, const char *dst_dir, const transfer_config_t *cfg, transfer_stats_t *stats) {
+    if (!src_dir || !dst_dir) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    DIR *d = opendir(src_dir);
+    if (!d) {
+        ESP_LOGE(TAG, "opendir(%s) failed: error=%d", src_dir, errno);
+        return ESP_FAIL;
+    }
+    transfer_stats_t local = { 0 };
+    char manifest[160];
+    snprintf(manifest, sizeof(manifest), "%s/%s", dst_dir, TRANSFER_MANIFEST);
+    const io_lock_t *lock = cfg ? cfg->dst_lock : NULL;
+
+    esp_err_t err = ESP_OK;
+    struct dirent *e;
+    while (err == ESP_OK && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue; /* Hidden files, "._" resource forks, "." and "..". */
+        }
+        char src[160];
+        char dst[160];
+        if ((size_t)snprintf(src, sizeof(src), "%s/%s", src_dir, e->d_name) >= sizeof(src)
+            || (size_t)snprintf(dst, sizeof(dst), "%s/%s", dst_dir, e->d_name) >= sizeof(dst)) {
+            ESP_LOGW(TAG, "Skipping %s: path too long", e->d_name);
+            continue;
+        }
+        struct stat st;
+        if (stat(src, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        long done = manifest_lookup(manifest, e->d_name);
+        if (done == (long)st.st_size) {
+            local.skipped++;
+            continue;
+        }
+
+        /* Only a file without an entry was cut off mid-copy; a listed one has changed since and starts over. */
+        err = transfer_file(src, dst, done < 0, cfg, &local);
+        if (err != ESP_OK) {
+            break;
+        }
+        if (lock && !lock->take(lock->ctx)) {
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        FILE *m = fopen(manifest, "a");
+        if (m) {
+            fprintf(m, "%ld %s\n", (long)st.st_size, e->d_name);
+            fflush(m);
+            fsync(fileno(m));
+            fclose(m);
+        } else {
+            ESP_LOGW(TAG, "Could not update %s: %s would be copied again", manifest, e->d_name);
+        }
+        if (lock) {
+            lock->give(lock->ctx);
+        }
+    }
+    closedir(d);
+
+    ESP_LOGI(TAG, "Import %s -> %s: %u files, %u already done, %llu bytes in %lld ms (%.1f KB/s, reader-bound %lld ms)",
+             src_dir, dst_dir, (unsigned)local.files, (unsigned)local.skipped, (unsigned long long)local.bytes,
+             (long long)(local.us / 1000), local.us > 0 ? local.bytes * 1e6 / 1024.0 / (double)local.us : 0.0,
+             (long long)(local.read_wait_us / 1000));
+    if (stats) {
+        stats->bytes += local.bytes;
+        stats->files += local.files;
+        stats->skipped += local.skipped;
+        stats->us += local.us;
+        stats->read_wait_us += local.read_wait_us;
+        stats->write_us += local.write_us;
+    }
+    return err;
+}
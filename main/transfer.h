@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "io_lock.h"
+
+/* Defaults: two buffers is classic ping-pong; more smooths out SD latency spikes. */
+#define TRANSFER_BUFFERS      2
+#define TRANSFER_BUFFER_SIZE  8192
+
+/* Batch import manifest, written inside the destination directory. */
+#define TRANSFER_MANIFEST     "import.mf"
+
+typedef struct {
+    size_t            buffers;      /* Buffers in flight, >= 2 (0: TRANSFER_BUFFERS). */
+    size_t            buffer_size;  /* Bytes per buffer (0: TRANSFER_BUFFER_SIZE). */
+    const io_lock_t  *dst_lock;     /* Taken around each destination write when set (e.g. for spi_flash_lock). */
+} transfer_config_t;
+
+typedef struct {
+    uint64_t bytes;         /* Bytes copied (resumed bytes not included). */
+    uint32_t files;         /* Files copied or resumed. */
+    uint32_t skipped;       /* Files the import manifest already listed as done. */
+    int64_t  us;            /* Wall time. */
+    int64_t  read_wait_us;  /* Writer idle, waiting for the reader: the copy was read-bound for this long. */
+    int64_t  write_us;      /* Time spent in destination writes. */
+} transfer_stats_t;
+
+/*
+* Transfer Engine.
+* A reader task fills buffers from src while the calling task writes the previous ones to dst, so SD reads and
+* flash writes overlap. Buffers cycle between the two over a pair of queues.
+* With resume set and dst no longer than src, copying continues at dst's current size instead of starting over.
+* Has no SD/SPIFFS dependency so it can be benchmarked on a host. stats (optional) is accumulated into, not reset.
+*/
+esp_err_t transfer_file(const char *src, const char *dst, bool resume, const transfer_config_t *cfg, transfer_stats_t *stats);
+
+/*
+* Copy every regular file of src_dir into dst_dir. Each finished file is appended to dst_dir/TRANSFER_MANIFEST,
+* so an interrupted import skips what is done and resumes the file it stopped in. A listed file whose size has
+* changed since is copied again from the start.
+* Hidden and "._" resource-fork files are skipped.
+*/
+esp_err_t transfer_dir(const char *src_dir, const char *dst_dir, const transfer_config_t *cfg, transfer_stats_t *stats);